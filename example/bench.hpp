@@ -0,0 +1,288 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lockfree_queue.hpp"
+#include "ring_deque.hpp"
+#include "sql_text.hpp"
+namespace bench {
+/**
+ * @brief 连接池派发队列的竞争测试, 不需要数据库
+ * 1~32个生产者线程向同一个分片提交命令, 一个消费者线程(相当于分片的io线程)取出,
+ * 对比MpscRing与原先 mutex + std::deque<shared_ptr<SqlCmd>> 的吞吐
+ */
+struct BenchCmd {
+    std::size_t value_ = 0;
+};
+template <class Queue>
+static double run_dispatch(std::size_t producers, std::size_t per_producer) {
+    Queue queue;
+    std::atomic<bool> start{false};
+    std::vector<std::thread> threads;
+    for (std::size_t p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, &start, per_producer]() {
+            while (!start.load(std::memory_order_acquire)) {
+            }
+            for (std::size_t i = 0; i < per_producer; ++i) {
+                while (!queue.push(i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    auto total = producers * per_producer;
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    std::size_t consumed = 0;
+    while (consumed < total) {
+        if (!queue.pop()) {
+            std::this_thread::yield();
+            continue;
+        }
+        ++consumed;
+    }
+    auto end = std::chrono::steady_clock::now();
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto seconds = std::chrono::duration<double>(end - begin).count();
+    return total / seconds;
+}
+struct RingQueue {
+    db::MpscRing<std::unique_ptr<BenchCmd>> ring_{4096};
+    bool push(std::size_t value) {
+        auto cmd = std::make_unique<BenchCmd>();
+        cmd->value_ = value;
+        return ring_.try_push(std::move(cmd));
+    }
+    bool pop() {
+        std::unique_ptr<BenchCmd> cmd;
+        return ring_.try_pop(cmd);
+    }
+};
+struct MutexQueue {
+    std::mutex mutex_;
+    std::deque<std::shared_ptr<BenchCmd>> deque_;
+    bool push(std::size_t value) {
+        auto cmd = std::make_shared<BenchCmd>();
+        cmd->value_ = value;
+        std::lock_guard<std::mutex> locker(mutex_);
+        if (deque_.size() >= 4096) return false;
+        deque_.push_back(std::move(cmd));
+        return true;
+    }
+    bool pop() {
+        std::shared_ptr<BenchCmd> cmd;
+        {
+            std::lock_guard<std::mutex> locker(mutex_);
+            if (deque_.empty()) return false;
+            cmd = std::move(deque_.front());
+            deque_.pop_front();
+        }
+        return true;
+    }
+};
+static void dispatch_contention(std::size_t per_producer = 200000) {
+    std::cout << "producers\tmpsc_ring(ops/s)\tmutex_deque(ops/s)\n";
+    for (std::size_t producers = 1; producers <= 32; producers *= 2) {
+        auto ring = run_dispatch<RingQueue>(producers, per_producer);
+        auto mutex = run_dispatch<MutexQueue>(producers, per_producer);
+        std::cout << producers << "\t\t" << static_cast<std::size_t>(ring) << "\t\t" << static_cast<std::size_t>(mutex) << "\n";
+    }
+}
+
+/**
+ * @brief 事务命令队列每条语句的内存分配次数, 不需要数据库
+ * 用计数的全局operator new统计一个事务从创建到执行完n条语句的分配次数, 连接用只保存回调的FakeConnection代替;
+ * 对比原先 std::list<shared_ptr<SqlCmd>> 加两层包装lambda 的做法与 RingDeque 按值存放命令, 回调只捕获this 的做法
+ */
+inline std::atomic<std::size_t> allocation_count{0};
+
+using BenchResultCallback = std::function<void(const std::shared_ptr<void>&)>;
+using BenchErrorCallback = std::function<void(const std::exception_ptr&)>;
+struct FakeConnection {
+    db::SqlText sql_;
+    BenchResultCallback result_callback_;
+    BenchErrorCallback ec_callback_;
+    std::function<void()> complete_callback_;
+    bool is_working_ = false;
+
+    void execute_sql(db::SqlText&& sql, BenchResultCallback&& result_callback, BenchErrorCallback&& ec_callback) {
+        sql_ = std::move(sql);
+        result_callback_ = std::move(result_callback);
+        ec_callback_ = std::move(ec_callback);
+        is_working_ = true;
+    }
+    // same order as MysqlConnection: result callback, reset the callbacks, then the complete callback
+    void complete() {
+        result_callback_(nullptr);
+        result_callback_ = nullptr;
+        ec_callback_ = nullptr;
+        is_working_ = false;
+        complete_callback_();
+    }
+};
+struct ListTransaction : std::enable_shared_from_this<ListTransaction> {
+    struct Cmd {
+        db::SqlText sql_;
+        BenchResultCallback result_callback_;
+        BenchErrorCallback ec_callback_;
+        std::unique_ptr<std::string> infile_data_;
+        std::shared_ptr<ListTransaction> this_ptr_;
+    };
+    FakeConnection& conn_;
+    std::list<std::shared_ptr<Cmd>> buffer_;
+    bool is_working_ = false;
+
+    explicit ListTransaction(FakeConnection& conn) : conn_(conn) {}
+    void add(db::SqlText&& sql, BenchResultCallback&& rcb, BenchErrorCallback&& ecb) {
+        auto cmd = std::make_shared<Cmd>();
+        cmd->sql_ = std::move(sql);
+        cmd->result_callback_ = std::move(rcb);
+        cmd->ec_callback_ = std::move(ecb);
+        if (!is_working_) {
+            run(std::move(cmd));
+        } else {
+            cmd->this_ptr_ = shared_from_this();
+            buffer_.push_back(std::move(cmd));
+        }
+    }
+    void run(std::shared_ptr<Cmd>&& cmd) {
+        is_working_ = true;
+        auto this_ptr = shared_from_this();
+        auto result_index = std::make_shared<std::size_t>(0);
+        conn_.execute_sql(
+            std::move(cmd->sql_),
+            [cmd, this_ptr, result_index](const std::shared_ptr<void>& result) {
+                ++*result_index;
+                if (cmd->result_callback_) cmd->result_callback_(result);
+            },
+            [cmd, this_ptr, result_index](const std::exception_ptr& except) {
+                if (cmd->ec_callback_) cmd->ec_callback_(except);
+            });
+    }
+    void next() {
+        if (buffer_.empty()) {
+            is_working_ = false;
+            return;
+        }
+        auto cmd = std::move(buffer_.front());
+        buffer_.pop_front();
+        run(std::move(cmd));
+    }
+};
+struct RingTransaction : std::enable_shared_from_this<RingTransaction> {
+    struct Cmd {
+        db::SqlText sql_;
+        BenchResultCallback result_callback_;
+        BenchErrorCallback ec_callback_;
+        std::string infile_data_;
+        bool has_infile_ = false;
+    };
+    FakeConnection& conn_;
+    db::RingDeque<Cmd> buffer_;
+    Cmd current_;
+    std::size_t result_index_ = 0;
+    std::shared_ptr<RingTransaction> self_;
+    bool is_working_ = false;
+
+    explicit RingTransaction(FakeConnection& conn) : conn_(conn) {}
+    void add(db::SqlText&& sql, BenchResultCallback&& rcb, BenchErrorCallback&& ecb) {
+        Cmd cmd{std::move(sql), std::move(rcb), std::move(ecb)};
+        if (is_working_) {
+            buffer_.push_back(std::move(cmd));
+            return;
+        }
+        current_ = std::move(cmd);
+        run();
+    }
+    void run() {
+        is_working_ = true;
+        if (!self_) self_ = shared_from_this();
+        result_index_ = 0;
+        conn_.execute_sql(
+            std::move(current_.sql_), [this](const std::shared_ptr<void>& result) { on_result(result); },
+            [this](const std::exception_ptr& except) { on_error(except); });
+    }
+    void on_result(const std::shared_ptr<void>& result) {
+        ++result_index_;
+        if (current_.result_callback_) current_.result_callback_(result);
+    }
+    void on_error(const std::exception_ptr& except) {
+        if (current_.ec_callback_) current_.ec_callback_(except);
+    }
+    void next() {
+        auto self = std::move(self_);
+        current_ = Cmd();
+        if (buffer_.pop_front(current_)) {
+            self_ = std::move(self);
+            run();
+        } else {
+            is_working_ = false;
+        }
+    }
+};
+/**
+ * @brief 创建事务, 一次提交n条语句后逐条完成, 返回期间的分配次数
+ * 用户回调只捕获一个引用, 不会分配, 统计到的都是队列与包装本身的开销
+ */
+template <class Transaction>
+static std::size_t run_transaction(FakeConnection& conn, std::size_t statements, std::size_t& done) {
+    auto before = allocation_count.load(std::memory_order_relaxed);
+    {
+        auto trans = std::make_shared<Transaction>(conn);
+        std::weak_ptr<Transaction> weak_trans(trans);
+        conn.complete_callback_ = [weak_trans]() {
+            if (auto trans = weak_trans.lock()) trans->next();
+        };
+        for (std::size_t i = 0; i < statements; ++i) {
+            trans->add("insert into t values(1)", [&done](const std::shared_ptr<void>&) { ++done; }, [](const std::exception_ptr&) {});
+        }
+        while (conn.is_working_) {
+            conn.complete();
+        }
+    }
+    return allocation_count.load(std::memory_order_relaxed) - before;
+}
+static void transaction_queue_allocations(std::size_t transactions = 100000) {
+    FakeConnection conn;
+    std::size_t done = 0;
+    std::cout << "statements\tlist(allocs/stmt)\tring(allocs/stmt)\tlist(ns/stmt)\tring(ns/stmt)\n";
+    for (std::size_t statements : {1, 5, 20, 100}) {
+        auto list_allocs = run_transaction<ListTransaction>(conn, statements, done);
+        auto ring_allocs = run_transaction<RingTransaction>(conn, statements, done);
+        auto time = [&](auto run) {
+            auto begin = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < transactions / statements; ++i) run();
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            return static_cast<double>(elapsed) / (transactions / statements * statements);
+        };
+        auto list_ns = time([&]() { run_transaction<ListTransaction>(conn, statements, done); });
+        auto ring_ns = time([&]() { run_transaction<RingTransaction>(conn, statements, done); });
+        std::cout << statements << "\t\t" << static_cast<double>(list_allocs) / statements << "\t\t\t" << static_cast<double>(ring_allocs) / statements
+                  << "\t\t\t" << list_ns << "\t\t" << ring_ns << "\n";
+    }
+    conn.complete_callback_ = nullptr;
+}
+}  // namespace bench
+
+// counting allocator for transaction_queue_allocations, only main.cpp includes this header
+void* operator new(std::size_t size) {
+    bench::allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (auto ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
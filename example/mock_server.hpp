@@ -0,0 +1,1138 @@
+#pragma once
+
+#include <mariadb/mysql.h>
+#include <strings.h>
+
+#include <asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace mock {
+/**
+ * @brief 结果集的列, 数值与日期类型在预处理语句的结果中按二进制协议编码
+ */
+struct Column {
+    std::string name;
+    enum_field_types type = MYSQL_TYPE_VAR_STRING;
+    bool is_unsigned = false;
+};
+using Value = std::optional<std::string>;  //文本形式, 空为NULL
+using Row = std::vector<Value>;
+
+struct Error {
+    unsigned int code = 0;
+    std::string message;
+    std::string sql_state = "HY000";
+};
+/**
+ * @brief 一条语句返回的一个结果: 没有列时为OK包, 有error时为ERR包
+ */
+struct Result {
+    std::vector<Column> columns;
+    std::vector<Row> rows;
+    std::uint64_t affected_rows = 0;
+    std::uint64_t insert_id = 0;
+    std::optional<Error> error;
+};
+/**
+ * @brief 注入的故障
+ */
+enum class Fault {
+    None,
+    Close,  //不回复, 直接关闭连接
+    Hang,   //一直不回复, 直到被KILL QUERY/KILL
+};
+/**
+ * @brief 一条语句的回复
+ */
+struct Response {
+    std::vector<Result> results;  //多于一个时依次发送(multi-result, 例如CALL), 遇到错误即停止; 为空时回复OK
+    std::chrono::milliseconds delay{0};  //回复前等待, 期间可以被KILL QUERY中断
+    Fault fault = Fault::None;
+
+    static Response ok(std::uint64_t affected_rows = 0, std::uint64_t insert_id = 0) {
+        Response response;
+        response.results.push_back({{}, {}, affected_rows, insert_id, std::nullopt});
+        return response;
+    }
+    static Response rows(std::vector<Column> columns, std::vector<Row> rows) {
+        Response response;
+        response.results.push_back({std::move(columns), std::move(rows), 0, 0, std::nullopt});
+        return response;
+    }
+    static Response error(unsigned int code, std::string message, std::string sql_state = "HY000") {
+        Response response;
+        response.results.push_back({{}, {}, 0, 0, Error{code, std::move(message), std::move(sql_state)}});
+        return response;
+    }
+    static Response fail(Fault fault) {
+        Response response;
+        response.fault = fault;
+        return response;
+    }
+    Response& after(std::chrono::milliseconds wait) {
+        delay = wait;
+        return *this;
+    }
+};
+/**
+ * @brief 交给脚本的一条语句
+ * multi statement已经按';'拆开, 每条语句单独请求一次; 预处理语句的参数转成文本
+ */
+struct Request {
+    std::string_view sql;
+    std::vector<Value> params;
+    std::string_view infile_data;  //LOAD DATA LOCAL INFILE 收到的文件内容
+    std::uint32_t connection_id = 0;
+    bool is_prepare = false;  //COM_STMT_PREPARE只取第一个结果的列, 忽略错误, 延迟与故障
+};
+using Handler = std::function<Response(const Request&)>;
+
+namespace protocol {
+constexpr std::uint32_t client_long_password = 1;  //MariaDB客户端据此认为是MySQL服务端
+constexpr std::uint32_t client_found_rows = 2;
+constexpr std::uint32_t client_long_flag = 4;
+constexpr std::uint32_t client_connect_with_db = 8;
+constexpr std::uint32_t client_local_files = 128;
+constexpr std::uint32_t client_protocol_41 = 512;
+constexpr std::uint32_t client_transactions = 8192;
+constexpr std::uint32_t client_secure_connection = 32768;
+constexpr std::uint32_t client_multi_statements = 1u << 16;
+constexpr std::uint32_t client_multi_results = 1u << 17;
+constexpr std::uint32_t client_ps_multi_results = 1u << 18;
+constexpr std::uint32_t client_plugin_auth = 1u << 19;
+constexpr std::uint32_t client_connect_attrs = 1u << 20;
+constexpr std::uint32_t client_plugin_auth_lenenc_data = 1u << 21;
+// no SSL and no CLIENT_DEPRECATE_EOF, result sets end with classic EOF packets
+constexpr std::uint32_t server_capabilities = client_long_password | client_found_rows | client_long_flag | client_connect_with_db | client_local_files |
+                                              client_protocol_41 | client_transactions | client_secure_connection | client_multi_statements |
+                                              client_multi_results | client_ps_multi_results | client_plugin_auth | client_connect_attrs |
+                                              client_plugin_auth_lenenc_data;
+
+constexpr std::uint16_t status_in_trans = 0x0001;
+constexpr std::uint16_t status_autocommit = 0x0002;
+constexpr std::uint16_t status_more_results = 0x0008;
+
+constexpr std::uint16_t flag_unsigned = 32;
+constexpr std::uint16_t flag_binary = 128;
+constexpr std::uint16_t flag_num = 32768;
+
+constexpr std::uint8_t charset_utf8 = 33;
+constexpr std::uint8_t charset_binary = 63;
+constexpr std::size_t max_payload = 0xffffff;
+
+enum Command : std::uint8_t {
+    com_quit = 0x01,
+    com_init_db = 0x02,
+    com_query = 0x03,
+    com_ping = 0x0e,
+    com_stmt_prepare = 0x16,
+    com_stmt_execute = 0x17,
+    com_stmt_send_long_data = 0x18,
+    com_stmt_close = 0x19,
+    com_stmt_reset = 0x1a,
+    com_set_option = 0x1b,
+    com_reset_connection = 0x1f,
+};
+
+inline void put_int(std::string& out, std::uint64_t value, std::size_t bytes) {
+    for (std::size_t i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+inline void put_lenenc_int(std::string& out, std::uint64_t value) {
+    if (value < 251) {
+        put_int(out, value, 1);
+    } else if (value < (1u << 16)) {
+        out.push_back('\xfc');
+        put_int(out, value, 2);
+    } else if (value < (1u << 24)) {
+        out.push_back('\xfd');
+        put_int(out, value, 3);
+    } else {
+        out.push_back('\xfe');
+        put_int(out, value, 8);
+    }
+}
+inline void put_lenenc_str(std::string& out, std::string_view value) {
+    put_lenenc_int(out, value.size());
+    out.append(value);
+}
+
+/**
+ * @brief 按协议读取包的内容, 越界时ok()为false, 读到的值为0或空
+ */
+class Reader {
+   private:
+    std::string_view data_;
+    std::size_t pos_ = 0;
+    bool ok_ = true;
+
+   public:
+    explicit Reader(std::string_view data) : data_(data) {}
+    bool ok() const noexcept { return ok_; }
+    std::size_t remaining() const noexcept { return data_.size() - pos_; }
+
+    std::uint64_t int_n(std::size_t bytes) {
+        auto raw = this->bytes(bytes);
+        std::uint64_t value = 0;
+        for (std::size_t i = 0; i < raw.size(); ++i) {
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(raw[i])) << (8 * i);
+        }
+        return value;
+    }
+    std::uint64_t lenenc_int() {
+        auto first = int_n(1);
+        if (first == 0xfc) return int_n(2);
+        if (first == 0xfd) return int_n(3);
+        if (first == 0xfe) return int_n(8);
+        return first;
+    }
+    std::string_view bytes(std::size_t size) {
+        if (!ok_ || size > remaining()) {
+            ok_ = false;
+            return {};
+        }
+        auto value = data_.substr(pos_, size);
+        pos_ += size;
+        return value;
+    }
+    std::string_view lenenc_str() { return bytes(lenenc_int()); }
+    std::string_view null_str() {
+        auto end = data_.find('\0', pos_);
+        if (!ok_ || end == std::string_view::npos) {
+            ok_ = false;
+            return {};
+        }
+        auto value = data_.substr(pos_, end - pos_);
+        pos_ = end + 1;
+        return value;
+    }
+    std::string_view rest() { return bytes(remaining()); }
+};
+
+inline std::string_view trim(std::string_view text) {
+    auto begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string_view::npos) return {};
+    auto end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+inline bool starts_with_nocase(std::string_view text, std::string_view prefix) {
+    return text.size() >= prefix.size() && strncasecmp(text.data(), prefix.data(), prefix.size()) == 0;
+}
+/**
+ * @brief 按引号之外的';'拆分multi statement, 去掉首尾空白与空语句
+ */
+inline std::vector<std::string_view> split_statements(std::string_view text) {
+    std::vector<std::string_view> statements;
+    char quote = 0;
+    std::size_t start = 0;
+    for (std::size_t i = 0; i <= text.size(); ++i) {
+        char c = i < text.size() ? text[i] : ';';
+        if (quote) {
+            if (c == '\\' && quote != '`') {
+                ++i;
+            } else if (c == quote) {
+                quote = 0;
+            }
+        } else if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+        } else if (c == ';') {
+            auto statement = trim(text.substr(start, i - start));
+            if (!statement.empty()) statements.push_back(statement);
+            start = i + 1;
+        }
+    }
+    return statements;
+}
+inline std::size_t count_placeholders(std::string_view sql) {
+    std::size_t count = 0;
+    char quote = 0;
+    for (std::size_t i = 0; i < sql.size(); ++i) {
+        char c = sql[i];
+        if (quote) {
+            if (c == '\\' && quote != '`') {
+                ++i;
+            } else if (c == quote) {
+                quote = 0;
+            }
+        } else if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+        } else if (c == '?') {
+            ++count;
+        }
+    }
+    return count;
+}
+inline bool is_number_type(enum_field_types type) {
+    switch (type) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_YEAR:
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_DECIMAL:
+        case MYSQL_TYPE_NEWDECIMAL:
+            return true;
+        default:
+            return false;
+    }
+}
+/**
+ * @brief 解析 "YYYY-MM-DD[ HH:MM:SS[.ffffff]]" 或 "[-]H:MM:SS[.ffffff]", 小数部分换算成微秒
+ */
+inline unsigned long parse_micros(const char* fraction) {
+    unsigned long micros = 0;
+    int digits = 0;
+    for (; *fraction >= '0' && *fraction <= '9' && digits < 6; ++fraction, ++digits) {
+        micros = micros * 10 + (*fraction - '0');
+    }
+    for (; digits < 6; ++digits) micros *= 10;
+    return micros;
+}
+/**
+ * @brief 把文本形式的值按列类型编码成二进制协议的值
+ */
+inline void put_binary_value(std::string& out, const Column& column, const std::string& text) {
+    auto as_int = [&]() {
+        return column.is_unsigned ? std::strtoull(text.c_str(), nullptr, 10) : static_cast<std::uint64_t>(std::strtoll(text.c_str(), nullptr, 10));
+    };
+    switch (column.type) {
+        case MYSQL_TYPE_TINY:
+            put_int(out, as_int(), 1);
+            break;
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_YEAR:
+            put_int(out, as_int(), 2);
+            break;
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_INT24:
+            put_int(out, as_int(), 4);
+            break;
+        case MYSQL_TYPE_LONGLONG:
+            put_int(out, as_int(), 8);
+            break;
+        case MYSQL_TYPE_FLOAT: {
+            float value = std::strtof(text.c_str(), nullptr);
+            std::uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            put_int(out, bits, 4);
+            break;
+        }
+        case MYSQL_TYPE_DOUBLE: {
+            double value = std::strtod(text.c_str(), nullptr);
+            std::uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            put_int(out, bits, 8);
+            break;
+        }
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP: {
+            int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+            std::sscanf(text.c_str(), "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second);
+            auto dot = text.find('.');
+            auto micros = dot == std::string::npos ? 0 : parse_micros(text.c_str() + dot + 1);
+            std::uint8_t length = micros ? 11 : (hour || minute || second) ? 7 : 4;
+            put_int(out, length, 1);
+            put_int(out, year, 2);
+            put_int(out, month, 1);
+            put_int(out, day, 1);
+            if (length >= 7) {
+                put_int(out, hour, 1);
+                put_int(out, minute, 1);
+                put_int(out, second, 1);
+            }
+            if (length == 11) put_int(out, micros, 4);
+            break;
+        }
+        case MYSQL_TYPE_TIME: {
+            bool is_negative = !text.empty() && text[0] == '-';
+            int hours = 0, minute = 0, second = 0;
+            std::sscanf(text.c_str() + (is_negative ? 1 : 0), "%d:%d:%d", &hours, &minute, &second);
+            auto dot = text.find('.');
+            auto micros = dot == std::string::npos ? 0 : parse_micros(text.c_str() + dot + 1);
+            std::uint8_t length = micros ? 12 : (hours || minute || second) ? 8 : 0;
+            put_int(out, length, 1);
+            if (length) {
+                put_int(out, is_negative, 1);
+                put_int(out, hours / 24, 4);
+                put_int(out, hours % 24, 1);
+                put_int(out, minute, 1);
+                put_int(out, second, 1);
+            }
+            if (length == 12) put_int(out, micros, 4);
+            break;
+        }
+        default:
+            put_lenenc_str(out, text);
+            break;
+    }
+}
+/**
+ * @brief 读取 COM_STMT_EXECUTE 中的一个参数, 转成文本形式
+ *
+ * @param reader
+ * @param type 客户端发送的类型, 高字节的0x80表示无符号
+ */
+inline std::string read_binary_param(Reader& reader, std::uint16_t type) {
+    bool is_unsigned = type & 0x8000;
+    auto as_text = [&](std::size_t bytes) {
+        auto value = reader.int_n(bytes);
+        if (is_unsigned) return std::to_string(value);
+        // sign extend
+        auto shift = 64 - 8 * bytes;
+        return std::to_string(static_cast<std::int64_t>(value << shift) >> shift);
+    };
+    char buffer[64];
+    switch (static_cast<enum_field_types>(type & 0xff)) {
+        case MYSQL_TYPE_TINY:
+            return as_text(1);
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_YEAR:
+            return as_text(2);
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_INT24:
+            return as_text(4);
+        case MYSQL_TYPE_LONGLONG:
+            return as_text(8);
+        case MYSQL_TYPE_FLOAT: {
+            auto bits = static_cast<std::uint32_t>(reader.int_n(4));
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+            return buffer;
+        }
+        case MYSQL_TYPE_DOUBLE: {
+            auto bits = reader.int_n(8);
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+            return buffer;
+        }
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP: {
+            Reader value(reader.bytes(reader.int_n(1)));
+            auto year = value.int_n(2);
+            auto month = value.int_n(1);
+            auto day = value.int_n(1);
+            auto hour = value.int_n(1);
+            auto minute = value.int_n(1);
+            auto second = value.int_n(1);
+            auto micros = value.int_n(4);
+            std::snprintf(buffer, sizeof(buffer), "%04llu-%02llu-%02llu %02llu:%02llu:%02llu.%06llu", (unsigned long long)year, (unsigned long long)month,
+                          (unsigned long long)day, (unsigned long long)hour, (unsigned long long)minute, (unsigned long long)second,
+                          (unsigned long long)micros);
+            return buffer;
+        }
+        case MYSQL_TYPE_TIME: {
+            Reader value(reader.bytes(reader.int_n(1)));
+            auto is_negative = value.int_n(1);
+            auto days = value.int_n(4);
+            auto hour = value.int_n(1);
+            auto minute = value.int_n(1);
+            auto second = value.int_n(1);
+            auto micros = value.int_n(4);
+            std::snprintf(buffer, sizeof(buffer), "%s%02llu:%02llu:%02llu.%06llu", is_negative ? "-" : "", (unsigned long long)(days * 24 + hour),
+                          (unsigned long long)minute, (unsigned long long)second, (unsigned long long)micros);
+            return buffer;
+        }
+        default:
+            return std::string(reader.lenenc_str());
+    }
+}
+}  // namespace protocol
+
+class MockServer;
+/**
+ * @brief 服务端的一个连接, 协程按顺序处理命令
+ */
+class Session : public std::enable_shared_from_this<Session> {
+   private:
+    struct Statement {
+        std::string sql_;
+        std::size_t param_count_ = 0;
+        std::vector<std::uint16_t> types_;  //上一次执行时绑定的参数类型
+        std::vector<std::optional<std::string>> long_data_;
+    };
+
+    MockServer& server_;
+    asio::ip::tcp::socket socket_;
+    asio::steady_timer delay_timer_;
+    std::uint32_t id_;
+    std::uint8_t seq_ = 0;
+    std::uint32_t capabilities_ = 0;
+    std::uint16_t status_ = protocol::status_autocommit;
+    bool is_killed_ = false;
+    std::string out_;
+    std::unordered_map<std::uint32_t, Statement> statements_;
+    std::uint32_t next_statement_id_ = 1;
+
+   public:
+    Session(MockServer& server, asio::ip::tcp::socket&& socket, std::uint32_t id)
+        : server_(server), socket_(std::move(socket)), delay_timer_(socket_.get_executor()), id_(id) {}
+
+    std::uint32_t id() const noexcept { return id_; }
+    asio::awaitable<void> run();
+    /**
+     * @brief KILL QUERY: 正在等待的语句以 ER_QUERY_INTERRUPTED 失败
+     */
+    void interrupt() {
+        is_killed_ = true;
+        delay_timer_.cancel();
+    }
+    void close() {
+        asio::error_code ignored;
+        socket_.close(ignored);
+        delay_timer_.cancel();
+    }
+
+   private:
+    static constexpr const char* scramble = "mock-scramble-012345";  //20字节, 不校验密码
+
+    asio::awaitable<std::string> read_packet() {
+        std::string payload;
+        for (;;) {
+            unsigned char header[4];
+            co_await asio::async_read(socket_, asio::buffer(header), asio::use_awaitable);
+            std::size_t size = header[0] | (header[1] << 8) | (header[2] << 16);
+            seq_ = static_cast<std::uint8_t>(header[3] + 1);
+            auto offset = payload.size();
+            payload.resize(offset + size);
+            if (size) co_await asio::async_read(socket_, asio::buffer(payload.data() + offset, size), asio::use_awaitable);
+            if (size < protocol::max_payload) co_return payload;
+        }
+    }
+    void write_packet(std::string_view payload) {
+        // payloads of 16MB and more are split, an exact multiple ends with an empty packet
+        for (;;) {
+            auto size = std::min(payload.size(), protocol::max_payload);
+            protocol::put_int(out_, size, 3);
+            out_.push_back(static_cast<char>(seq_++));
+            out_.append(payload.substr(0, size));
+            payload.remove_prefix(size);
+            if (size < protocol::max_payload) break;
+        }
+    }
+    asio::awaitable<void> flush() {
+        if (out_.empty()) co_return;
+        co_await asio::async_write(socket_, asio::buffer(out_), asio::use_awaitable);
+        out_.clear();
+    }
+
+    void write_ok(std::uint64_t affected_rows, std::uint64_t insert_id, std::uint16_t status) {
+        std::string payload(1, '\0');
+        protocol::put_lenenc_int(payload, affected_rows);
+        protocol::put_lenenc_int(payload, insert_id);
+        protocol::put_int(payload, status, 2);
+        protocol::put_int(payload, 0, 2);
+        write_packet(payload);
+    }
+    void write_eof(std::uint16_t status) {
+        std::string payload(1, '\xfe');
+        protocol::put_int(payload, 0, 2);
+        protocol::put_int(payload, status, 2);
+        write_packet(payload);
+    }
+    void write_error(const Error& error) {
+        std::string payload(1, '\xff');
+        protocol::put_int(payload, error.code, 2);
+        payload.push_back('#');
+        auto sql_state = error.sql_state;
+        sql_state.resize(5, '0');
+        payload.append(sql_state);
+        payload.append(error.message);
+        write_packet(payload);
+    }
+    void write_column(const Column& column, std::size_t max_length) {
+        bool is_number = protocol::is_number_type(column.type);
+        std::string payload;
+        protocol::put_lenenc_str(payload, "def");
+        protocol::put_lenenc_str(payload, "");
+        protocol::put_lenenc_str(payload, "");
+        protocol::put_lenenc_str(payload, "");
+        protocol::put_lenenc_str(payload, column.name);
+        protocol::put_lenenc_str(payload, column.name);
+        protocol::put_lenenc_int(payload, 0x0c);
+        protocol::put_int(payload, is_number ? protocol::charset_binary : protocol::charset_utf8, 2);
+        protocol::put_int(payload, std::max<std::size_t>(max_length, is_number ? 20 : 255), 4);
+        protocol::put_int(payload, column.type, 1);
+        std::uint16_t flags = (is_number ? protocol::flag_num | protocol::flag_binary : 0) | (column.is_unsigned ? protocol::flag_unsigned : 0);
+        protocol::put_int(payload, flags, 2);
+        protocol::put_int(payload, column.type == MYSQL_TYPE_FLOAT || column.type == MYSQL_TYPE_DOUBLE ? 31 : 0, 1);
+        protocol::put_int(payload, 0, 2);
+        write_packet(payload);
+    }
+    void write_columns(const std::vector<Column>& columns, const std::vector<Row>& rows) {
+        for (std::size_t i = 0; i < columns.size(); ++i) {
+            std::size_t max_length = 0;
+            for (auto& row : rows) {
+                if (i < row.size() && row[i]) max_length = std::max(max_length, row[i]->size());
+            }
+            write_column(columns[i], max_length);
+        }
+        write_eof(status_);
+    }
+    void write_result(const Result& result, bool is_binary, std::uint16_t status) {
+        if (result.columns.empty()) {
+            write_ok(result.affected_rows, result.insert_id, status);
+            return;
+        }
+        std::string payload;
+        protocol::put_lenenc_int(payload, result.columns.size());
+        write_packet(payload);
+        write_columns(result.columns, result.rows);
+        for (auto& row : result.rows) {
+            payload.clear();
+            if (is_binary) {
+                payload.push_back('\0');
+                auto bitmap = payload.size();
+                payload.append((result.columns.size() + 7 + 2) / 8, '\0');
+                for (std::size_t i = 0; i < result.columns.size(); ++i) {
+                    if (i >= row.size() || !row[i]) {
+                        payload[bitmap + (i + 2) / 8] |= static_cast<char>(1 << ((i + 2) % 8));
+                    } else {
+                        protocol::put_binary_value(payload, result.columns[i], *row[i]);
+                    }
+                }
+            } else {
+                for (std::size_t i = 0; i < result.columns.size(); ++i) {
+                    if (i >= row.size() || !row[i]) {
+                        payload.push_back('\xfb');
+                    } else {
+                        protocol::put_lenenc_str(payload, *row[i]);
+                    }
+                }
+            }
+            write_packet(payload);
+        }
+        write_eof(status);
+    }
+
+    asio::awaitable<bool> handshake();
+    asio::awaitable<bool> respond(Request& request, bool is_binary, bool is_last);
+    asio::awaitable<void> handle_query(std::string_view text);
+    void handle_prepare(std::string_view sql);
+    asio::awaitable<void> handle_execute(std::string_view packet);
+    void track_transaction(std::string_view sql) {
+        if (starts_with_keyword(sql, "begin") || starts_with_keyword(sql, "start transaction")) {
+            status_ |= protocol::status_in_trans;
+        } else if (starts_with_keyword(sql, "commit") || (starts_with_keyword(sql, "rollback") && !protocol::starts_with_nocase(sql, "rollback to"))) {
+            status_ &= ~protocol::status_in_trans;
+        }
+    }
+    static bool starts_with_keyword(std::string_view sql, std::string_view keyword) {
+        return protocol::starts_with_nocase(sql, keyword) && (sql.size() == keyword.size() || !isalnum(static_cast<unsigned char>(sql[keyword.size()])));
+    }
+};
+
+/**
+ * @brief 进程内的MySQL协议模拟服务端, 用于不依赖真实数据库的测试与压测
+ * 支持握手(mysql_native_password, 不校验密码), COM_QUERY(含multi statement与multi-result), COM_STMT_PREPARE/EXECUTE/CLOSE/RESET/SEND_LONG_DATA,
+ * COM_PING, LOAD DATA LOCAL INFILE, KILL [QUERY]; 回复由按前缀匹配的脚本决定, 可以注入延迟, 断开与挂起等故障
+ * 在自己的线程上运行单线程的io_context, 脚本也在这个线程上调用
+ */
+class MockServer {
+   private:
+    asio::io_context io_context_;
+    asio::ip::tcp::acceptor acceptor_;
+    std::thread thread_;
+
+    std::mutex mutex_;
+    std::condition_variable history_cond_;  //history_增加时通知, 见 wait_for
+    std::vector<std::pair<std::string, Handler>> rules_;
+    Handler default_handler_;
+    std::vector<std::string> history_;
+    std::vector<std::string> packets_;  //COM_QUERY的原文, multi statement不拆开
+    bool is_recording_ = true;
+
+    std::atomic<std::int64_t> latency_ms_{0};
+    std::atomic<std::size_t> accepted_{0};
+    std::atomic<std::size_t> statements_{0};
+    std::uint32_t next_connection_id_ = 1;
+    std::unordered_map<std::uint32_t, std::weak_ptr<Session>> sessions_;  //只在io线程上访问
+
+   public:
+    /**
+     * @brief 在127.0.0.1上监听
+     *
+     * @param port 0为由系统分配, 通过 port() 获取
+     */
+    explicit MockServer(unsigned short port = 0) : acceptor_(io_context_, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port)) {
+        default_handler_ = [](const Request& request) {
+            // LOAD DATA reports one affected row per line
+            std::size_t lines = 0;
+            for (auto c : request.infile_data) lines += c == '\n';
+            return Response::ok(lines);
+        };
+    }
+    MockServer(const MockServer&) = delete;
+    MockServer& operator=(const MockServer&) = delete;
+    ~MockServer() { stop(); }
+
+    void start() {
+        asio::co_spawn(io_context_, accept(), asio::detached);
+        thread_ = std::thread([this]() { io_context_.run(); });
+    }
+    void stop() {
+        if (!thread_.joinable()) return;
+        asio::post(io_context_, [this]() {
+            asio::error_code ignored;
+            acceptor_.close(ignored);
+            for (auto& [id, weak_session] : sessions_) {
+                if (auto session = weak_session.lock()) session->close();
+            }
+        });
+        io_context_.stop();
+        thread_.join();
+    }
+    unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+    /**
+     * @brief 以prefix开头(忽略大小写与首尾空白)的语句由handler回复, 后添加的规则优先
+     *
+     * @param prefix
+     * @param handler
+     */
+    void on(std::string prefix, Handler handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rules_.emplace_back(std::move(prefix), std::move(handler));
+    }
+    void on(std::string prefix, Response response) {
+        on(std::move(prefix), [response = std::move(response)](const Request&) { return response; });
+    }
+    /**
+     * @brief 没有规则匹配时的回复, 默认为OK
+     */
+    void set_default(Handler handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        default_handler_ = std::move(handler);
+    }
+    void clear_rules() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rules_.clear();
+    }
+    /**
+     * @brief 每条语句额外的回复延迟
+     */
+    void set_latency(std::chrono::milliseconds latency) { latency_ms_.store(latency.count(), std::memory_order_relaxed); }
+    std::chrono::milliseconds latency() const { return std::chrono::milliseconds(latency_ms_.load(std::memory_order_relaxed)); }
+    /**
+     * @brief 断开所有已建立的连接, 模拟服务端重启
+     */
+    void drop_connections() {
+        asio::post(io_context_, [this]() {
+            for (auto& [id, weak_session] : sessions_) {
+                if (auto session = weak_session.lock()) session->close();
+            }
+        });
+    }
+    /**
+     * @brief 收到的语句(multi statement拆开后), 按到达顺序; 预处理语句在prepare与每次执行时各记录一次
+     */
+    std::vector<std::string> history() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return history_;
+    }
+    /**
+     * @brief 收到的COM_QUERY包的原文, 按到达顺序, 用于确认几条语句是否合并在一个包中发送
+     */
+    std::vector<std::string> query_packets() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return packets_;
+    }
+    void clear_history() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        history_.clear();
+        packets_.clear();
+    }
+    /**
+     * @brief 等待以prefix开头(忽略大小写)的语句出现在history中, 超时返回false
+     *
+     * @param prefix
+     * @param timeout
+     * @return bool
+     */
+    bool wait_for(std::string_view prefix, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return history_cond_.wait_for(lock, timeout, [this, prefix]() {
+            for (auto& sql : history_) {
+                if (protocol::starts_with_nocase(sql, prefix)) return true;
+            }
+            return false;
+        });
+    }
+    /**
+     * @brief 压测时关闭记录, 避免history无限增长
+     */
+    void set_recording(bool is_recording) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_recording_ = is_recording;
+    }
+    std::size_t accepted_connections() const noexcept { return accepted_.load(std::memory_order_relaxed); }
+    std::size_t statement_count() const noexcept { return statements_.load(std::memory_order_relaxed); }
+
+   private:
+    friend class Session;
+
+    asio::awaitable<void> accept() {
+        for (;;) {
+            auto socket = co_await acceptor_.async_accept(asio::use_awaitable);
+            socket.set_option(asio::ip::tcp::no_delay(true));
+            auto id = next_connection_id_++;
+            auto session = std::make_shared<Session>(*this, std::move(socket), id);
+            sessions_[id] = session;
+            accepted_.fetch_add(1, std::memory_order_relaxed);
+            asio::co_spawn(io_context_, session->run(), [this, session](std::exception_ptr) { sessions_.erase(session->id()); });
+        }
+    }
+    void record_packet(std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (is_recording_) packets_.emplace_back(text);
+    }
+    Response respond(const Request& request) {
+        statements_.fetch_add(1, std::memory_order_relaxed);
+        Handler handler;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (is_recording_) {
+                history_.emplace_back(request.sql);
+                history_cond_.notify_all();
+            }
+            for (auto iter = rules_.rbegin(); iter != rules_.rend(); ++iter) {
+                if (protocol::starts_with_nocase(request.sql, iter->first)) {
+                    handler = iter->second;
+                    break;
+                }
+            }
+            if (!handler) handler = default_handler_;
+        }
+        return handler(request);
+    }
+    /**
+     * @brief 处理 KILL [QUERY|CONNECTION] id, 不是KILL语句时返回false
+     */
+    bool kill(std::string_view sql) {
+        if (!protocol::starts_with_nocase(sql, "kill ")) return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (is_recording_) {
+                history_.emplace_back(sql);
+                history_cond_.notify_all();
+            }
+        }
+        auto rest = protocol::trim(sql.substr(5));
+        bool is_query = protocol::starts_with_nocase(rest, "query ");
+        if (is_query) rest = protocol::trim(rest.substr(6));
+        if (protocol::starts_with_nocase(rest, "connection ")) rest = protocol::trim(rest.substr(11));
+        auto iter = sessions_.find(static_cast<std::uint32_t>(std::strtoul(std::string(rest).c_str(), nullptr, 10)));
+        if (iter != sessions_.end()) {
+            if (auto session = iter->second.lock()) {
+                if (is_query) {
+                    session->interrupt();
+                } else {
+                    session->close();
+                }
+            }
+        }
+        return true;
+    }
+};
+
+inline asio::awaitable<void> Session::run() {
+    auto self = shared_from_this();
+    if (!co_await handshake()) co_return;
+    for (;;) {
+        auto packet = co_await read_packet();
+        if (packet.empty()) co_return;
+        protocol::Reader reader(packet);
+        auto command = static_cast<std::uint8_t>(packet[0]);
+        switch (command) {
+            case protocol::com_quit:
+                close();
+                co_return;
+            case protocol::com_query:
+                co_await handle_query(std::string_view(packet).substr(1));
+                break;
+            case protocol::com_stmt_prepare:
+                handle_prepare(protocol::trim(std::string_view(packet).substr(1)));
+                break;
+            case protocol::com_stmt_execute:
+                co_await handle_execute(packet);
+                break;
+            case protocol::com_stmt_send_long_data: {
+                reader.int_n(1);
+                auto iter = statements_.find(static_cast<std::uint32_t>(reader.int_n(4)));
+                auto param = reader.int_n(2);
+                auto data = reader.rest();
+                if (iter != statements_.end() && param < iter->second.long_data_.size()) {
+                    auto& value = iter->second.long_data_[param];
+                    if (!value) value.emplace();
+                    value->append(data);
+                }
+                // no reply
+                continue;
+            }
+            case protocol::com_stmt_close:
+                reader.int_n(1);
+                statements_.erase(static_cast<std::uint32_t>(reader.int_n(4)));
+                continue;
+            case protocol::com_stmt_reset: {
+                reader.int_n(1);
+                auto iter = statements_.find(static_cast<std::uint32_t>(reader.int_n(4)));
+                if (iter == statements_.end()) {
+                    write_error({1243, "Unknown prepared statement handler", "HY000"});
+                    break;
+                }
+                for (auto& value : iter->second.long_data_) value.reset();
+                write_ok(0, 0, status_);
+                break;
+            }
+            case protocol::com_set_option:
+                reader.int_n(1);
+                // 0: MYSQL_OPTION_MULTI_STATEMENTS_ON, 1: OFF
+                if (reader.int_n(2) == 0) {
+                    capabilities_ |= protocol::client_multi_statements;
+                } else {
+                    capabilities_ &= ~protocol::client_multi_statements;
+                }
+                write_eof(status_);
+                break;
+            case protocol::com_reset_connection:
+                statements_.clear();
+                status_ = protocol::status_autocommit;
+                write_ok(0, 0, status_);
+                break;
+            case protocol::com_ping:
+            case protocol::com_init_db:
+                write_ok(0, 0, status_);
+                break;
+            default:
+                write_error({1047, "Unknown command", "08S01"});
+                break;
+        }
+        if (!socket_.is_open()) co_return;
+        co_await flush();
+    }
+}
+inline asio::awaitable<bool> Session::handshake() {
+    std::string payload(1, '\x0a');
+    payload.append("5.7.99-mock");
+    payload.push_back('\0');
+    protocol::put_int(payload, id_, 4);
+    payload.append(scramble, 8);
+    payload.push_back('\0');
+    protocol::put_int(payload, protocol::server_capabilities & 0xffff, 2);
+    protocol::put_int(payload, protocol::charset_utf8, 1);
+    protocol::put_int(payload, status_, 2);
+    protocol::put_int(payload, protocol::server_capabilities >> 16, 2);
+    protocol::put_int(payload, 21, 1);
+    payload.append(10, '\0');
+    payload.append(scramble + 8, 12);
+    payload.push_back('\0');
+    payload.append("mysql_native_password");
+    payload.push_back('\0');
+    seq_ = 0;
+    write_packet(payload);
+    co_await flush();
+
+    auto response = co_await read_packet();
+    protocol::Reader reader(response);
+    capabilities_ = static_cast<std::uint32_t>(reader.int_n(4)) & protocol::server_capabilities;
+    reader.bytes(4 + 1 + 23);
+    reader.null_str();  // user
+    if (capabilities_ & protocol::client_plugin_auth_lenenc_data) {
+        reader.lenenc_str();
+    } else if (capabilities_ & protocol::client_secure_connection) {
+        reader.bytes(reader.int_n(1));
+    } else {
+        reader.null_str();
+    }
+    if (!reader.ok() || !(capabilities_ & protocol::client_protocol_41)) {
+        write_error({1043, "Bad handshake", "08S01"});
+        co_await flush();
+        close();
+        co_return false;
+    }
+    write_ok(0, 0, status_);
+    co_await flush();
+    co_return true;
+}
+/**
+ * @brief 回复一条语句, 语句出错或连接被关闭时返回false, multi statement中之后的语句不再执行
+ *
+ * @param request
+ * @param is_binary 预处理语句的结果按二进制协议发送
+ * @param is_last 是否是这个命令的最后一条语句, 之前的结果都带 SERVER_MORE_RESULTS_EXIST
+ */
+inline asio::awaitable<bool> Session::respond(Request& request, bool is_binary, bool is_last) {
+    if (server_.kill(request.sql)) {
+        write_ok(0, 0, status_ | (is_last ? 0 : protocol::status_more_results));
+        co_return true;
+    }
+    std::string infile_data;
+    if (protocol::starts_with_nocase(request.sql, "load data local infile")) {
+        if (!(capabilities_ & protocol::client_local_files)) {
+            write_error({1148, "The used command is not allowed with this MySQL version", "42000"});
+            co_return false;
+        }
+        // ask for the file named in the statement, the client sends its content and an empty packet
+        std::string file_name;
+        auto quote = request.sql.find_first_of("'\"", 22);
+        if (quote != std::string_view::npos) {
+            auto end = request.sql.find(request.sql[quote], quote + 1);
+            file_name = request.sql.substr(quote + 1, end == std::string_view::npos ? std::string_view::npos : end - quote - 1);
+        }
+        write_packet("\xfb" + file_name);
+        co_await flush();
+        for (;;) {
+            auto chunk = co_await read_packet();
+            if (chunk.empty()) break;
+            infile_data.append(chunk);
+        }
+        request.infile_data = infile_data;
+    }
+    auto response = server_.respond(request);
+    auto delay = response.delay + server_.latency();
+    if (response.fault == Fault::Hang || delay.count() > 0) {
+        // results of earlier statements reach the client before the wait
+        co_await flush();
+        if (response.fault == Fault::Hang) {
+            delay_timer_.expires_at(asio::steady_timer::time_point::max());
+        } else {
+            delay_timer_.expires_after(delay);
+        }
+        asio::error_code ec;
+        co_await delay_timer_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        if (!socket_.is_open()) co_return false;
+        if (is_killed_) {
+            is_killed_ = false;
+            write_error({1317, "Query execution was interrupted", "70100"});
+            co_return false;
+        }
+    }
+    if (response.fault == Fault::Close) {
+        close();
+        co_return false;
+    }
+    track_transaction(request.sql);
+    if (response.results.empty()) {
+        write_ok(0, 0, status_ | (is_last ? 0 : protocol::status_more_results));
+        co_return true;
+    }
+    for (std::size_t i = 0; i < response.results.size(); ++i) {
+        auto& result = response.results[i];
+        if (result.error) {
+            write_error(*result.error);
+            co_return false;
+        }
+        bool has_more = !is_last || i + 1 < response.results.size();
+        write_result(result, is_binary, status_ | (has_more ? protocol::status_more_results : 0));
+    }
+    co_return true;
+}
+inline asio::awaitable<void> Session::handle_query(std::string_view text) {
+    server_.record_packet(text);
+    std::vector<std::string_view> statements;
+    if (capabilities_ & protocol::client_multi_statements) {
+        statements = protocol::split_statements(text);
+    } else if (!protocol::trim(text).empty()) {
+        statements.push_back(protocol::trim(text));
+    }
+    if (statements.empty()) {
+        write_error({1065, "Query was empty", "42000"});
+        co_return;
+    }
+    for (std::size_t i = 0; i < statements.size(); ++i) {
+        Request request;
+        request.sql = statements[i];
+        request.connection_id = id_;
+        if (!co_await respond(request, false, i + 1 == statements.size())) break;
+    }
+}
+inline void Session::handle_prepare(std::string_view sql) {
+    Request request;
+    request.sql = sql;
+    request.connection_id = id_;
+    request.is_prepare = true;
+    auto response = server_.respond(request);
+    std::vector<Column> columns;
+    if (!response.results.empty() && !response.results[0].error) columns = response.results[0].columns;
+
+    auto id = next_statement_id_++;
+    auto& statement = statements_[id];
+    statement.sql_.assign(sql);
+    statement.param_count_ = protocol::count_placeholders(sql);
+    statement.long_data_.resize(statement.param_count_);
+
+    std::string payload(1, '\0');
+    protocol::put_int(payload, id, 4);
+    protocol::put_int(payload, columns.size(), 2);
+    protocol::put_int(payload, statement.param_count_, 2);
+    payload.push_back('\0');
+    protocol::put_int(payload, 0, 2);
+    write_packet(payload);
+    if (statement.param_count_) {
+        for (std::size_t i = 0; i < statement.param_count_; ++i) {
+            write_column({"?", MYSQL_TYPE_VAR_STRING, false}, 0);
+        }
+        write_eof(status_);
+    }
+    if (!columns.empty()) write_columns(columns, {});
+}
+inline asio::awaitable<void> Session::handle_execute(std::string_view packet) {
+    protocol::Reader reader(packet);
+    reader.int_n(1);
+    auto iter = statements_.find(static_cast<std::uint32_t>(reader.int_n(4)));
+    reader.int_n(1);  // cursor flags, cursors are not supported
+    reader.int_n(4);  // iteration count, always 1
+    if (iter == statements_.end()) {
+        write_error({1243, "Unknown prepared statement handler", "HY000"});
+        co_return;
+    }
+    auto& statement = iter->second;
+    Request request;
+    request.sql = statement.sql_;
+    request.connection_id = id_;
+    if (statement.param_count_) {
+        auto null_bitmap = reader.bytes((statement.param_count_ + 7) / 8);
+        if (reader.int_n(1)) {
+            statement.types_.resize(statement.param_count_);
+            for (auto& type : statement.types_) type = static_cast<std::uint16_t>(reader.int_n(2));
+        }
+        for (std::size_t i = 0; i < statement.param_count_; ++i) {
+            if (!null_bitmap.empty() && (static_cast<unsigned char>(null_bitmap[i / 8]) >> (i % 8)) & 1) {
+                request.params.emplace_back();
+            } else if (statement.long_data_[i]) {
+                request.params.emplace_back(std::move(statement.long_data_[i]));
+                statement.long_data_[i].reset();
+            } else {
+                request.params.emplace_back(protocol::read_binary_param(reader, i < statement.types_.size() ? statement.types_[i] : MYSQL_TYPE_VAR_STRING));
+            }
+        }
+        if (!reader.ok()) {
+            write_error({1835, "Malformed communication packet", "HY000"});
+            co_return;
+        }
+    }
+    co_await respond(request, true, true);
+}
+}  // namespace mock
@@ -1,8 +1,20 @@
 #pragma once
 
 #include "mysql_client.hpp"
+#include "mysql_cluster_client.hpp"
+#include "mock_server.hpp"
 using namespace std::chrono_literals;
 namespace test {
+struct UserRow {
+    std::string user;
+    std::string_view host;  //只在结果存活期间有效
+};
+}  // namespace test
+template <>
+struct db::RowMapping<test::UserRow> {
+    static constexpr auto columns = std::make_tuple(db::column("user", &test::UserRow::user), db::column("host", &test::UserRow::host));
+};
+namespace test {
 static void mysql_test() {
     const char* usr_name = "test";
     const char* host = "127.0.0.1";
@@ -29,8 +41,7 @@ static void mysql_test() {
         std::cout << "Single sql test begin:\n";
         int min_conn_size(2), max_conn_size(4);
         auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo(usr_name, host, port, password, database, character_set), min_conn_size, min_conn_size);
-        client_ptr->init();
-        std::this_thread::sleep_for(1s);
+        client_ptr->init().get();
         client_ptr->query(sql, [](db::MysqlResultPtr ptr) {
             std::cout << " this is single sql :\n";
             for (size_t i = 0; i < ptr->size(); i++) {
@@ -42,6 +53,42 @@ static void mysql_test() {
         });
         std::cout << "Single sql test end\n";
 
+        std::cout << "Prepared statement test begin:\n";
+        client_ptr->query("select user,host from user where user = ?", db::make_params(usr_name), [](db::MysqlResultPtr ptr) {
+            std::cout << " this is prepared statement :\n";
+            for (size_t i = 0; i < ptr->size(); i++) {
+                for (size_t j = 0; j < ptr->columns(); ++j) {
+                    std::cout << ptr->getValue(i, j) << "\t";
+                }
+                std::cout << "\n";
+            }
+        });
+        std::cout << "Prepared statement test end\n";
+
+        std::cout << "Awaitable api test begin:\n";
+        try {
+            auto result = client_ptr->async_query(sql, asio::use_future).get();
+            std::cout << " this is use_future, rows: " << result->size() << "\n";
+        } catch (std::exception& e) {
+            std::cout << e.what() << "\n";
+        }
+        std::cout << "Awaitable api test end\n";
+
+        std::cout << "Row mapping test begin:\n";
+        client_ptr->query(sql, [](db::MysqlResultPtr ptr) {
+            for (auto& row : db::map_rows<UserRow>(*ptr)) {
+                std::cout << row.user << "@" << row.host << "\n";
+            }
+        });
+        std::cout << "Row mapping test end\n";
+
+        std::cout << "Stream query test begin:\n";
+        client_ptr->query_stream(sql, 2, [](const db::MysqlResultPtr& batch, bool is_last, std::function<void(bool)>&& next) {
+            std::cout << " this is stream batch, rows: " << batch->size() << (is_last ? " (last)\n" : "\n");
+            if (next) next(true);
+        });
+        std::cout << "Stream query test end\n";
+
         {
             std::cout << "Transaction test begin:\n";
             auto trans_ptr = client_ptr->new_transaction([](bool ret) {
@@ -73,4 +120,533 @@ static void mysql_test() {
     }
 }
 
+/**
+ * @brief 大语句压力测试: 并发发送多条数MB的INSERT, 语句大于socket发送缓冲区时非阻塞api会要求等待可写
+ * 需要本地MySQL的max_allowed_packet大于statement_bytes
+ *
+ * @param statement_bytes 每条INSERT的大小
+ * @param statements 语句条数
+ */
+static void large_insert_test(std::size_t statement_bytes = 8 << 20, std::size_t statements = 16) {
+    const char* usr_name = "test";
+    const char* host = "127.0.0.1";
+    const char* port = "3306";
+    const char* password = "";
+    const char* database = "test";
+    const char* character_set = "";
+
+    std::cout << "Large insert test begin:\n";
+    auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo(usr_name, host, port, password, database, character_set), 4, 4);
+    client_ptr->init().get();
+    client_ptr->execute("create table if not exists large_insert_test (id int primary key auto_increment, payload varchar(1000))");
+    client_ptr->execute("truncate table large_insert_test");
+
+    std::string sql = "insert into large_insert_test (payload) values ";
+    std::string row = "('" + std::string(998, 'x') + "')";
+    while (sql.size() + row.size() + 1 < statement_bytes) {
+        sql.append(row).push_back(',');
+    }
+    sql.append(row);
+
+    std::atomic<std::size_t> finished{0};
+    std::atomic<std::size_t> failed{0};
+    std::promise<void> all_done;
+    auto begin = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < statements; ++i) {
+        auto on_finish = [&, statements]() {
+            if (finished.fetch_add(1) + 1 == statements) all_done.set_value();
+        };
+        client_ptr->query(
+            sql.c_str(), [on_finish](const db::MysqlResultPtr&) { on_finish(); },
+            [on_finish, &failed](std::exception_ptr ec) {
+                try {
+                    std::rethrow_exception(ec);
+                } catch (std::exception& e) {
+                    std::cout << e.what() << "\n";
+                }
+                failed.fetch_add(1);
+                on_finish();
+            });
+    }
+    all_done.get_future().wait();
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << statements << " statements of " << (sql.size() >> 20) << "MB, failed " << failed << ", " << seconds << "s, "
+              << (sql.size() * statements / seconds / (1 << 20)) << "MB/s\n";
+    std::cout << "Large insert test end\n";
+    client_ptr->stop();
+    client_ptr->join();
+}
+/**
+ * @brief 批量写入测试, 分别以多行INSERT与LOAD DATA LOCAL INFILE写入rows行
+ * LOAD DATA需要服务端开启local_infile
+ *
+ * @param rows
+ */
+static void bulk_insert_test(std::size_t rows = 1000000) {
+    const char* usr_name = "test";
+    const char* host = "127.0.0.1";
+    const char* port = "3306";
+    const char* password = "";
+    const char* database = "test";
+    const char* character_set = "";
+
+    std::cout << "Bulk insert test begin:\n";
+    auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo(usr_name, host, port, password, database, character_set), 4, 4);
+    client_ptr->init().get();
+    client_ptr->execute("create table if not exists bulk_insert_test (id int primary key, name varchar(64), score double)");
+
+    for (auto mode : {db::BulkMode::MultiRowInsert, db::BulkMode::LoadDataLocal}) {
+        client_ptr->execute("truncate table bulk_insert_test");
+        std::atomic<std::size_t> written{0};
+        std::atomic<unsigned long long> affected{0};
+        std::promise<void> all_done;
+        db::BulkOptions options;
+        options.mode = mode;
+        options.flush_interval = 100ms;
+        auto begin = std::chrono::steady_clock::now();
+        auto writer = client_ptr->new_bulk_writer(
+            "bulk_insert_test", {"id", "name", "score"}, options,
+            [&, rows](std::size_t batch_rows, unsigned long long batch_affected, std::exception_ptr ec) {
+                if (ec) {
+                    try {
+                        std::rethrow_exception(ec);
+                    } catch (std::exception& e) {
+                        std::cout << e.what() << "\n";
+                    }
+                }
+                affected += batch_affected;
+                if (written.fetch_add(batch_rows) + batch_rows == rows) all_done.set_value();
+            });
+        for (std::size_t i = 0; i < rows; ++i) {
+            writer->add_row(i, i % 10 ? "name\t'" + std::to_string(i) + "'" : std::string(), i * 0.5);
+        }
+        writer->flush();
+        all_done.get_future().wait();
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        std::cout << (mode == db::BulkMode::MultiRowInsert ? "multi-row insert: " : "load data local infile: ") << affected << " rows affected, "
+                  << seconds << "s, " << rows / seconds << " rows/s\n";
+    }
+    std::cout << "Bulk insert test end\n";
+    client_ptr->stop();
+    client_ptr->join();
+}
+/**
+ * @brief 读写分离测试, 主库与两个副本分别运行在本机的3306, 3307, 3308端口
+ * 通过 select @@port 统计只读查询落在哪些节点上
+ *
+ * @param queries
+ */
+static void cluster_test(std::size_t queries = 10000) {
+    auto make_info = [](const char* port) { return db::ConnectionInfo("test", "127.0.0.1", port, "", "test", ""); };
+    db::ClusterOptions options;
+    options.balance_policy = db::BalancePolicy::LatencyEwma;
+
+    std::cout << "Cluster test begin:\n";
+    auto client_ptr = std::make_shared<db::MysqlClusterClient>(make_info("3306"), std::vector<db::ConnectionInfo>{make_info("3307"), make_info("3308")}, 4, 4, 2, options);
+    client_ptr->init().get();
+    client_ptr->execute("create table if not exists cluster_test (id int primary key auto_increment, value int)");
+
+    std::mutex mutex;
+    std::map<std::string, std::size_t> ports;
+    std::atomic<std::size_t> finished{0};
+    std::promise<void> all_done;
+    for (std::size_t i = 0; i < queries; ++i) {
+        auto on_finish = [&, queries]() {
+            if (finished.fetch_add(1) + 1 == queries) all_done.set_value();
+        };
+        client_ptr->query(
+            "select @@port",
+            [&, on_finish](const db::MysqlResultPtr& result) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++ports[result->get<std::string>(0, 0)];
+                }
+                on_finish();
+            },
+            [on_finish](std::exception_ptr) { on_finish(); });
+    }
+    all_done.get_future().wait();
+    for (auto& [port, count] : ports) {
+        std::cout << "port " << port << ": " << count << " queries\n";
+    }
+    for (std::size_t i = 0; i < client_ptr->replica_count(); ++i) {
+        std::cout << "replica " << i << " lag: " << client_ptr->replica_lag(i) << "s\n";
+    }
+    std::cout << "Cluster test end\n";
+    client_ptr->stop();
+    client_ptr->join();
+}
+/**
+ * @brief 断线重连测试, 运行期间手动重启mysqld(或 KILL 连接), 观察查询失败的时间段以及恢复后的连接数
+ * 开启 read_retries, 只读查询在连接断开时会换一个连接重试, 连接池按退避时间补足最少连接数
+ *
+ * @param seconds
+ */
+static void reconnect_test(std::size_t seconds = 60) {
+    db::PoolOptions options;
+    options.keepalive_interval = std::chrono::seconds(5);
+    options.connect_timeout = std::chrono::seconds(2);
+    options.read_retries = 2;
+
+    std::cout << "Reconnect test begin, restart the server during the next " << seconds << " seconds:\n";
+    auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo("test", "127.0.0.1", "3306", "", "test", ""), 4, 8, 1, options);
+    client_ptr->init().get();
+    std::atomic<std::size_t> succeeded{0};
+    std::atomic<std::size_t> failed{0};
+    for (std::size_t tick = 0; tick < seconds * 10; ++tick) {
+        client_ptr->query(
+            "select 1",
+            [&succeeded](const db::MysqlResultPtr&) { succeeded.fetch_add(1); },
+            [&failed](std::exception_ptr except) {
+                failed.fetch_add(1);
+                try {
+                    std::rethrow_exception(except);
+                } catch (const std::exception& e) {
+                    std::cout << "query failed: " << e.what() << "\n";
+                }
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (tick % 10 == 9) {
+            std::cout << "succeeded: " << succeeded << ", failed: " << failed << ", connections: " << client_ptr->connection_count() << "\n";
+        }
+    }
+    std::cout << "Reconnect test end\n";
+    client_ptr->stop();
+    client_ptr->join();
+}
+/**
+ * @brief 执行一批查询后输出连接池的统计, 以及Prometheus文本格式
+ *
+ * @param queries
+ */
+static void metrics_test(std::size_t queries = 10000) {
+    std::cout << "Metrics test begin:\n";
+    auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo("test", "127.0.0.1", "3306", "", "test", ""), 4, 8, 2);
+    client_ptr->init().get();
+    std::atomic<std::size_t> finished{0};
+    std::promise<void> all_done;
+    for (std::size_t i = 0; i < queries; ++i) {
+        auto on_finish = [&, queries]() {
+            if (finished.fetch_add(1) + 1 == queries) all_done.set_value();
+        };
+        client_ptr->query(
+            i % 100 == 0 ? "select * from no_such_table" : "select 1",
+            [on_finish](const db::MysqlResultPtr&) { on_finish(); },
+            [on_finish](std::exception_ptr) { on_finish(); });
+    }
+    all_done.get_future().wait();
+    auto metrics = client_ptr->metrics();
+    auto print = [](const char* name, const db::HistogramSnapshot& histogram) {
+        std::cout << name << ": count " << histogram.count << ", p50 " << histogram.percentile(0.5) << "us, p99 " << histogram.percentile(0.99)
+                  << "us, max " << histogram.max_us << "us\n";
+    };
+    print("queue wait", metrics.queue_wait);
+    print("connect", metrics.connect_time);
+    print("round trip", metrics.round_trip);
+    print("decode", metrics.decode_time);
+    std::cout << "executed: " << metrics.executed << ", failed: " << metrics.failed << ", queued: " << metrics.queued << ", dropped: " << metrics.dropped << "\n";
+    std::cout << db::to_prometheus(metrics, "mysql_pool", "pool=\"test\"");
+    std::cout << "Metrics test end\n";
+    client_ptr->stop();
+    client_ptr->join();
+}
+/**
+ * @brief 事务测试: 异步获取事务, 每个事务一条INSERT加一条UPDATE
+ * 分别在关闭与开启 merge_transaction_statements 时运行, 开启后BEGIN与INSERT, UPDATE与COMMIT各自合并, 往返从4次减为2次
+ *
+ * @param transactions
+ */
+static void transaction_test(std::size_t transactions = 2000) {
+    std::cout << "Transaction test begin:\n";
+    for (bool merge : {false, true}) {
+        db::PoolOptions options;
+        options.merge_transaction_statements = merge;
+        auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo("test", "127.0.0.1", "3306", "", "test", ""), 8, 8, 2, options);
+        client_ptr->init().get();
+        client_ptr->execute("create table if not exists transaction_test (id int primary key auto_increment, value int)");
+
+        std::atomic<std::size_t> committed{0};
+        std::atomic<std::size_t> finished{0};
+        std::promise<void> all_done;
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < transactions; ++i) {
+            auto on_finish = [&, transactions](bool is_committed) {
+                if (is_committed) committed.fetch_add(1);
+                if (finished.fetch_add(1) + 1 == transactions) all_done.set_value();
+            };
+            client_ptr->new_transaction_async(
+                [i, on_finish](const db::MysqlTransactionPtr& trans) {
+                    if (!trans) {
+                        on_finish(false);
+                        return;
+                    }
+                    trans->execute_sql(("insert into transaction_test (value) values (" + std::to_string(i) + ")").c_str(), nullptr, nullptr);
+                    trans->execute_and_commit("update transaction_test set value = value + 1 where id = last_insert_id()", nullptr, nullptr);
+                },
+                on_finish);
+        }
+        all_done.get_future().wait();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << (merge ? "merged" : "separate") << " BEGIN/COMMIT: " << committed << " of " << transactions << " committed in " << elapsed << "ms\n";
+        client_ptr->stop();
+        client_ptr->join();
+    }
+    std::cout << "Transaction test end\n";
+}
+/**
+ * @brief 死锁重试测试: 一半事务按 1, 2 的顺序更新两行, 另一半按 2, 1 的顺序, 制造死锁
+ * 通过 run_transaction 执行, 最后输出提交数与重试次数; 另外以协程事务体和保存点各运行一次
+ *
+ * @param transactions
+ */
+static void retry_test(std::size_t transactions = 200) {
+    std::cout << "Retry test begin:\n";
+    auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo("test", "127.0.0.1", "3306", "", "test", ""), 8, 8, 2);
+    client_ptr->init().get();
+    client_ptr->execute("create table if not exists retry_test (id int primary key, value int)");
+    client_ptr->execute("insert ignore into retry_test values (1, 0), (2, 0)");
+
+    db::TransactionRetryPolicy policy;
+    policy.max_retries = 10;
+    std::atomic<std::size_t> committed{0};
+    std::atomic<std::size_t> finished{0};
+    std::promise<void> all_done;
+    for (std::size_t i = 0; i < transactions; ++i) {
+        const char* first = i % 2 ? "update retry_test set value = value + 1 where id = 1" : "update retry_test set value = value + 1 where id = 2";
+        const char* second = i % 2 ? "update retry_test set value = value + 1 where id = 2" : "update retry_test set value = value + 1 where id = 1";
+        client_ptr->run_transaction(
+            [first, second](const db::MysqlTransactionPtr& trans) {
+                trans->execute_sql(first, nullptr, nullptr);
+                trans->execute_sql("do sleep(0.005)", nullptr, nullptr);
+                trans->execute_sql(second, nullptr, nullptr);
+            },
+            [&, transactions](std::exception_ptr error) {
+                if (!error) committed.fetch_add(1);
+                if (finished.fetch_add(1) + 1 == transactions) all_done.set_value();
+            },
+            policy);
+    }
+    all_done.get_future().wait();
+    auto metrics = client_ptr->metrics();
+    std::cout << committed << " of " << transactions << " committed, retries: " << metrics.transaction_retries
+              << ", exhausted: " << metrics.transaction_exhausted << "\n";
+
+    auto coroutine_done = client_ptr->async_run_transaction(
+        [](db::MysqlTransactionPtr trans) -> asio::awaitable<void> {
+            co_await trans->async_execute_sql("update retry_test set value = value + 1 where id = 1", asio::use_awaitable);
+            co_await trans->async_execute_sql("update retry_test set value = value + 1 where id = 2", asio::use_awaitable);
+        },
+        asio::use_future);
+    try {
+        coroutine_done.get();
+        std::cout << "coroutine transaction committed\n";
+    } catch (const std::exception& e) {
+        std::cout << "coroutine transaction failed: " << e.what() << "\n";
+    }
+
+    // the duplicate key only undoes the failed insert, the transaction goes on from the savepoint
+    std::promise<bool> savepoint_done;
+    client_ptr->new_transaction_async(
+        [&savepoint_done](const db::MysqlTransactionPtr& trans) {
+            if (!trans) {
+                savepoint_done.set_value(false);
+                return;
+            }
+            trans->execute_sql("update retry_test set value = 0 where id = 1", nullptr, nullptr);
+            trans->savepoint("before_insert");
+            trans->execute_sql("insert into retry_test values (1, 0)", nullptr, [trans](std::exception_ptr) { trans->rollback_to("before_insert"); });
+        },
+        [&savepoint_done](bool is_committed) { savepoint_done.set_value(is_committed); });
+    std::cout << "savepoint transaction " << (savepoint_done.get_future().get() ? "committed" : "rolled back") << "\n";
+    std::cout << "Retry test end\n";
+    client_ptr->stop();
+    client_ptr->join();
+}
+/**
+ * @brief 用进程内的模拟服务端(mock_server.hpp)端到端测试连接池, 事务与结果解析, 不需要数据库
+ * 覆盖文本与预处理语句的结果, multi-result, 合并的事务语句, 死锁重试, 保存点, 查询超时, 连接断开后恢复与注入的延迟
+ *
+ * @return int 失败的检查数
+ */
+static int mock_test() {
+    std::cout << "Mock server test begin:\n";
+    mock::MockServer server;
+    server.on("select user", mock::Response::rows({{"user"}, {"host"}}, {{"root", "localhost"}, {"test", std::nullopt}}));
+    server.on("select ? + 1", [](const mock::Request& request) {
+        std::string value = request.params.empty() || !request.params[0] ? "0" : std::to_string(std::stoll(*request.params[0]) + 1);
+        return mock::Response::rows({{"value", MYSQL_TYPE_LONGLONG}}, {{value}});
+    });
+    server.on("call two_results", [](const mock::Request&) {
+        auto response = mock::Response::rows({{"id", MYSQL_TYPE_LONG}}, {{"1"}, {"2"}});
+        response.results.push_back(mock::Response::rows({{"name"}}, {{"a"}}).results[0]);
+        return response;
+    });
+    std::atomic<int> deadlocks{2};
+    server.on("update deadlock", [&deadlocks](const mock::Request&) {
+        if (deadlocks.fetch_sub(1) > 0) return mock::Response::error(ER_LOCK_DEADLOCK, "Deadlock found when trying to get lock", "40001");
+        return mock::Response::ok(1);
+    });
+    server.on("insert duplicate", mock::Response::error(ER_DUP_ENTRY, "Duplicate entry '1' for key 'PRIMARY'", "23000"));
+    server.on("select sleep", mock::Response::fail(mock::Fault::Hang));
+    server.on("update broken", mock::Response::fail(mock::Fault::Close));
+    server.start();
+
+    int failures = 0;
+    auto check = [&failures](bool is_ok, const char* what) {
+        std::cout << (is_ok ? "  ok   " : "  FAIL ") << what << "\n";
+        if (!is_ok) ++failures;
+    };
+    auto error_code = [](std::exception_ptr error) {
+        try {
+            if (error) std::rethrow_exception(error);
+        } catch (const db::MysqlException& e) {
+            return static_cast<int>(e.code());
+        } catch (...) {
+            return -1;
+        }
+        return 0;
+    };
+    auto contains = [&server](std::string_view sql) {
+        auto history = server.history();
+        return std::find(history.begin(), history.end(), sql) != history.end();
+    };
+
+    db::PoolOptions options;
+    options.merge_transaction_statements = true;
+    options.query_timeout = 200ms;
+    options.keepalive_interval = 0ms;
+    auto client_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo("test", "127.0.0.1", std::to_string(server.port()), "", "test", ""), 2, 4, 1, options);
+    try {
+        client_ptr->init().get();
+    } catch (const std::exception& e) {
+        std::cout << "connect to mock server failed: " << e.what() << "\n";
+        return 1;
+    }
+
+    {
+        auto result = client_ptr->async_query("select user, host from user", asio::use_future).get();
+        check(result->size() == 2 && result->get<std::string>(0, 0) == "root" && result->isNull(1, 1), "text protocol rows");
+        auto rows = db::map_rows<UserRow>(*result);
+        check(rows.size() == 2 && rows[1].user == "test", "row mapping");
+    }
+    {
+        auto result = client_ptr->async_query("select ? + 1", db::make_params(41), asio::use_future).get();
+        check(result->size() == 1 && result->get<std::int64_t>(0, 0) == 42, "prepared statement with binary params and rows");
+    }
+    {
+        // the result callback runs once per result set
+        std::promise<void> done;
+        std::vector<std::size_t> sizes;
+        client_ptr->query(
+            "call two_results()",
+            [&sizes, &done](const db::MysqlResultPtr& result) {
+                sizes.push_back(result->size());
+                if (sizes.size() == 2) done.set_value();
+            },
+            [&done](std::exception_ptr) { done.set_value(); });
+        check(done.get_future().wait_for(2s) == std::future_status::ready && sizes == std::vector<std::size_t>{2, 1}, "multiple result sets");
+    }
+    {
+        server.clear_history();
+        std::promise<bool> committed;
+        client_ptr->new_transaction_async(
+            [&committed](const db::MysqlTransactionPtr& trans) {
+                if (!trans) {
+                    committed.set_value(false);
+                    return;
+                }
+                trans->execute_and_commit("update account set value = 1", nullptr, nullptr);
+            },
+            [&committed](bool is_committed) { committed.set_value(is_committed); });
+        bool is_committed = committed.get_future().get();
+        // begin, the statement and commit in a single round trip
+        auto packets = server.query_packets();
+        check(is_committed && packets.size() == 1 && contains("begin") && contains("update account set value = 1") && contains("commit"),
+              "transaction statements merged with begin and commit");
+    }
+    {
+        std::promise<std::exception_ptr> done;
+        client_ptr->run_transaction([](const db::MysqlTransactionPtr& trans) { trans->execute_sql("update deadlock set value = 1", nullptr, nullptr); },
+                                    [&done](std::exception_ptr error) { done.set_value(error); });
+        check(!done.get_future().get() && client_ptr->metrics().transaction_retries == 2, "deadlocked transaction retried");
+    }
+    {
+        std::promise<bool> committed;
+        client_ptr->new_transaction_async(
+            [&committed](const db::MysqlTransactionPtr& trans) {
+                if (!trans) {
+                    committed.set_value(false);
+                    return;
+                }
+                trans->savepoint("before_insert");
+                trans->execute_sql("insert duplicate values (1)", nullptr, [trans](std::exception_ptr) { trans->rollback_to("before_insert"); });
+            },
+            [&committed](bool is_committed) { committed.set_value(is_committed); });
+        check(committed.get_future().get() && contains("ROLLBACK TO SAVEPOINT `before_insert`"), "failed statement rolled back to savepoint");
+    }
+    {
+        std::promise<std::exception_ptr> done;
+        client_ptr->query("select sleep(10)", nullptr, [&done](std::exception_ptr error) { done.set_value(error); });
+        check(error_code(done.get_future().get()) == static_cast<int>(db::ErrorCode::Timeout), "query timeout");
+        // KILL QUERY is sent on a separate connection after the caller has been failed
+        check(server.wait_for("KILL QUERY", 2s), "timed out query killed");
+    }
+    {
+        std::promise<std::exception_ptr> done;
+        client_ptr->query("update broken set value = 1", nullptr, [&done](std::exception_ptr error) { done.set_value(error); });
+        check(error_code(done.get_future().get()) == static_cast<int>(db::ErrorCode::Connection), "connection closed by server");
+        auto result = client_ptr->async_query("select user, host from user", asio::use_future).get();
+        check(result->size() == 2, "pool recovered after connection loss");
+    }
+    {
+        // more io threads than connections, two of the four shards never own a connection
+        db::PoolOptions narrow_options;
+        narrow_options.keepalive_interval = 0ms;
+        auto narrow_ptr = std::make_shared<db::MysqlClient>(db::ConnectionInfo("test", "127.0.0.1", std::to_string(server.port()), "", "test", ""), 2, 2, 4,
+                                                            narrow_options);
+        narrow_ptr->init().get();
+        constexpr std::size_t queries = 200;
+        constexpr std::size_t transactions = 20;
+        struct State {
+            std::atomic<std::size_t> finished{0};
+            std::promise<void> all_done;
+            void finish() {
+                if (finished.fetch_add(1) + 1 == queries + transactions) all_done.set_value();
+            }
+        };
+        auto state = std::make_shared<State>();
+        auto all_done = state->all_done.get_future();
+        for (std::size_t i = 0; i < queries; ++i) {
+            narrow_ptr->query(
+                "select user, host from user", [state](const db::MysqlResultPtr&) { state->finish(); }, [state](std::exception_ptr) { state->finish(); });
+        }
+        for (std::size_t i = 0; i < transactions; ++i) {
+            narrow_ptr->new_transaction_async(
+                [state](const db::MysqlTransactionPtr& trans) {
+                    if (!trans) {
+                        state->finish();
+                        return;
+                    }
+                    trans->execute_and_commit("update account set value = 1", nullptr, nullptr);
+                },
+                [state](bool) { state->finish(); });
+        }
+        check(all_done.wait_for(5s) == std::future_status::ready, "queued work runs with more io threads than connections");
+        narrow_ptr->stop();
+        narrow_ptr->join();
+    }
+    {
+        server.set_latency(50ms);
+        auto start = std::chrono::steady_clock::now();
+        client_ptr->async_query("select user, host from user", asio::use_future).get();
+        check(std::chrono::steady_clock::now() - start >= 50ms, "injected latency");
+        server.set_latency(0ms);
+    }
+    client_ptr->stop();
+    client_ptr->join();
+    server.stop();
+    std::cout << "statements: " << server.statement_count() << ", connections: " << server.accepted_connections() << ", failures: " << failures << "\n";
+    std::cout << "Mock server test end\n";
+    return failures;
+}
 }  // namespace test
\ No newline at end of file
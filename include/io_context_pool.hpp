@@ -2,6 +2,7 @@
 #define __IO_CONTEXT_POOL_HPP__
 #include <asio/io_context.hpp>
 #include <asio/signal_set.hpp>
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <thread>
@@ -41,7 +42,7 @@ class SigleIOThread {
 class MultiIOThreads {
    private:
     std::vector<std::unique_ptr<SigleIOThread>> io_workers_;
-    std::size_t current_io_index_ = {0};
+    std::atomic<std::size_t> current_io_index_ = {0};
 
    public:
     void init(std::size_t num) {
@@ -66,14 +67,17 @@ class MultiIOThreads {
             io->stop();
         }
     }
+    /**
+     * @brief 轮询取一个io_context, 可被多个线程同时调用
+     *
+     * @return asio::io_context&
+     */
     asio::io_context& get_io_context() {
-        auto& io = io_workers_.at(current_io_index_);
-        ++current_io_index_;
-        if (current_io_index_ == io_workers_.size()) {
-            current_io_index_ = 0;
-        }
-        return io->get_io_context();
+        auto index = current_io_index_.fetch_add(1, std::memory_order_relaxed) % io_workers_.size();
+        return io_workers_[index]->get_io_context();
     }
+    asio::io_context& get_io_context(std::size_t index) { return io_workers_.at(index)->get_io_context(); }
+    std::size_t size() const noexcept { return io_workers_.size(); }
 };
 template <class PoolPolicy>
 class IOContextPoolBase : public PoolPolicy {
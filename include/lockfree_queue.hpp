@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace db {
+constexpr std::size_t cache_line_size = 64;
+
+/**
+ * @brief 有界的多生产者单消费者环形队列(Vyukov bounded queue)
+ * 任意线程都可以try_push, 只有一个线程(分片所在的io线程)可以try_pop
+ *
+ * @tparam T 可默认构造, 可移动
+ */
+template <typename T>
+class MpscRing {
+   private:
+    struct Cell {
+        std::atomic<std::size_t> seq_;
+        T value_;
+    };
+    std::unique_ptr<Cell[]> cells_;
+    const std::size_t mask_;
+    alignas(cache_line_size) std::atomic<std::size_t> enqueue_pos_{0};
+    alignas(cache_line_size) std::atomic<std::size_t> dequeue_pos_{0};
+
+    static std::size_t round_up(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+   public:
+    explicit MpscRing(std::size_t capacity) : mask_(round_up(capacity) - 1) {
+        cells_ = std::make_unique<Cell[]>(mask_ + 1);
+        for (std::size_t i = 0; i <= mask_; ++i) {
+            cells_[i].seq_.store(i, std::memory_order_relaxed);
+        }
+    }
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    /**
+     * @brief 入队, 队列满时返回false且value不会被移走
+     *
+     * @param value
+     * @return bool
+     */
+    bool try_push(T&& value) {
+        Cell* cell;
+        std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->seq_.load(std::memory_order_acquire);
+            auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (dif == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value_ = std::move(value);
+        cell->seq_.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief 出队, 只能在消费者线程调用
+     *
+     * @param value
+     * @return bool
+     */
+    bool try_pop(T& value) {
+        std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell* cell = &cells_[pos & mask_];
+        std::size_t seq = cell->seq_.load(std::memory_order_acquire);
+        if (static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1) < 0) {
+            return false;
+        }
+        value = std::move(cell->value_);
+        cell->value_ = T();
+        cell->seq_.store(pos + mask_ + 1, std::memory_order_release);
+        dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    std::size_t size_approx() const noexcept {
+        auto enqueue = enqueue_pos_.load(std::memory_order_relaxed);
+        auto dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+    bool empty() const noexcept { return size_approx() == 0; }
+    std::size_t capacity() const noexcept { return mask_ + 1; }
+};
+
+/**
+ * @brief 无锁的下标栈(Treiber stack), 栈顶带版本号以避免ABA
+ * 用来保存空闲连接所在的槽位, 任意线程都可以push/pop
+ */
+class IndexStack {
+   public:
+    static constexpr std::uint32_t npos = UINT32_MAX;
+
+   private:
+    std::unique_ptr<std::atomic<std::uint32_t>[]> next_;
+    alignas(cache_line_size) std::atomic<std::uint64_t> head_{npos};
+
+    static std::uint64_t make_head(std::uint64_t old_head, std::uint32_t index) {
+        return (((old_head >> 32) + 1) << 32) | index;
+    }
+
+   public:
+    explicit IndexStack(std::size_t capacity) : next_(std::make_unique<std::atomic<std::uint32_t>[]>(capacity)) {
+        for (std::size_t i = 0; i < capacity; ++i) {
+            next_[i].store(npos, std::memory_order_relaxed);
+        }
+    }
+    IndexStack(const IndexStack&) = delete;
+    IndexStack& operator=(const IndexStack&) = delete;
+
+    void push(std::uint32_t index) {
+        std::uint64_t head = head_.load(std::memory_order_relaxed);
+        do {
+            next_[index].store(static_cast<std::uint32_t>(head), std::memory_order_relaxed);
+        } while (!head_.compare_exchange_weak(head, make_head(head, index), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool pop(std::uint32_t& index) {
+        std::uint64_t head = head_.load(std::memory_order_acquire);
+        for (;;) {
+            auto top = static_cast<std::uint32_t>(head);
+            if (top == npos) {
+                return false;
+            }
+            auto next = next_[top].load(std::memory_order_relaxed);
+            if (head_.compare_exchange_weak(head, make_head(head, next), std::memory_order_acquire, std::memory_order_acquire)) {
+                index = top;
+                return true;
+            }
+        }
+    }
+
+    bool empty() const noexcept { return static_cast<std::uint32_t>(head_.load(std::memory_order_relaxed)) == npos; }
+};
+}  // namespace db
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <asio.hpp>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <utility>
+
+#include "mysql_connection.hpp"
+// per-operation cancellation was added in asio 1.19 (boost 1.77)
+#if (defined(ASIO_VERSION) && ASIO_VERSION >= 101900) || (defined(BOOST_ASIO_VERSION) && BOOST_ASIO_VERSION >= 101900)
+#define DB_HAS_CANCELLATION_SLOT 1
+#endif
+namespace db {
+/**
+ * @brief async_query 等异步接口的完成签名
+ * 配合 asio::use_awaitable 时 co_await 返回 MysqlResultPtr, 出错时抛出异常;
+ * 配合 asio::use_future 时得到 std::future<MysqlResultPtr>
+ */
+using QuerySignature = void(std::exception_ptr, MysqlResultPtr);
+
+namespace detail {
+/**
+ * @brief 把一次性的asio完成处理器接到ResultPtrCallback/ExceptPtrCallback上
+ * 以第一个结果集或错误完成, 之后的结果集被忽略; 处理器在其关联的executor上被调用
+ * 处理器关联了cancellation_slot时(例如 asio::bind_cancellation_slot, awaitable_operators), 取消会立即以
+ * ErrorCode::Cancelled 完成, 并中止排队或执行中的命令
+ */
+template <typename Handler>
+class QueryOperation {
+   private:
+    using WorkGuard = decltype(asio::make_work_guard(std::declval<Handler&>()));
+    Handler handler_;
+    WorkGuard work_;
+    std::atomic<bool> is_done_{false};  //取消可能在其他线程上与结果同时到达
+#ifdef DB_HAS_CANCELLATION_SLOT
+    asio::cancellation_slot slot_;
+#endif
+
+   public:
+    explicit QueryOperation(Handler&& handler)
+        : handler_(std::move(handler)), work_(asio::make_work_guard(handler_)) {}
+
+    /**
+     * @brief 处理器关联了cancellation_slot时, 返回与命令共享的取消状态, 否则为空
+     *
+     * @param op
+     * @return std::shared_ptr<QueryCanceller>
+     */
+    static std::shared_ptr<QueryCanceller> bind_cancellation(const std::shared_ptr<QueryOperation>& op) {
+#ifdef DB_HAS_CANCELLATION_SLOT
+        op->slot_ = asio::get_associated_cancellation_slot(op->handler_);
+        if (!op->slot_.is_connected()) return nullptr;
+        auto canceller = std::make_shared<QueryCanceller>();
+        op->slot_.assign([weak_op = std::weak_ptr<QueryOperation>(op), canceller](asio::cancellation_type_t) {
+            canceller->cancel();
+            if (auto op = weak_op.lock()) {
+                op->complete(std::make_exception_ptr(MysqlException(ErrorCode::Cancelled, "query cancelled")), nullptr, false);
+            }
+        });
+        return canceller;
+#else
+        return nullptr;
+#endif
+    }
+
+    /**
+     * @brief 调用完成处理器, 只有第一次调用生效
+     *
+     * @param ec_ptr
+     * @param result_ptr
+     * @param clear_slot 在slot自己的处理函数中完成时不能清除slot
+     */
+    void complete(std::exception_ptr ec_ptr, MysqlResultPtr result_ptr, bool clear_slot = true) {
+        if (is_done_.exchange(true)) return;
+        auto executor = work_.get_executor();
+#ifdef DB_HAS_CANCELLATION_SLOT
+        // the slot belongs to the caller, clear it on the caller's executor before completing
+        auto slot = clear_slot ? slot_ : asio::cancellation_slot();
+        asio::dispatch(executor, [handler = std::move(handler_), slot, ec_ptr, result_ptr = std::move(result_ptr)]() mutable {
+            if (slot.is_connected()) slot.clear();
+            std::move(handler)(ec_ptr, std::move(result_ptr));
+        });
+#else
+        asio::dispatch(executor, [handler = std::move(handler_), ec_ptr, result_ptr = std::move(result_ptr)]() mutable {
+            std::move(handler)(ec_ptr, std::move(result_ptr));
+        });
+#endif
+        work_.reset();
+    }
+
+    static std::pair<ResultPtrCallback, ExceptPtrCallback> make_callbacks(const std::shared_ptr<QueryOperation>& op) {
+        return {[op](const MysqlResultPtr& result_ptr) { op->complete(nullptr, result_ptr); },
+                [op](std::exception_ptr ec_ptr) { op->complete(ec_ptr, nullptr); }};
+    }
+};
+template <typename Handler>
+auto make_query_operation(Handler&& handler) {
+    return std::make_shared<QueryOperation<std::decay_t<Handler>>>(std::forward<Handler>(handler));
+}
+}  // namespace detail
+}  // namespace db
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <asio.hpp>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "mysql_connection.hpp"
+#include "mysql_statement.hpp"
+#include "sql_text.hpp"
+namespace db {
+/**
+ * @brief 批量写入的方式
+ */
+enum class BulkMode {
+    MultiRowInsert,  //合并成 INSERT INTO t (...) VALUES (...),(...)
+    LoadDataLocal,   //以制表符分隔的文本经 LOAD DATA LOCAL INFILE 发送, 数据只来自内存
+};
+
+struct BulkOptions {
+    BulkMode mode = BulkMode::MultiRowInsert;
+    std::size_t max_packet = 4 * 1024 * 1024;       //一批的最大字节数, 多行INSERT时不能超过服务端的max_allowed_packet
+    std::size_t max_rows = 0;                       //一批的最大行数, 0为不限
+    std::chrono::milliseconds flush_interval{0};    //一批中第一行加入后最多等待多久就发送, 0为只按大小发送
+};
+
+/**
+ * @brief 每一批完成后回调, 成功时except为空
+ */
+using BulkBatchCallback = std::function<void(std::size_t rows, unsigned long long affected_rows, std::exception_ptr except)>;
+/**
+ * @brief 执行一批的方式, infile_data为空时执行普通sql, 否则以其内容执行LOAD DATA LOCAL INFILE
+ */
+using BulkExecutor = std::function<void(SqlText&& sql, std::unique_ptr<std::string>&& infile_data, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb)>;
+
+/**
+ * @brief 批量写入器, 把逐行加入的数据合并成大批发送
+ * 可被多个线程同时调用add_row; 析构时发送剩余的行
+ * 字符串按反斜杠转义, 要求连接字符集为utf8/utf8mb4/latin1等ASCII兼容的字符集, 且服务端未开启NO_BACKSLASH_ESCAPES
+ */
+class BulkWriter : public std::enable_shared_from_this<BulkWriter> {
+   private:
+    BulkExecutor executor_;
+    asio::io_context& io_context_;  //flush_interval的定时器运行在这里
+    BulkOptions options_;
+    std::shared_ptr<BulkBatchCallback> batch_callback_;
+    std::size_t columns_number_;
+    std::string insert_prefix_;  //INSERT INTO t (...) VALUES
+    SqlText load_data_sql_;
+
+    std::mutex mutex_;
+    SqlText sql_;        //多行INSERT的当前批
+    std::string data_;   //LOAD DATA的当前批
+    std::string row_;    //编码一行的临时缓冲区
+    std::size_t rows_ = 0;
+    std::size_t batch_id_ = 0;
+
+    // a batch taken out under mutex_ and sent after unlocking, the executor may call batch_callback_ synchronously
+    struct Batch {
+        std::size_t rows_ = 0;
+        SqlText sql_;
+        std::string data_;
+    };
+
+   public:
+    /**
+     * @brief 一般通过 MysqlClient::new_bulk_writer 或 MysqlTransaction::new_bulk_writer 创建
+     *
+     * @param executor
+     * @param io_context
+     * @param table 原样写入sql, 可带库名
+     * @param columns
+     * @param options
+     * @param batch_callback 可以为空
+     */
+    BulkWriter(BulkExecutor&& executor, asio::io_context& io_context, std::string_view table, const std::vector<std::string>& columns, const BulkOptions& options,
+               BulkBatchCallback&& batch_callback)
+        : executor_(std::move(executor)),
+          io_context_(io_context),
+          options_(options),
+          batch_callback_(std::make_shared<BulkBatchCallback>(std::move(batch_callback))),
+          columns_number_(columns.size()) {
+        if (columns.empty()) {
+            throw std::invalid_argument("bulk writer needs at least one column");
+        }
+        std::string column_list = "(";
+        for (std::size_t i = 0; i < columns.size(); ++i) {
+            if (i) column_list += ',';
+            append_identifier(column_list, columns[i]);
+        }
+        column_list += ')';
+        if (options_.mode == BulkMode::MultiRowInsert) {
+            insert_prefix_.append("INSERT INTO ").append(table).append(" ").append(column_list).append(" VALUES ");
+        } else {
+            load_data_sql_.append("LOAD DATA LOCAL INFILE 'bulk' INTO TABLE ");
+            load_data_sql_.append(table);
+            load_data_sql_.append(" FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n' ");
+            load_data_sql_.append(column_list);
+        }
+    }
+    ~BulkWriter() {
+        Batch batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batch = take_batch();
+        }
+        send_batch(std::move(batch));
+    }
+    BulkWriter(const BulkWriter&) = delete;
+    BulkWriter& operator=(const BulkWriter&) = delete;
+
+    /**
+     * @brief 加入一行, 参数个数与类型同 make_params
+     */
+    template <typename... Args>
+    void add_row(Args&&... args) {
+        add_row(make_params(std::forward<Args>(args)...));
+    }
+    /**
+     * @brief 加入一行, 当前批放不下这一行或达到max_rows时先发送当前批
+     *
+     * @param row 列数必须与构造时相同
+     */
+    void add_row(StmtParams&& row) {
+        if (row.size() != columns_number_) {
+            throw std::invalid_argument("bulk row has " + std::to_string(row.size()) + " values, expected " + std::to_string(columns_number_));
+        }
+        Batch full;
+        Batch last;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            row_.clear();
+            if (options_.mode == BulkMode::MultiRowInsert) {
+                encode_insert_row(row);
+            } else {
+                encode_tsv_row(row);
+            }
+            if (rows_ > 0 && batch_size() + row_.size() + 1 > options_.max_packet) {
+                full = take_batch();
+            }
+            if (rows_ == 0) {
+                start_batch();
+            } else if (options_.mode == BulkMode::MultiRowInsert) {
+                sql_.push_back(',');
+            }
+            if (options_.mode == BulkMode::MultiRowInsert) {
+                sql_.append(row_);
+            } else {
+                data_.append(row_);
+            }
+            if (++rows_ == options_.max_rows) {
+                last = take_batch();
+            }
+        }
+        send_batch(std::move(full));
+        send_batch(std::move(last));
+    }
+    /**
+     * @brief 立即发送当前批
+     */
+    void flush() {
+        Batch batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batch = take_batch();
+        }
+        send_batch(std::move(batch));
+    }
+    std::size_t pending_rows() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return rows_;
+    }
+
+   private:
+    std::size_t batch_size() const noexcept { return options_.mode == BulkMode::MultiRowInsert ? sql_.size() : data_.size(); }
+    void start_batch() {
+        ++batch_id_;
+        if (options_.mode == BulkMode::MultiRowInsert) {
+            sql_.assign(insert_prefix_);
+        }
+        if (options_.flush_interval.count() > 0) {
+            auto timer = std::make_shared<asio::steady_timer>(io_context_, options_.flush_interval);
+            timer->async_wait([weak_this = weak_from_this(), batch_id = batch_id_, timer](const asio::error_code& ec) {
+                auto this_ptr = weak_this.lock();
+                if (ec || !this_ptr) return;
+                Batch batch;
+                {
+                    std::lock_guard<std::mutex> lock(this_ptr->mutex_);
+                    // the batch may have been sent by size already
+                    if (this_ptr->batch_id_ == batch_id) {
+                        batch = this_ptr->take_batch();
+                    }
+                }
+                this_ptr->send_batch(std::move(batch));
+            });
+        }
+    }
+    // called with mutex_ held
+    Batch take_batch() {
+        Batch batch;
+        if (rows_ == 0) return batch;
+        batch.rows_ = rows_;
+        rows_ = 0;
+        ++batch_id_;
+        if (options_.mode == BulkMode::MultiRowInsert) {
+            batch.sql_ = std::move(sql_);
+        } else {
+            batch.data_ = std::move(data_);
+            data_.clear();
+        }
+        return batch;
+    }
+    // called without mutex_, batch_callback_ may add rows or flush again
+    void send_batch(Batch&& batch) {
+        if (batch.rows_ == 0) return;
+        auto result_callback = [callback = batch_callback_, rows = batch.rows_](const MysqlResultPtr& result) {
+            if (*callback) (*callback)(rows, result->affectedRows(), nullptr);
+        };
+        auto except_callback = [callback = batch_callback_, rows = batch.rows_](std::exception_ptr except) {
+            if (*callback) (*callback)(rows, 0, except);
+        };
+        if (options_.mode == BulkMode::MultiRowInsert) {
+            executor_(std::move(batch.sql_), nullptr, std::move(result_callback), std::move(except_callback));
+        } else {
+            auto data = std::make_unique<std::string>(std::move(batch.data_));
+            executor_(SqlText(load_data_sql_), std::move(data), std::move(result_callback), std::move(except_callback));
+        }
+    }
+
+    static void append_identifier(std::string& out, std::string_view name) {
+        out += '`';
+        for (auto c : name) {
+            if (c == '`') out += '`';
+            out += c;
+        }
+        out += '`';
+    }
+    template <typename T>
+    void append_number(T value) {
+        char buf[32];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+        row_.append(buf, end);
+    }
+    void append_number(double value) {
+        if (!std::isfinite(value)) {
+            throw std::invalid_argument("bulk row contains a non-finite double");
+        }
+        char buf[32];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+        row_.append(buf, end);
+    }
+    // returns false for NULL
+    bool append_value(const StmtParam& param) {
+        switch (param.is_null_ ? MYSQL_TYPE_NULL : param.type_) {
+            case MYSQL_TYPE_LONGLONG:
+                if (param.is_unsigned_) {
+                    append_number(static_cast<unsigned long long>(param.int_value_));
+                } else {
+                    append_number(param.int_value_);
+                }
+                return true;
+            case MYSQL_TYPE_DOUBLE:
+                append_number(param.double_value_);
+                return true;
+            case MYSQL_TYPE_STRING:
+                return true;
+            default:
+                return false;
+        }
+    }
+    void encode_insert_row(const StmtParams& row) {
+        row_ += '(';
+        for (std::size_t i = 0; i < row.size(); ++i) {
+            if (i) row_ += ',';
+            const auto& param = row[i];
+            if (!append_value(param)) {
+                row_ += "NULL";
+            } else if (param.type_ == MYSQL_TYPE_STRING) {
+                row_ += '\'';
+                for (auto c : param.str_value_) {
+                    switch (c) {
+                        case '\0': row_ += "\\0"; break;
+                        case '\n': row_ += "\\n"; break;
+                        case '\r': row_ += "\\r"; break;
+                        case '\x1a': row_ += "\\Z"; break;
+                        case '\\':
+                        case '\'':
+                        case '"':
+                            row_ += '\\';
+                            row_ += c;
+                            break;
+                        default: row_ += c; break;
+                    }
+                }
+                row_ += '\'';
+            }
+        }
+        row_ += ')';
+    }
+    void encode_tsv_row(const StmtParams& row) {
+        for (std::size_t i = 0; i < row.size(); ++i) {
+            if (i) row_ += '\t';
+            const auto& param = row[i];
+            if (!append_value(param)) {
+                row_ += "\\N";
+            } else if (param.type_ == MYSQL_TYPE_STRING) {
+                for (auto c : param.str_value_) {
+                    switch (c) {
+                        case '\0': row_ += "\\0"; break;
+                        case '\n': row_ += "\\n"; break;
+                        case '\r': row_ += "\\r"; break;
+                        case '\t': row_ += "\\t"; break;
+                        case '\\': row_ += "\\\\"; break;
+                        default: row_ += c; break;
+                    }
+                }
+            }
+        }
+        row_ += '\n';
+    }
+};
+using BulkWriterPtr = std::shared_ptr<BulkWriter>;
+}  // namespace db
@@ -1,16 +1,20 @@
 #pragma once
 
 #include <deque>
+#include <future>
 #include <list>
 #include <memory>
 #include <shared_mutex>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <thread>
 #include <unordered_set>
 
 #include "io_context_pool.hpp"
+#include "mysql_awaitable.hpp"
 #include "mysql_connection_pool.hpp"
+#include "mysql_row_mapping.hpp"
 
 using namespace std::chrono_literals;
 namespace db {
@@ -21,22 +25,219 @@ class MysqlClient : public std::enable_shared_from_this<MysqlClient> {
     MysqlPoolPtr mysql_pool_ptr_;
 
    public:
-    MysqlClient(const ConnectionInfo& conn_info, const std::size_t min_conn_num, const std::size_t max_conn_num)
-        : io_context_(1),
+    /**
+     * @brief 创建客户端
+     *
+     * @param conn_info 数据库登陆信息
+     * @param min_conn_num 连接池最少连接数
+     * @param max_conn_num 连接池最多连接数
+     * @param thread_num io线程数, 连接会轮询分布到各个io线程上
+     * @param options 连接池的可选配置, 如流水线深度
+     */
+    MysqlClient(const ConnectionInfo& conn_info, const std::size_t min_conn_num, const std::size_t max_conn_num, const std::size_t thread_num = 1,
+                const PoolOptions& options = PoolOptions())
+        : io_context_(thread_num == 0 ? 1 : thread_num),
           conn_info_(conn_info),
-          mysql_pool_ptr_(std::make_shared<MysqlConnectionPool>(io_context_.get_io_context(), min_conn_num, max_conn_num, conn_info_)) {}
-    void init() {
+          mysql_pool_ptr_(std::make_shared<MysqlConnectionPool>(io_context_, min_conn_num, max_conn_num, conn_info_, options)) {}
+    /**
+     * @brief 启动io线程并在各个io线程上并行建立min_conn_num个连接, 不阻塞
+     * 返回的future在连接全部建立后就绪; 超时, 或初始连接都已结束但不足min_conn_num时抛出 MysqlException
+     * 例: client->init().get();
+     *
+     * @param timeout 0为不限
+     * @return std::future<void>
+     */
+    std::future<void> init(std::chrono::milliseconds timeout = 10s) {
+        auto promise = std::make_shared<std::promise<void>>();
+        auto future = promise->get_future();
         io_context_.run();
-        mysql_pool_ptr_->init();
-        std::this_thread::sleep_for(1s);
+        mysql_pool_ptr_->init(
+            [promise](std::exception_ptr error) {
+                if (error) {
+                    promise->set_exception(error);
+                } else {
+                    promise->set_value();
+                }
+            },
+            timeout);
+        return future;
+    }
+    /**
+     * @brief 等待init建立的连接就绪, 支持 asio::use_awaitable 等完成令牌
+     * 例: co_await client->async_wait_ready(asio::use_awaitable);
+     *
+     * @param token 完成签名为 void(std::exception_ptr)
+     */
+    template <typename CompletionToken>
+    auto async_wait_ready(CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, void(std::exception_ptr)>(
+            [pool = mysql_pool_ptr_](auto handler) {
+                using Handler = decltype(handler);
+                // std::function needs a copyable callable, the handler may be move-only
+                auto work = std::make_shared<decltype(asio::make_work_guard(handler))>(asio::make_work_guard(handler));
+                auto handler_ptr = std::make_shared<Handler>(std::move(handler));
+                pool->on_ready([handler_ptr, work](std::exception_ptr error) {
+                    asio::dispatch(work->get_executor(), [handler_ptr, work, error]() { std::move(*handler_ptr)(error); });
+                });
+            },
+            token);
     }
     void join() { io_context_.join(); }
+    void stop() { io_context_.stop(); }
+    /**
+     * @brief 已创建以及正在创建的连接数
+     */
+    std::size_t connection_count() const noexcept { return mysql_pool_ptr_->connection_count(); }
+    /**
+     * @brief 连接池统计的快照, 见 MysqlConnectionPool::metrics
+     */
+    MetricsSnapshot metrics() const { return mysql_pool_ptr_->metrics(); }
     void close_all();
     void execute(const char* sql) { mysql_pool_ptr_->execute_sql(sql); }
     void query(const char* sql, ResultPtrCallback&& result_callback, ExceptPtrCallback ec_callback = nullptr) {
         mysql_pool_ptr_->execute_sql(sql, std::move(result_callback), std::move(ec_callback));
     }
+    /**
+     * @brief 带截止时间的查询, 排队与执行都计算在内
+     * 排队超过deadline时以 ErrorCode::DeadlineExceeded 失败, 不再执行; 执行中超过时以 ErrorCode::Timeout 失败并KILL QUERY
+     *
+     * @param sql
+     * @param deadline
+     * @param result_callback
+     * @param ec_callback
+     */
+    void query(const char* sql, Deadline deadline, ResultPtrCallback&& result_callback, ExceptPtrCallback ec_callback = nullptr) {
+        mysql_pool_ptr_->execute_sql(sql, std::move(result_callback), std::move(ec_callback), deadline);
+    }
+    /**
+     * @brief 积压队列中的命令数
+     *
+     * @return std::size_t
+     */
+    std::size_t backlog() const noexcept { return mysql_pool_ptr_->backlog(); }
+    /**
+     * @brief 以服务端预处理语句执行, 每个连接按sql文本缓存MYSQL_STMT, 结果为二进制协议的行
+     * 例: client->query("select name from user where id = ?", db::make_params(42), cb);
+     *
+     * @param sql 以?作为参数占位符
+     * @param params
+     * @param result_callback
+     * @param ec_callback
+     */
+    void query(const char* sql, StmtParams&& params, ResultPtrCallback&& result_callback, ExceptPtrCallback ec_callback = nullptr) {
+        mysql_pool_ptr_->execute_sql(sql, std::move(params), std::move(result_callback), std::move(ec_callback));
+    }
+    void execute(const char* sql, StmtParams&& params) { mysql_pool_ptr_->execute_sql(sql, std::move(params)); }
+    /**
+     * @brief 流式查询, 大结果集按批回调, 不在客户端缓存整个结果集
+     * 消费者处理完一批后调用next(true)才会读取下一批, next(false)放弃剩余的行
+     *
+     * @param sql
+     * @param batch_rows 每批的行数
+     * @param batch_callback
+     * @param ec_callback
+     */
+    void query_stream(const char* sql, std::size_t batch_rows, RowBatchCallback&& batch_callback, ExceptPtrCallback ec_callback = nullptr) {
+        mysql_pool_ptr_->query_stream(sql, batch_rows, std::move(batch_callback), std::move(ec_callback));
+    }
+
+    /**
+     * @brief 异步查询, 支持 asio::use_awaitable, asio::use_future, asio::deferred 等完成令牌
+     * 例: auto result = co_await client->async_query("select 1", asio::use_awaitable);
+     * 处理器关联了cancellation_slot时支持取消, 排队中的命令被丢弃, 执行中的命令被KILL QUERY
+     *
+     * @param sql
+     * @param token 完成签名为 void(std::exception_ptr, MysqlResultPtr)
+     */
+    template <typename CompletionToken>
+    auto async_query(std::string_view sql, CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, QuerySignature>(
+            [pool = mysql_pool_ptr_](auto handler, SqlText sql) {
+                auto op = detail::make_query_operation(std::move(handler));
+                auto [result_callback, ec_callback] = op->make_callbacks(op);
+                auto canceller = op->bind_cancellation(op);
+                pool->execute_sql(std::move(sql), std::move(result_callback), std::move(ec_callback), Deadline::max(), std::move(canceller));
+            },
+            token, SqlText(sql));
+    }
+    template <typename CompletionToken>
+    auto async_query(std::string_view sql, StmtParams&& params, CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, QuerySignature>(
+            [pool = mysql_pool_ptr_](auto handler, SqlText sql, StmtParams params) {
+                auto op = detail::make_query_operation(std::move(handler));
+                auto [result_callback, ec_callback] = op->make_callbacks(op);
+                auto canceller = op->bind_cancellation(op);
+                pool->execute_sql(std::move(sql), std::move(params), std::move(result_callback), std::move(ec_callback), Deadline::max(), std::move(canceller));
+            },
+            token, SqlText(sql), std::move(params));
+    }
+    /**
+     * @brief 经结果缓存查询, 需要开启 PoolOptions::result_cache_bytes, 见 ResultCache
+     *
+     * @param sql
+     * @param ttl
+     * @param tables 结果依赖的表, execute_tagged/invalidate_cache 这些表时结果失效
+     * @param result_callback
+     * @param ec_callback
+     */
+    void query_cached(const char* sql, std::chrono::milliseconds ttl, const CacheTags& tables, ResultPtrCallback&& result_callback,
+                      ExceptPtrCallback ec_callback = nullptr) {
+        mysql_pool_ptr_->query_cached(sql, ttl, tables, std::move(result_callback), std::move(ec_callback));
+    }
+    /**
+     * @brief 执行修改tables的语句, 完成后使依赖这些表的缓存结果失效
+     *
+     * @param sql
+     * @param tables
+     * @param result_callback
+     * @param ec_callback
+     */
+    void execute_tagged(const char* sql, const CacheTags& tables, ResultPtrCallback&& result_callback = nullptr, ExceptPtrCallback ec_callback = nullptr) {
+        mysql_pool_ptr_->execute_tagged(sql, tables, std::move(result_callback), std::move(ec_callback));
+    }
+    void invalidate_cache(const CacheTags& tables) { mysql_pool_ptr_->invalidate_cache(tables); }
+    /**
+     * @brief 按整数键的点查, 见 MysqlConnectionPool::lookup
+     *
+     * @param sql 以 "<键列> = ?" 结尾的模板
+     * @param key
+     * @param result_callback
+     * @param ec_callback
+     */
+    void lookup(const char* sql, long long key, ResultPtrCallback&& result_callback, ExceptPtrCallback ec_callback = nullptr) {
+        mysql_pool_ptr_->lookup(sql, key, std::move(result_callback), std::move(ec_callback));
+    }
+    /**
+     * @brief 创建批量写入器, 见 BulkWriter
+     *
+     * @param table
+     * @param columns
+     * @param options
+     * @param batch_callback 每批完成后回调
+     * @return BulkWriterPtr
+     */
+    BulkWriterPtr new_bulk_writer(std::string_view table, const std::vector<std::string>& columns, const BulkOptions& options = {},
+                                  BulkBatchCallback&& batch_callback = nullptr) {
+        auto executor = [pool = mysql_pool_ptr_](SqlText&& sql, std::unique_ptr<std::string>&& data, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+            if (data) {
+                pool->execute_load_data(std::move(sql), std::move(*data), std::move(rcb), std::move(ecb));
+            } else {
+                pool->execute_sql(std::move(sql), std::move(rcb), std::move(ecb));
+            }
+        };
+        return std::make_shared<BulkWriter>(std::move(executor), io_context_.get_io_context(), table, columns, options, std::move(batch_callback));
+    }
+    /**
+     * @brief 获取事务, 阻塞调用线程直到有空闲连接; 不能在io线程上调用, 否则抛出 std::logic_error
+     * 不希望阻塞时使用 new_transaction_async 或 async_new_transaction
+     *
+     * @param commit_callback 提交或回滚后回调, 参数为是否提交成功
+     * @return MysqlTransactionPtr 排队已满时为空
+     */
     MysqlTransactionPtr new_transaction(std::function<void(bool)>&& commit_callback) {
+        if (mysql_pool_ptr_->is_io_thread()) {
+            throw std::logic_error("new_transaction blocks and would stall the io thread, use new_transaction_async instead");
+        }
         std::promise<MysqlTransactionPtr> pro;
         auto f = pro.get_future();
         mysql_pool_ptr_->new_transaction_async([&pro](const MysqlTransactionPtr& trans) {
@@ -50,5 +251,90 @@ class MysqlClient : public std::enable_shared_from_this<MysqlClient> {
         trans->set_commit_callback(commit_callback);
         return trans;
     }
+    /**
+     * @brief 获取事务, 不阻塞, 可以在任何线程上调用
+     * callback在事务所在连接的strand上执行, 在其中直接调用事务的 execute_sql 即可
+     *
+     * @param callback 排队已满时参数为空
+     * @param commit_callback
+     */
+    void new_transaction_async(MysqlConnectionPool::TransactionPtrCallback&& callback, std::function<void(bool)>&& commit_callback = nullptr) {
+        mysql_pool_ptr_->new_transaction_async([callback = std::move(callback), commit_callback = std::move(commit_callback)](const MysqlTransactionPtr& trans) {
+            if (trans && commit_callback) trans->set_commit_callback(commit_callback);
+            callback(trans);
+        });
+    }
+    /**
+     * @brief 获取事务, 支持 asio::use_awaitable 等完成令牌
+     * 例: auto trans = co_await client->async_new_transaction(asio::use_awaitable);
+     * 排队已满时以 ErrorCode::Overloaded 的 MysqlException 完成
+     *
+     * @param token 完成签名为 void(std::exception_ptr, MysqlTransactionPtr)
+     */
+    template <typename CompletionToken>
+    auto async_new_transaction(CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, void(std::exception_ptr, MysqlTransactionPtr)>(
+            [pool = mysql_pool_ptr_](auto handler) {
+                using Handler = decltype(handler);
+                // std::function needs a copyable callable, the handler may be move-only
+                auto work = std::make_shared<decltype(asio::make_work_guard(handler))>(asio::make_work_guard(handler));
+                auto handler_ptr = std::make_shared<Handler>(std::move(handler));
+                pool->new_transaction_async([handler_ptr, work](const MysqlTransactionPtr& trans) {
+                    std::exception_ptr error;
+                    if (!trans) error = std::make_exception_ptr(MysqlException(ErrorCode::Overloaded, "too many queued transactions"));
+                    asio::dispatch(work->get_executor(), [handler_ptr, work, error, trans]() { std::move(*handler_ptr)(error, trans); });
+                });
+            },
+            token);
+    }
+    /**
+     * @brief 执行事务, 死锁或锁等待超时时按policy重新执行body, 见 MysqlConnectionPool::run_transaction
+     *
+     * @param body 在事务所在连接的strand上调用, 释放事务后提交
+     * @param done 提交成功时参数为空
+     * @param policy
+     */
+    void run_transaction(MysqlConnectionPool::TransactionBody&& body, ExceptPtrCallback&& done,
+                         const TransactionRetryPolicy& policy = TransactionRetryPolicy()) {
+        mysql_pool_ptr_->run_transaction(std::move(body), std::move(done), policy);
+    }
+    /**
+     * @brief 以协程作为事务体执行事务, 死锁或锁等待超时时按policy重试; 事务体正常返回后提交, 抛出异常时回滚
+     * 例: co_await client->async_run_transaction([](db::MysqlTransactionPtr trans) -> asio::awaitable<void> {
+     *         co_await trans->async_execute_sql("update account set balance = balance - 1 where id = 1", asio::use_awaitable);
+     *     }, asio::use_awaitable);
+     *
+     * @param body 每次执行都重新调用, 返回的协程在事务所在连接的strand上运行
+     * @param token 完成签名为 void(std::exception_ptr), 提交成功时为空, 否则为事务体抛出的异常或导致回滚的错误
+     * @param policy
+     */
+    template <typename CompletionToken>
+    auto async_run_transaction(std::function<asio::awaitable<void>(MysqlTransactionPtr)> body, CompletionToken&& token,
+                               const TransactionRetryPolicy& policy = TransactionRetryPolicy()) {
+        return asio::async_initiate<CompletionToken, void(std::exception_ptr)>(
+            [pool = mysql_pool_ptr_, policy](auto handler, std::function<asio::awaitable<void>(MysqlTransactionPtr)> body) {
+                using Handler = decltype(handler);
+                auto work = std::make_shared<decltype(asio::make_work_guard(handler))>(asio::make_work_guard(handler));
+                auto handler_ptr = std::make_shared<Handler>(std::move(handler));
+                // the exception thrown by the last attempt's body, reported instead of the bare rollback
+                auto body_error = std::make_shared<std::exception_ptr>();
+                pool->run_transaction(
+                    [body = std::move(body), body_error](const MysqlTransactionPtr& trans) {
+                        *body_error = nullptr;
+                        // the completion handler holds the transaction until the body returns
+                        asio::co_spawn(trans->strand(), body(trans), [trans, body_error](std::exception_ptr error) {
+                            if (!error) return;
+                            *body_error = error;
+                            trans->rollback();
+                        });
+                    },
+                    [handler_ptr, work, body_error](std::exception_ptr error) {
+                        if (error && *body_error) error = *body_error;
+                        asio::dispatch(work->get_executor(), [handler_ptr, work, error]() { std::move(*handler_ptr)(error); });
+                    },
+                    policy);
+            },
+            token, std::move(body));
+    }
 };
 }  // namespace db
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "io_context_pool.hpp"
+#include "mysql_connection_pool.hpp"
+
+namespace db {
+/**
+ * @brief 只读查询在副本之间的负载均衡方式
+ */
+enum class BalancePolicy {
+    LeastOutstanding,  //选进行中请求最少的副本
+    LatencyEwma,       //选 延迟的指数移动平均 * (进行中请求数 + 1) 最小的副本
+};
+
+struct ClusterOptions {
+    BalancePolicy balance_policy = BalancePolicy::LeastOutstanding;
+    // 复制延迟超过这个值的副本不再接收查询, 恢复后重新加入
+    std::chrono::seconds max_replica_lag{5};
+    // 检查复制延迟(SHOW SLAVE STATUS)的间隔, 0为不检查
+    std::chrono::milliseconds lag_check_interval{1000};
+    // 延迟EWMA中新样本的权重
+    double ewma_alpha = 0.2;
+};
+
+/**
+ * @brief 主库加多个只读副本的客户端, 每个节点一个连接池
+ * query 发往副本, execute 与事务发往主库; 没有可用副本时查询也发往主库
+ * 副本的复制线程停止(Seconds_Behind_Master为NULL)或检查失败时视为不可用
+ */
+class MysqlClusterClient : public std::enable_shared_from_this<MysqlClusterClient> {
+   private:
+    struct Endpoint {
+        ConnectionInfo conn_info_;
+        MysqlPoolPtr pool_;
+        std::atomic<std::size_t> outstanding_{0};
+        std::atomic<std::int64_t> ewma_us_{0};  //0表示还没有样本
+        std::atomic<std::int64_t> lag_seconds_{0};
+        std::atomic<bool> is_available_{true};
+
+        Endpoint(IOContextPool& io_pool, const ConnectionInfo& conn_info, std::size_t min_conn_num, std::size_t max_conn_num, const PoolOptions& options)
+            : conn_info_(conn_info), pool_(std::make_shared<MysqlConnectionPool>(io_pool, min_conn_num, max_conn_num, conn_info_, options)) {}
+    };
+    // shared with in-flight callbacks, which must not keep the client (and its io threads) alive
+    using EndpointPtr = std::shared_ptr<Endpoint>;
+
+    IOContextPool io_context_;
+    ClusterOptions options_;
+    EndpointPtr primary_;
+    std::vector<EndpointPtr> replicas_;
+    std::atomic<std::size_t> next_replica_{0};  //同分时轮询的起点
+    std::unique_ptr<asio::steady_timer> lag_timer_;
+
+   public:
+    /**
+     * @brief 创建集群客户端
+     *
+     * @param primary 主库登陆信息
+     * @param replicas 只读副本的登陆信息
+     * @param min_conn_num 每个节点连接池的最少连接数
+     * @param max_conn_num 每个节点连接池的最多连接数
+     * @param thread_num io线程数, 所有节点共用
+     * @param options
+     * @param pool_options 每个节点连接池的可选配置
+     */
+    MysqlClusterClient(const ConnectionInfo& primary, const std::vector<ConnectionInfo>& replicas, const std::size_t min_conn_num, const std::size_t max_conn_num,
+                       const std::size_t thread_num = 1, const ClusterOptions& options = ClusterOptions(), const PoolOptions& pool_options = PoolOptions())
+        : io_context_(thread_num == 0 ? 1 : thread_num),
+          options_(options),
+          primary_(std::make_shared<Endpoint>(io_context_, primary, min_conn_num, max_conn_num, pool_options)) {
+        for (auto& replica : replicas) {
+            replicas_.emplace_back(std::make_shared<Endpoint>(io_context_, replica, min_conn_num, max_conn_num, pool_options));
+        }
+    }
+    /**
+     * @brief 启动io线程并并行建立各节点的连接, 需要通过 std::make_shared 创建后调用
+     * 返回的future在主库的连接就绪后就绪, 见 MysqlClient::init; 初始连接失败的副本先标记为不可用, 由复制延迟检查恢复
+     *
+     * @param timeout 0为不限
+     * @return std::future<void>
+     */
+    std::future<void> init(std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+        auto promise = std::make_shared<std::promise<void>>();
+        auto future = promise->get_future();
+        io_context_.run();
+        primary_->pool_->init(
+            [promise](std::exception_ptr error) {
+                if (error) {
+                    promise->set_exception(error);
+                } else {
+                    promise->set_value();
+                }
+            },
+            timeout);
+        for (auto& replica : replicas_) {
+            replica->pool_->init(
+                [replica](std::exception_ptr error) {
+                    if (error) replica->is_available_.store(false, std::memory_order_relaxed);
+                },
+                timeout);
+        }
+        if (!replicas_.empty() && options_.lag_check_interval.count() > 0) {
+            lag_timer_ = std::make_unique<asio::steady_timer>(io_context_.get_io_context());
+            check_lag();
+        }
+        return future;
+    }
+    void join() { io_context_.join(); }
+    void stop() { io_context_.stop(); }
+
+    /**
+     * @brief 只读查询, 发往负载最低的可用副本
+     *
+     * @param sql
+     * @param result_callback
+     * @param ec_callback
+     */
+    void query(const char* sql, ResultPtrCallback&& result_callback, ExceptPtrCallback ec_callback = nullptr) {
+        auto endpoint = pick_replica();
+        auto start = std::chrono::steady_clock::now();
+        endpoint->outstanding_.fetch_add(1, std::memory_order_relaxed);
+        endpoint->pool_->execute_sql(
+            sql,
+            [endpoint, start, alpha = options_.ewma_alpha, result_callback = std::move(result_callback)](const MysqlResultPtr& result) {
+                finish(*endpoint, start, alpha);
+                if (result_callback) result_callback(result);
+            },
+            [endpoint, start, alpha = options_.ewma_alpha, ec_callback = std::move(ec_callback)](std::exception_ptr except) {
+                finish(*endpoint, start, alpha);
+                if (ec_callback) ec_callback(except);
+            });
+    }
+    /**
+     * @brief 在主库上查询, 用于需要读到自己刚写入数据的场景
+     *
+     * @param sql
+     * @param result_callback
+     * @param ec_callback
+     */
+    void query_primary(const char* sql, ResultPtrCallback&& result_callback, ExceptPtrCallback ec_callback = nullptr) {
+        primary_->pool_->execute_sql(sql, std::move(result_callback), std::move(ec_callback));
+    }
+    void execute(const char* sql) { primary_->pool_->execute_sql(sql); }
+    void execute(const char* sql, ResultPtrCallback&& result_callback, ExceptPtrCallback ec_callback = nullptr) {
+        primary_->pool_->execute_sql(sql, std::move(result_callback), std::move(ec_callback));
+    }
+    void execute(const char* sql, StmtParams&& params, ResultPtrCallback&& result_callback = nullptr, ExceptPtrCallback ec_callback = nullptr) {
+        primary_->pool_->execute_sql(sql, std::move(params), std::move(result_callback), std::move(ec_callback));
+    }
+    /**
+     * @brief 在主库上获取事务, 阻塞调用线程, 见 MysqlClient::new_transaction
+     */
+    MysqlTransactionPtr new_transaction(std::function<void(bool)>&& commit_callback) {
+        if (primary_->pool_->is_io_thread()) {
+            throw std::logic_error("new_transaction blocks and would stall the io thread, use new_transaction_async instead");
+        }
+        std::promise<MysqlTransactionPtr> pro;
+        auto f = pro.get_future();
+        primary_->pool_->new_transaction_async([&pro](const MysqlTransactionPtr& trans) {
+            pro.set_value(trans);
+        });
+        auto trans = f.get();
+        if (!trans) {
+            return nullptr;
+        }
+        trans->set_commit_callback(commit_callback);
+        return trans;
+    }
+
+    /**
+     * @brief 在主库上获取事务, 不阻塞, 见 MysqlClient::new_transaction_async
+     */
+    void new_transaction_async(MysqlConnectionPool::TransactionPtrCallback&& callback, std::function<void(bool)>&& commit_callback = nullptr) {
+        primary_->pool_->new_transaction_async([callback = std::move(callback), commit_callback = std::move(commit_callback)](const MysqlTransactionPtr& trans) {
+            if (trans && commit_callback) trans->set_commit_callback(commit_callback);
+            callback(trans);
+        });
+    }
+    /**
+     * @brief 在主库上执行事务, 死锁或锁等待超时时重试, 见 MysqlConnectionPool::run_transaction
+     */
+    void run_transaction(MysqlConnectionPool::TransactionBody&& body, ExceptPtrCallback&& done,
+                         const TransactionRetryPolicy& policy = TransactionRetryPolicy()) {
+        primary_->pool_->run_transaction(std::move(body), std::move(done), policy);
+    }
+    const MysqlPoolPtr& primary() const noexcept { return primary_->pool_; }
+    std::size_t replica_count() const noexcept { return replicas_.size(); }
+    /**
+     * @brief 第index个副本最近一次检查到的复制延迟(秒), 副本不可用时为-1
+     *
+     * @param index
+     * @return std::int64_t
+     */
+    std::int64_t replica_lag(std::size_t index) const {
+        auto& replica = *replicas_.at(index);
+        return replica.is_available_.load(std::memory_order_relaxed) ? replica.lag_seconds_.load(std::memory_order_relaxed) : -1;
+    }
+    std::size_t replica_outstanding(std::size_t index) const { return replicas_.at(index)->outstanding_.load(std::memory_order_relaxed); }
+
+   private:
+    const EndpointPtr& pick_replica() {
+        const EndpointPtr* best = nullptr;
+        double best_score = 0;
+        auto size = replicas_.size();
+        auto first = size ? next_replica_.fetch_add(1, std::memory_order_relaxed) : 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            auto& replica_ptr = replicas_[(first + i) % size];
+            auto& replica = *replica_ptr;
+            if (!replica.is_available_.load(std::memory_order_relaxed)) continue;
+            double outstanding = static_cast<double>(replica.outstanding_.load(std::memory_order_relaxed));
+            double score = outstanding;
+            if (options_.balance_policy == BalancePolicy::LatencyEwma) {
+                // a replica without samples scores as the fastest so that it gets measured
+                score = static_cast<double>(replica.ewma_us_.load(std::memory_order_relaxed)) * (outstanding + 1);
+            }
+            if (!best || score < best_score) {
+                best = &replica_ptr;
+                best_score = score;
+            }
+        }
+        return best ? *best : primary_;
+    }
+    static void finish(Endpoint& endpoint, std::chrono::steady_clock::time_point start, double alpha) {
+        endpoint.outstanding_.fetch_sub(1, std::memory_order_relaxed);
+        auto sample = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        auto ewma = endpoint.ewma_us_.load(std::memory_order_relaxed);
+        std::int64_t next;
+        do {
+            next = ewma == 0 ? sample : static_cast<std::int64_t>(alpha * sample + (1 - alpha) * ewma);
+        } while (!endpoint.ewma_us_.compare_exchange_weak(ewma, std::max<std::int64_t>(next, 1), std::memory_order_relaxed));
+    }
+    void check_lag() {
+        for (auto& replica : replicas_) {
+            replica->pool_->execute_sql(
+                "SHOW SLAVE STATUS",
+                [replica, max_lag = options_.max_replica_lag.count()](const MysqlResultPtr& result) {
+                    // an empty result means the server is not replicating from anyone; treat it as up to date
+                    if (result->size() == 0) {
+                        replica->lag_seconds_.store(0, std::memory_order_relaxed);
+                        replica->is_available_.store(true, std::memory_order_relaxed);
+                        return;
+                    }
+                    // a replica whose lag can not be read is not trusted
+                    auto column = result->columnNumber("Seconds_Behind_Master");
+                    if (column >= result->columns()) {
+                        replica->lag_seconds_.store(-1, std::memory_order_relaxed);
+                        replica->is_available_.store(false, std::memory_order_relaxed);
+                        return;
+                    }
+                    auto lag = result->get<std::optional<std::int64_t>>(0, column);
+                    replica->lag_seconds_.store(lag.value_or(-1), std::memory_order_relaxed);
+                    replica->is_available_.store(lag && *lag <= max_lag, std::memory_order_relaxed);
+                },
+                [replica](std::exception_ptr) {
+                    replica->is_available_.store(false, std::memory_order_relaxed);
+                });
+        }
+        lag_timer_->expires_after(options_.lag_check_interval);
+        lag_timer_->async_wait([weak_this = weak_from_this()](const asio::error_code& ec) {
+            auto this_ptr = weak_this.lock();
+            if (ec || !this_ptr) return;
+            this_ptr->check_lag();
+        });
+    }
+};
+using MysqlClusterClientPtr = std::shared_ptr<MysqlClusterClient>;
+}  // namespace db
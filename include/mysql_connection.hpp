@@ -1,14 +1,26 @@
 #pragma once
 
+#include <errno.h>
+#include <mariadb/errmsg.h>
 #include <mariadb/mysql.h>
 #include <mariadb/mysqld_error.h>
+#include <strings.h>
+#include <unistd.h>
 
 #include <asio.hpp>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "mysql_error.hpp"
+#include "mysql_metrics.hpp"
 #include "mysql_result.hpp"
+#include "mysql_statement.hpp"
+#include "sql_text.hpp"
 namespace db {
 class Channel;  // tcp connection used for read and write
 enum class ConnectStatus { None = 0,
@@ -37,40 +49,113 @@ using MysqlConnectionPtr = std::shared_ptr<MysqlConnection>;
 using ResultPtrCallback = std::function<void(const MysqlResultPtr&)>;
 using ExceptPtrCallback = std::function<void(std::exception_ptr)>;
 using ConnectionCallback = std::function<void(const MysqlConnectionPtr&)>;
+/**
+ * @brief 流式查询每一批结果的回调
+ * is_last 为false时, 连接在next被调用之前不会再从socket读取; next(true)继续读下一批, next(false)放弃剩余的行
+ * is_last 为true时next为空, 这一批可能为空
+ */
+using RowBatchCallback = std::function<void(const MysqlResultPtr& batch, bool is_last, std::function<void(bool)>&& next)>;
+using Deadline = std::chrono::steady_clock::time_point;
+class QueryCanceller;
 struct SqlCmd {
-    std::string_view sql_;
+    SqlText sql_;  //排队期间调用方的缓冲区可能已经失效, 所以这里持有一份拷贝, 执行时移入连接
     ResultPtrCallback result_callback_;
     ExceptPtrCallback exception_callback_;
-    SqlCmd(std::string_view&& sql,
+    std::unique_ptr<StmtParams> params_;  //非空时以预处理语句执行
+    RowBatchCallback batch_callback_;     //非空时以流式查询执行
+    std::size_t batch_rows_ = 0;
+    std::unique_ptr<std::string> infile_data_;  //非空时为LOAD DATA LOCAL INFILE语句, 文件内容来自这里
+    Deadline deadline_ = Deadline::max();   //调用方的截止时间, 排队与执行都计算在内
+    Deadline expire_at_ = Deadline::max();  //排队超过这个时间则不再执行
+    std::chrono::steady_clock::time_point enqueued_at_;  //进入积压队列的时间, 用于统计排队等待
+    std::shared_ptr<QueryCanceller> canceller_;
+    SqlCmd(SqlText&& sql,
            ResultPtrCallback&& cb,
            ExceptPtrCallback&& exceptCb)
         : sql_(std::move(sql)),
           result_callback_(std::move(cb)),
           exception_callback_(std::move(exceptCb)) {
     }
+    bool is_expired(Deadline now) const noexcept { return now > expire_at_; }
+    bool is_text_query() const { return !params_ && !batch_callback_ && !infile_data_; }
+    /**
+     * @brief 能否放入流水线的一批
+     * 可取消或有截止时间的命令单独执行, 超时与取消不会牵连同一批的其它语句
+     *
+     * @return bool
+     */
+    bool is_batchable() const { return is_text_query() && !canceller_ && deadline_ == Deadline::max(); }
+    /**
+     * @brief 能否与其后的语句合并成一个multi statement发送
+     * 包含';'的语句或存储过程可能返回多个结果集, 只能放在一批的最后
+     *
+     * @return bool
+     */
+    bool is_pipelinable() const {
+        if (!is_batchable()) return false;
+        if (sql_.find(';') != std::string_view::npos) return false;
+        auto pos = sql_.find_first_not_of(" \t\r\n(");
+        if (pos == std::string::npos) return false;
+        return strncasecmp(sql_.data() + pos, "call", 4) != 0;
+    }
 };
+using SqlCmdPtr = std::unique_ptr<SqlCmd>;
 class MysqlConnection : public std::enable_shared_from_this<MysqlConnection> {
+   public:
+    using Strand = asio::strand<asio::io_context::executor_type>;
+
    private:
     enum class ExecStatus { None = 0,
                             RealQuery,
                             StoreResult,
-                            NextResult };
+                            NextResult,
+                            StmtPrepare,
+                            StmtExecute,
+                            FetchRow };
     bool is_working_ = false;
     std::shared_ptr<MYSQL> mysql_ptr_;
     asio::io_context& io_context_;
+    Strand strand_;  //连接上的协程与回调都在此strand上串行执行
     asio::ip::tcp::socket socket_;
+    StatementCache stmt_cache_;  //按sql文本缓存的预处理语句
+    std::string connect_error_;  //建立连接失败的原因, 成功时为空
+    SchemaCache schema_cache_;   //按sql文本缓存的字段名字表
     ConnectionInfo conn_info_;
-    ConnectStatus conn_status_{ConnectStatus::None};
+    std::atomic<ConnectStatus> conn_status_{ConnectStatus::None};  //连接池会在其他线程上读取
     ExecStatus exec_status_{ExecStatus::None};
 
-    std::string sql_;
+    SqlText sql_;
     ResultPtrCallback result_callback_;
     ExceptPtrCallback ec_callback_;
+    StmtParams params_;
+    bool is_prepared_ = false;
+    RowBatchCallback batch_callback_;
+    std::size_t batch_rows_ = 0;
+    asio::steady_timer resume_timer_;  //流式查询等待消费者调用next
+    bool is_resumed_ = false;
+    bool keep_streaming_ = true;
+    asio::steady_timer timeout_timer_;  //连接超时与查询超时
+    std::chrono::milliseconds connect_timeout_{0};
+    std::chrono::milliseconds query_timeout_{0};
+    Deadline deadline_ = Deadline::max();  //本次执行的截止时间
+    std::shared_ptr<QueryCanceller> canceller_;
+    std::atomic<std::uint64_t> execution_id_{0};  //每次执行加一, 用于识别超时与取消针对的是哪一次执行
+    bool is_aborted_ = false;                     //调用方已经因超时或取消收到错误, 之后的结果被丢弃
+    MysqlConnectionPtr killer_;                   //发送KILL QUERY的临时连接
+    std::string infile_data_;                     // LOAD DATA LOCAL INFILE 读取的内存数据
+    std::size_t infile_offset_ = 0;
+    bool has_infile_ = false;
+    std::vector<SqlCmdPtr> pipeline_;  //流水线模式下本次合并发送的语句, 第i个结果集属于第i条语句
+    std::size_t pipeline_index_ = 0;
+    bool is_pipeline_tail_done_ = false;  //批中最后一条语句已经收到结果
+    unsigned long client_flag_ = 0;
+    ResultLayout result_layout_ = ResultLayout::RowMajor;
     ConnectionCallback connected_callback_{[](const MysqlConnectionPtr&) {}};
     ConnectionCallback closed_callback_{[](const MysqlConnectionPtr&) {}};
     std::function<void()> complete_callback_;
 
-    unsigned int reconnect_{1};
+    std::chrono::steady_clock::time_point last_active_;  //最近一次完成语句或ping的时间, 用于空闲保活
+    PoolMetricsPtr metrics_;                             //所属连接池的统计, 可以为空
     std::thread::id thread_id_;
 
    public:
@@ -81,54 +166,421 @@ class MysqlConnection : public std::enable_shared_from_this<MysqlConnection> {
                                                 delete p;
                                             })),
           io_context_(io_context),
+          strand_(asio::make_strand(io_context_)),
           socket_(io_context_),
-          conn_info_(conn_info) {
+          conn_info_(conn_info),
+          resume_timer_(io_context_),
+          timeout_timer_(io_context_) {
         mysql_init(mysql_ptr_.get());
         mysql_options(mysql_ptr_.get(), MYSQL_OPT_NONBLOCK, nullptr);
+        // LOAD DATA LOCAL INFILE is served from memory only, the handler never opens a local file
+        unsigned int local_infile = 1;
+        mysql_options(mysql_ptr_.get(), MYSQL_OPT_LOCAL_INFILE, &local_infile);
+        mysql_set_local_infile_handler(mysql_ptr_.get(), &MysqlConnection::infile_init, &MysqlConnection::infile_read, &MysqlConnection::infile_end,
+                                       &MysqlConnection::infile_error, this);
+    }
+    ~MysqlConnection() {
+        // the cached statements are closed after mysql_close, which invalidates them,
+        // so mysql_stmt_close only frees memory instead of sending COM_STMT_CLOSE on a nonblocking handle
+        auto stmts = stmt_cache_.release();
+        asio::error_code ec;
+        socket_.close(ec);
+        mysql_ptr_.reset();
+        for (auto stmt : stmts) {
+            mysql_stmt_close(stmt);
+        }
     }
-    ~MysqlConnection() { std::cout << "connection disconnected\n"; }
 
-    void execute_sql(std::string_view sql, ResultPtrCallback&& result_callback, ExceptPtrCallback&& ec_callback) {
+    /**
+     * @brief 执行sql, 排队的命令把自己的sql移入这里, 直接调用时拷贝一次
+     *
+     * @param sql
+     * @param result_callback
+     * @param ec_callback
+     */
+    void execute_sql(SqlText&& sql, ResultPtrCallback&& result_callback, ExceptPtrCallback&& ec_callback) {
         result_callback_ = std::move(result_callback);
         ec_callback_ = std::move(ec_callback);
-        sql_ = std::string(sql);
+        sql_ = std::move(sql);
+        is_working_ = true;
+        begin_execution();
+        start_execute();
+    }
+    /**
+     * @brief 流水线模式: 把多条语句用换行加';'拼接后一次发送, 按顺序读回各自的结果集
+     * 结果集少于语句数(例如语句被注释吞掉)时, 没有结果的语句收到错误回调
+     * 某条语句出错时只有它收到错误回调, 其后尚未执行的语句会重新合并发送
+     * 需要先调用enable_multi_statements
+     *
+     * @param cmds
+     */
+    void execute_pipeline(std::vector<SqlCmdPtr>&& cmds) {
+        pipeline_ = std::move(cmds);
+        pipeline_index_ = 0;
+        is_pipeline_tail_done_ = false;
+        build_pipeline_sql();
         is_working_ = true;
-        asio::post(io_context_, [weak_this = std::weak_ptr(shared_from_this())]() {
+        begin_execution();
+        start_execute();
+    }
+    /**
+     * @brief 以预处理语句执行, 语句在本连接上第一次执行时prepare并缓存, 结果为二进制协议的行
+     *
+     * @param sql 以?作为参数占位符
+     * @param params
+     * @param result_callback
+     * @param ec_callback
+     */
+    void execute_prepared(SqlText&& sql, StmtParams&& params, ResultPtrCallback&& result_callback, ExceptPtrCallback&& ec_callback) {
+        params_ = std::move(params);
+        is_prepared_ = true;
+        execute_sql(std::move(sql), std::move(result_callback), std::move(ec_callback));
+    }
+    /**
+     * @brief 流式查询: 基于mysql_use_result逐行读取, 每batch_rows行回调一次, 不在客户端缓存整个结果集
+     * 消费者处理完一批之后调用next, 在此之前不再读取socket, 服务端因此被反压
+     *
+     * @param sql
+     * @param batch_rows 每批的行数
+     * @param batch_callback
+     * @param ec_callback
+     */
+    void execute_stream(SqlText&& sql, std::size_t batch_rows, RowBatchCallback&& batch_callback, ExceptPtrCallback&& ec_callback) {
+        batch_callback_ = std::move(batch_callback);
+        batch_rows_ = batch_rows == 0 ? 1 : batch_rows;
+        execute_sql(std::move(sql), nullptr, std::move(ec_callback));
+    }
+    /**
+     * @brief 执行 LOAD DATA LOCAL INFILE, 服务端请求的文件内容由data提供, 不读取本地文件
+     *
+     * @param sql LOAD DATA LOCAL INFILE 语句, 文件名会被忽略
+     * @param data 文件内容
+     * @param result_callback
+     * @param ec_callback
+     */
+    void execute_load_data(SqlText&& sql, std::string&& data, ResultPtrCallback&& result_callback, ExceptPtrCallback&& ec_callback) {
+        infile_data_ = std::move(data);
+        infile_offset_ = 0;
+        has_infile_ = true;
+        execute_sql(std::move(sql), std::move(result_callback), std::move(ec_callback));
+    }
+    void enable_multi_statements() { client_flag_ |= CLIENT_MULTI_STATEMENTS; }
+    /**
+     * @brief 连接超时与默认的查询超时, 0表示不限制
+     * 查询超时后调用方立即收到 ErrorCode::Timeout, 语句通过另一个连接KILL QUERY, 本连接读完剩余结果后回到连接池
+     *
+     * @param connect_timeout
+     * @param query_timeout
+     */
+    void set_timeouts(std::chrono::milliseconds connect_timeout, std::chrono::milliseconds query_timeout) {
+        connect_timeout_ = connect_timeout;
+        query_timeout_ = query_timeout;
+    }
+    /**
+     * @brief 下一次执行的截止时间与取消状态, 在execute_*之前设置, 执行完成后恢复
+     *
+     * @param deadline
+     * @param canceller
+     */
+    void set_execution_control(Deadline deadline, std::shared_ptr<QueryCanceller> canceller) {
+        deadline_ = deadline;
+        canceller_ = std::move(canceller);
+    }
+    /**
+     * @brief 取消第execution_id次执行, 该次执行已经结束时什么也不做
+     *
+     * @param execution_id
+     */
+    void cancel(std::uint64_t execution_id) {
+        asio::post(strand_, [weak_this = weak_from_this(), execution_id]() {
             auto this_ptr = weak_this.lock();
             if (!this_ptr) return;
-            asio::co_spawn(this_ptr->io_context_, this_ptr->async_execute(), asio::detached);
+            this_ptr->abort_execution(execution_id, ErrorCode::Cancelled, "query cancelled");
         });
     }
+    void set_stmt_cache_size(std::size_t size) { stmt_cache_.set_capacity(size); }
+    void set_result_layout(ResultLayout layout) { result_layout_ = layout; }
+    void set_metrics(PoolMetricsPtr metrics) { metrics_ = std::move(metrics); }
     void set_connected_callback(ConnectionCallback&& callback) { connected_callback_ = callback; }
     void set_closed_callback(ConnectionCallback&& callback) { closed_callback_ = callback; }
     void set_complete_callback(std::function<void()>&& callback) { complete_callback_ = callback; }
     bool is_working() { return is_working_; }
     ConnectStatus status() { return conn_status_; }
     asio::io_context& io_context() { return io_context_; }
+    /**
+     * @brief 建立连接失败的原因, 在closed回调中可用
+     *
+     * @return const std::string&
+     */
+    const std::string& connect_error() const noexcept { return connect_error_; }
+    Strand& strand() { return strand_; }
 
     void handle_connect() {
-        asio::co_spawn(io_context_, async_connect(), asio::detached);
+        asio::co_spawn(strand_, async_connect(), [weak_this = weak_from_this()](std::exception_ptr e, bool) {
+            auto this_ptr = weak_this.lock();
+            if (e && this_ptr) {
+                // the socket wait failed or was cancelled by the connect timeout
+                this_ptr->fail_connect(what(e));
+            }
+        });
+    }
+    /**
+     * @brief 以mysql_ping检查空闲连接, 连接必须空闲; 失败时不关闭连接, 由调用方决定
+     *
+     * @param callback 参数为连接是否可用, 在连接的strand上调用
+     */
+    void handle_ping(std::function<void(bool)>&& callback) {
+        is_working_ = true;
+        asio::co_spawn(strand_, async_ping(), [weak_this = weak_from_this(), callback = std::move(callback)](std::exception_ptr e, bool is_alive) {
+            auto this_ptr = weak_this.lock();
+            if (!this_ptr) return;
+            this_ptr->is_working_ = false;
+            callback(!e && is_alive);
+        });
     }
+    /**
+     * @brief 距离最近一次完成语句或ping的时间
+     */
+    std::chrono::steady_clock::duration idle_for() const { return std::chrono::steady_clock::now() - last_active_; }
     void handle_close() {
+        conn_status_ = ConnectStatus::Bad;
         if (closed_callback_) {
             closed_callback_(shared_from_this());
         }
     }
 
    private:
+    void start_execute() {
+        asio::post(strand_, [weak_this = std::weak_ptr(shared_from_this())]() {
+            auto this_ptr = weak_this.lock();
+            if (!this_ptr) return;
+            this_ptr->arm_query_timer();
+            auto on_exit = [weak_this](std::exception_ptr e) {
+                auto this_ptr = weak_this.lock();
+                if (e && this_ptr) {
+                    // a failed socket wait leaves the MYSQL handle in the middle of a command
+                    this_ptr->handle_error(CR_SERVER_LOST, what(e).c_str());
+                }
+            };
+            if (this_ptr->is_prepared_) {
+                asio::co_spawn(this_ptr->strand_, this_ptr->async_execute_stmt(), std::move(on_exit));
+            } else if (this_ptr->batch_callback_) {
+                asio::co_spawn(this_ptr->strand_, this_ptr->async_execute_stream(), std::move(on_exit));
+            } else {
+                asio::co_spawn(this_ptr->strand_, this_ptr->async_execute(), std::move(on_exit));
+            }
+        });
+    }
+    static std::string what(const std::exception_ptr& e) {
+        try {
+            std::rethrow_exception(e);
+        } catch (const std::exception& ex) {
+            return ex.what();
+        } catch (...) {
+            return "unknown error";
+        }
+    }
+    void build_pipeline_sql() {
+        sql_.clear();
+        for (auto i = pipeline_index_; i < pipeline_.size(); ++i) {
+            if (i != pipeline_index_) {
+                // the newline ends a trailing "-- " or "#" comment, which would otherwise swallow the next statements
+                sql_.push_back('\n');
+                sql_.push_back(';');
+            }
+            sql_.append(pipeline_[i]->sql_);
+        }
+    }
+    std::string_view current_sql() const noexcept {
+        if (pipeline_.empty()) return sql_;
+        return pipeline_[pipeline_index_]->sql_;
+    }
+    std::chrono::steady_clock::time_point metrics_now() const noexcept {
+        if constexpr (metrics_enabled) {
+            if (metrics_) return std::chrono::steady_clock::now();
+        }
+        return {};
+    }
+    void record_round_trip(std::chrono::steady_clock::time_point start) {
+        if constexpr (metrics_enabled) {
+            if (metrics_) metrics_->round_trip_.record(std::chrono::steady_clock::now() - start);
+        }
+    }
+    void record_decode(std::chrono::steady_clock::time_point start) {
+        if constexpr (metrics_enabled) {
+            if (metrics_) metrics_->decode_time_.record(std::chrono::steady_clock::now() - start);
+        }
+    }
+    void count_failed(std::size_t statements = 1) {
+        if (metrics_) metrics_->failed_.add(statements);
+    }
+    void handle_result(const MysqlResultPtr& result_ptr) {
+        if (metrics_) metrics_->executed_.add();
+        if (pipeline_.empty()) {
+            if (result_callback_) {
+                result_callback_(result_ptr);
+            }
+            return;
+        }
+        // the last statement of a batch may return several result sets
+        auto& cmd = pipeline_[pipeline_index_];
+        if (pipeline_index_ + 1 < pipeline_.size()) {
+            ++pipeline_index_;
+        } else {
+            is_pipeline_tail_done_ = true;
+        }
+        if (cmd->result_callback_) {
+            cmd->result_callback_(result_ptr);
+        }
+    }
+    void begin_execution();
+    void arm_query_timer();
+    void abort_execution(std::uint64_t execution_id, ErrorCode code, const char* message);
+    void kill_query();
+    void fail_connect(std::string message) {
+        connect_error_ = std::move(message);
+        timeout_timer_.cancel();
+        handle_close();
+    }
+    void deliver_batch(const MysqlResultPtr& batch, bool is_last, std::function<void(bool)>&& next) {
+        if (batch_callback_) {
+            batch_callback_(batch, is_last, std::move(next));
+        }
+    }
+    void end_execution() {
+        if (has_infile_) {
+            has_infile_ = false;
+            std::string().swap(infile_data_);
+        }
+        timeout_timer_.cancel();
+        deadline_ = Deadline::max();
+        canceller_.reset();
+        is_aborted_ = false;
+    }
+    void handle_complete() {
+        last_active_ = std::chrono::steady_clock::now();
+        bool was_aborted = is_aborted_;
+        end_execution();
+        // the server returned fewer result sets than the batch has statements, the rest would never complete;
+        // after an abort they have already been failed
+        std::vector<ExceptPtrCallback> missing;
+        if (!pipeline_.empty() && !was_aborted) {
+            for (auto i = pipeline_index_ + (is_pipeline_tail_done_ ? 1 : 0); i < pipeline_.size(); ++i) {
+                missing.push_back(std::move(pipeline_[i]->exception_callback_));
+            }
+        }
+        ec_callback_ = nullptr;
+        result_callback_ = nullptr;
+        pipeline_.clear();
+        pipeline_index_ = 0;
+        is_pipeline_tail_done_ = false;
+        params_.clear();
+        is_prepared_ = false;
+        batch_callback_ = nullptr;
+        is_working_ = false;
+        if (!missing.empty()) {
+            count_failed(missing.size());
+            auto ec_ptr = std::make_exception_ptr(MysqlException(ErrorCode::Server, "pipelined statement returned no result"));
+            for (auto& ec_callback : missing) {
+                if (ec_callback) {
+                    ec_callback(ec_ptr);
+                }
+            }
+        }
+        if (complete_callback_) {
+            complete_callback_();
+        }
+    }
+    asio::awaitable<int> async_wait_status(int status);
+    static int infile_init(void** ptr, const char*, void* userdata) {
+        auto conn = static_cast<MysqlConnection*>(userdata);
+        *ptr = conn;
+        return conn->has_infile_ ? 0 : 1;
+    }
+    static int infile_read(void* ptr, char* buf, unsigned int buf_len) {
+        auto conn = static_cast<MysqlConnection*>(ptr);
+        auto size = std::min<std::size_t>(buf_len, conn->infile_data_.size() - conn->infile_offset_);
+        memcpy(buf, conn->infile_data_.data() + conn->infile_offset_, size);
+        conn->infile_offset_ += size;
+        return static_cast<int>(size);
+    }
+    static void infile_end(void*) {}
+    static int infile_error(void*, char* error_msg, unsigned int error_msg_len) {
+        snprintf(error_msg, error_msg_len, "LOAD DATA LOCAL INFILE is only served through execute_load_data");
+        return CR_UNKNOWN_ERROR;
+    }
     asio::awaitable<bool> async_connect();
+    asio::awaitable<bool> async_ping();
     asio::awaitable<void> async_execute();
+    asio::awaitable<void> async_execute_stmt();
+    asio::awaitable<void> async_close_stmt(MYSQL_STMT* stmt);
+    asio::awaitable<void> async_execute_stream();
+    asio::awaitable<void> async_free_result(MYSQL_RES* result);
+    void resume_stream(bool keep_going) {
+        is_resumed_ = true;
+        keep_streaming_ = keep_going;
+        resume_timer_.cancel();
+    }
     void handle_error();
+    void handle_error(unsigned int error_no, const char* message);
 };
 
+/**
+ * @brief 调用方与执行命令的连接之间共享的取消状态
+ * 命令还在排队时被取消则出队时直接丢弃, 已经在连接上执行时由连接中止并KILL QUERY
+ */
+class QueryCanceller {
+   private:
+    std::mutex mutex_;
+    bool is_cancelled_ = false;
+    std::weak_ptr<MysqlConnection> conn_;
+    std::uint64_t execution_id_ = 0;
+
+   public:
+    bool is_cancelled() {
+        std::lock_guard<std::mutex> locker(mutex_);
+        return is_cancelled_;
+    }
+    /**
+     * @brief 命令开始在conn上执行, 已经被取消时立即中止
+     *
+     * @param conn
+     * @param execution_id
+     */
+    void attach(const MysqlConnectionPtr& conn, std::uint64_t execution_id) {
+        {
+            std::lock_guard<std::mutex> locker(mutex_);
+            if (!is_cancelled_) {
+                conn_ = conn;
+                execution_id_ = execution_id;
+                return;
+            }
+        }
+        conn->cancel(execution_id);
+    }
+    void cancel() {
+        MysqlConnectionPtr conn;
+        std::uint64_t execution_id = 0;
+        {
+            std::lock_guard<std::mutex> locker(mutex_);
+            if (is_cancelled_) return;
+            is_cancelled_ = true;
+            conn = conn_.lock();
+            execution_id = execution_id_;
+        }
+        if (conn) {
+            conn->cancel(execution_id);
+        }
+    }
+};
 inline asio::awaitable<void> MysqlConnection::async_execute() {
     int err = 0;
     int wait_status = 0;
+    auto started = metrics_now();
     wait_status = mysql_real_query_start(&err, mysql_ptr_.get(), sql_.data(), sql_.length());
     exec_status_ = ExecStatus::RealQuery;
     while (wait_status) {
-        co_await socket_.async_wait(asio::ip::tcp::socket::wait_read, asio::use_awaitable);
-        wait_status = mysql_real_query_cont(&err, mysql_ptr_.get(), MYSQL_WAIT_READ);
+        wait_status = mysql_real_query_cont(&err, mysql_ptr_.get(), co_await async_wait_status(wait_status));
     }
     if (err) {
         handle_error();
@@ -139,35 +591,29 @@ inline asio::awaitable<void> MysqlConnection::async_execute() {
         exec_status_ = ExecStatus::StoreResult;
         wait_status = mysql_store_result_start(&result, mysql_ptr_.get());
         while (wait_status) {
-            co_await socket_.async_wait(asio::ip::tcp::socket::wait_read, asio::use_awaitable);
-            wait_status = mysql_store_result_cont(&result, mysql_ptr_.get(), MYSQL_WAIT_READ);
+            wait_status = mysql_store_result_cont(&result, mysql_ptr_.get(), co_await async_wait_status(wait_status));
         }
         if (!result && mysql_errno(mysql_ptr_.get())) {
             handle_error();
             co_return;
         }
+        record_round_trip(started);
+        auto decode_started = metrics_now();
         auto result_ptr = std::shared_ptr<MYSQL_RES>(result, [](MYSQL_RES* r) { mysql_free_result(r); });
-        auto query_result_ptr = std::make_shared<MysqlResult>(result_ptr, mysql_affected_rows(mysql_ptr_.get()), mysql_insert_id(mysql_ptr_.get()));
-        if (result_callback_) {
-            result_callback_(query_result_ptr);
-        }
+        auto schema = result ? schema_cache_.get(current_sql(), mysql_fetch_fields(result), mysql_num_fields(result)) : nullptr;
+        auto query_result_ptr = std::make_shared<MysqlResult>(result_ptr, mysql_affected_rows(mysql_ptr_.get()), mysql_insert_id(mysql_ptr_.get()), result_layout_, std::move(schema));
+        record_decode(decode_started);
+        handle_result(query_result_ptr);
 
         if (!mysql_more_results(mysql_ptr_.get())) {
-            {
-                ec_callback_ = nullptr;
-                result_callback_ = nullptr;
-                is_working_ = false;
-                if (complete_callback_) {
-                    complete_callback_();
-                }
-                co_return;
-            }
+            handle_complete();
+            co_return;
         } else {
             exec_status_ = ExecStatus::NextResult;
+            started = metrics_now();
             wait_status = mysql_next_result_start(&err, mysql_ptr_.get());
             while (wait_status) {
-                co_await socket_.async_wait(asio::ip::tcp::socket::wait_read, asio::use_awaitable);
-                wait_status = mysql_next_result_cont(&err, mysql_ptr_.get(), MYSQL_WAIT_READ);
+                wait_status = mysql_next_result_cont(&err, mysql_ptr_.get(), co_await async_wait_status(wait_status));
             }
             if (wait_status == 0) {
                 if (err) {
@@ -178,56 +624,509 @@ inline asio::awaitable<void> MysqlConnection::async_execute() {
         }
     }
 }
+inline asio::awaitable<void> MysqlConnection::async_execute_stmt() {
+    int err = 0;
+    int wait_status = 0;
+    MYSQL_STMT* stmt = stmt_cache_.find(sql_);
+    if (!stmt) {
+        stmt = mysql_stmt_init(mysql_ptr_.get());
+        if (!stmt) {
+            handle_error();
+            co_return;
+        }
+        exec_status_ = ExecStatus::StmtPrepare;
+        wait_status = mysql_stmt_prepare_start(&err, stmt, sql_.data(), sql_.length());
+        while (wait_status) {
+            wait_status = mysql_stmt_prepare_cont(&err, stmt, co_await async_wait_status(wait_status));
+        }
+        if (err) {
+            auto error_no = mysql_stmt_errno(stmt);
+            std::string message = mysql_stmt_error(stmt);
+            co_await async_close_stmt(stmt);
+            handle_error(error_no, message.c_str());
+            co_return;
+        }
+        my_bool update_max_length = 1;
+        mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_length);
+        if (auto evicted = stmt_cache_.insert(sql_, stmt)) {
+            co_await async_close_stmt(evicted);
+        }
+    }
+    if (mysql_stmt_param_count(stmt) != params_.size()) {
+        auto message = "prepared statement expects " + std::to_string(mysql_stmt_param_count(stmt)) + " parameters, got " + std::to_string(params_.size());
+        handle_error(0, message.c_str());
+        co_return;
+    }
+    std::vector<MYSQL_BIND> param_binds(params_.size());
+    for (std::size_t i = 0; i < params_.size(); ++i) {
+        params_[i].bind(param_binds[i]);
+    }
+    if (!params_.empty() && mysql_stmt_bind_param(stmt, param_binds.data())) {
+        handle_error(mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+        co_return;
+    }
+    exec_status_ = ExecStatus::StmtExecute;
+    auto started = metrics_now();
+    wait_status = mysql_stmt_execute_start(&err, stmt);
+    while (wait_status) {
+        wait_status = mysql_stmt_execute_cont(&err, stmt, co_await async_wait_status(wait_status));
+    }
+    if (err) {
+        handle_error(mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+        co_return;
+    }
+    auto meta = std::shared_ptr<MYSQL_RES>(mysql_stmt_result_metadata(stmt), [](MYSQL_RES* r) {
+        if (r) mysql_free_result(r);
+    });
+    std::shared_ptr<RowBuffer> rows;
+    MysqlResult::SizeType rows_number = 0;
+    std::chrono::steady_clock::time_point decode_started;
+    if (meta) {
+        exec_status_ = ExecStatus::StoreResult;
+        wait_status = mysql_stmt_store_result_start(&err, stmt);
+        while (wait_status) {
+            wait_status = mysql_stmt_store_result_cont(&err, stmt, co_await async_wait_status(wait_status));
+        }
+        if (err) {
+            handle_error(mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+            co_return;
+        }
+        record_round_trip(started);
+        decode_started = metrics_now();
+        // rows are buffered on the client now, fetching below does not touch the socket
+        auto field_count = mysql_num_fields(meta.get());
+        auto fields = mysql_fetch_fields(meta.get());
+        std::vector<MYSQL_BIND> result_binds(field_count);
+        std::vector<std::string> buffers(field_count);
+        std::vector<unsigned long> lengths(field_count);
+        std::vector<my_bool> is_null(field_count);
+        std::vector<my_bool> errors(field_count);
+        std::vector<bool> is_number(field_count);
+        for (unsigned int i = 0; i < field_count; ++i) {
+            is_number[i] = bind_result_column(fields[i], result_binds[i], buffers[i]);
+            result_binds[i].length = &lengths[i];
+            result_binds[i].is_null = &is_null[i];
+            result_binds[i].error = &errors[i];
+        }
+        if (mysql_stmt_bind_result(stmt, result_binds.data())) {
+            handle_error(mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+            co_return;
+        }
+        rows = std::make_shared<RowBuffer>();
+        rows->lengths_.reserve(mysql_stmt_num_rows(stmt) * field_count);
+        std::string column_buffer;
+        for (;;) {
+            int ret = 0;
+            wait_status = mysql_stmt_fetch_start(&ret, stmt);
+            while (wait_status) {
+                wait_status = mysql_stmt_fetch_cont(&ret, stmt, co_await async_wait_status(wait_status));
+            }
+            if (ret == MYSQL_NO_DATA) break;
+            if (ret == 1) {
+                handle_error(mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+                co_return;
+            }
+            for (unsigned int i = 0; i < field_count; ++i) {
+                if (is_null[i]) {
+                    rows->append(nullptr, 0);
+                } else if (is_number[i]) {
+                    rows->append(buffers[i].data(), 8, false);
+                } else if (lengths[i] < result_binds[i].buffer_length) {
+                    rows->append(buffers[i].data(), lengths[i]);
+                } else {
+                    // truncated, fetch the whole column again
+                    column_buffer.resize(lengths[i] + 1);
+                    MYSQL_BIND bind = result_binds[i];
+                    bind.buffer = column_buffer.data();
+                    bind.buffer_length = column_buffer.size();
+                    mysql_stmt_fetch_column(stmt, &bind, i, 0);
+                    rows->append(column_buffer.data(), lengths[i]);
+                }
+            }
+            ++rows_number;
+        }
+        rows->finish();
+        my_bool ret = 0;
+        wait_status = mysql_stmt_free_result_start(&ret, stmt);
+        while (wait_status) {
+            wait_status = mysql_stmt_free_result_cont(&ret, stmt, co_await async_wait_status(wait_status));
+        }
+    }
+    if (!meta) {
+        record_round_trip(started);
+        decode_started = metrics_now();
+    }
+    auto schema = meta ? schema_cache_.get(sql_, mysql_fetch_fields(meta.get()), mysql_num_fields(meta.get())) : nullptr;
+    auto query_result_ptr = std::make_shared<MysqlResult>(meta, rows, rows_number, mysql_stmt_affected_rows(stmt), mysql_stmt_insert_id(stmt), result_layout_, std::move(schema));
+    record_decode(decode_started);
+    handle_result(query_result_ptr);
+    handle_complete();
+}
+inline asio::awaitable<void> MysqlConnection::async_close_stmt(MYSQL_STMT* stmt) {
+    my_bool ret = 0;
+    // COM_STMT_CLOSE has no reply, only wait for the socket being writable again
+    int wait_status = mysql_stmt_close_start(&ret, stmt);
+    while (wait_status) {
+        wait_status = mysql_stmt_close_cont(&ret, stmt, co_await async_wait_status(wait_status));
+    }
+}
+inline asio::awaitable<void> MysqlConnection::async_execute_stream() {
+    int err = 0;
+    int wait_status = 0;
+    wait_status = mysql_real_query_start(&err, mysql_ptr_.get(), sql_.data(), sql_.length());
+    exec_status_ = ExecStatus::RealQuery;
+    while (wait_status) {
+        wait_status = mysql_real_query_cont(&err, mysql_ptr_.get(), co_await async_wait_status(wait_status));
+    }
+    if (err) {
+        handle_error();
+        co_return;
+    }
+    MYSQL_RES* result = mysql_use_result(mysql_ptr_.get());
+    if (!result) {
+        if (mysql_errno(mysql_ptr_.get())) {
+            handle_error();
+            co_return;
+        }
+        // statement without result set
+        deliver_batch(std::make_shared<MysqlResult>(nullptr, mysql_affected_rows(mysql_ptr_.get()), mysql_insert_id(mysql_ptr_.get())), true, nullptr);
+        handle_complete();
+        co_return;
+    }
+    exec_status_ = ExecStatus::FetchRow;
+    auto fields = std::make_shared<const FieldArray>(mysql_fetch_fields(result), mysql_num_fields(result));
+    auto field_count = fields->size();
+    auto schema = schema_cache_.get(sql_, fields->data(), field_count);
+    keep_streaming_ = true;
+    for (;;) {
+        auto rows = std::make_shared<RowBuffer>();
+        MysqlResult::SizeType rows_number = 0;
+        bool is_end = false;
+        while (rows_number < batch_rows_) {
+            MYSQL_ROW row = nullptr;
+            wait_status = mysql_fetch_row_start(&row, result);
+            while (wait_status) {
+                wait_status = mysql_fetch_row_cont(&row, result, co_await async_wait_status(wait_status));
+            }
+            if (!row) {
+                is_end = true;
+                break;
+            }
+            auto lengths = mysql_fetch_lengths(result);
+            for (unsigned int i = 0; i < field_count; ++i) {
+                rows->append(row[i], lengths[i]);
+            }
+            ++rows_number;
+        }
+        if (is_end && mysql_errno(mysql_ptr_.get())) {
+            auto error_no = mysql_errno(mysql_ptr_.get());
+            std::string message = mysql_error(mysql_ptr_.get());
+            co_await async_free_result(result);
+            handle_error(error_no, message.c_str());
+            co_return;
+        }
+        rows->finish();
+        auto batch_ptr = std::make_shared<MysqlResult>(fields, rows, rows_number, result_layout_, schema);
+        if (is_end) {
+            co_await async_free_result(result);
+            deliver_batch(batch_ptr, true, nullptr);
+            break;
+        }
+        is_resumed_ = false;
+        deliver_batch(batch_ptr, false, [weak_this = weak_from_this()](bool keep_going) {
+            auto this_ptr = weak_this.lock();
+            if (!this_ptr) return;
+            asio::post(this_ptr->strand_, [this_ptr, keep_going]() { this_ptr->resume_stream(keep_going); });
+        });
+        if (!is_resumed_ && !is_aborted_) {
+            // backpressure: stop reading the socket until the consumer asks for more
+            asio::error_code ec;
+            resume_timer_.expires_at(asio::steady_timer::time_point::max());
+            co_await resume_timer_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        }
+        if (!keep_streaming_ || is_aborted_) {
+            // frees the result by reading and dropping the remaining rows
+            co_await async_free_result(result);
+            deliver_batch(std::make_shared<MysqlResult>(fields, nullptr, 0, result_layout_, schema), true, nullptr);
+            break;
+        }
+    }
+    while (mysql_more_results(mysql_ptr_.get())) {
+        // only the first result set is streamed, skip the others
+        exec_status_ = ExecStatus::NextResult;
+        wait_status = mysql_next_result_start(&err, mysql_ptr_.get());
+        while (wait_status) {
+            wait_status = mysql_next_result_cont(&err, mysql_ptr_.get(), co_await async_wait_status(wait_status));
+        }
+        if (err) {
+            handle_error();
+            co_return;
+        }
+        if (auto extra = mysql_use_result(mysql_ptr_.get())) {
+            co_await async_free_result(extra);
+        }
+    }
+    handle_complete();
+}
+inline asio::awaitable<void> MysqlConnection::async_free_result(MYSQL_RES* result) {
+    int wait_status = mysql_free_result_start(result);
+    while (wait_status) {
+        wait_status = mysql_free_result_cont(result, co_await async_wait_status(wait_status));
+    }
+}
+/**
+ * @brief 等待非阻塞api返回的条件, 返回实际满足的条件, 交给对应的 *_cont
+ * READ/WRITE/EXCEPT 与 TIMEOUT 可以同时出现, 以先满足的为准; socket等待失败或被取消时抛出异常
+ */
+inline asio::awaitable<int> MysqlConnection::async_wait_status(int status) {
+    using Socket = asio::ip::tcp::socket;
+    // the common case is a single direction without a client side timeout
+    switch (status) {
+        case MYSQL_WAIT_READ:
+            co_await socket_.async_wait(Socket::wait_read, asio::use_awaitable);
+            co_return status;
+        case MYSQL_WAIT_WRITE:
+            co_await socket_.async_wait(Socket::wait_write, asio::use_awaitable);
+            co_return status;
+        case MYSQL_WAIT_EXCEPT:
+            co_await socket_.async_wait(Socket::wait_error, asio::use_awaitable);
+            co_return status;
+        default:
+            break;
+    }
+    struct WaitState {
+        asio::steady_timer signal_;
+        asio::steady_timer timer_;
+        bool is_done_ = false;
+        int ready_ = 0;
+        asio::error_code ec_;
+        explicit WaitState(asio::io_context& io) : signal_(io, asio::steady_timer::time_point::max()), timer_(io) {}
+        void complete(int ready, const asio::error_code& ec) {
+            if (is_done_) return;
+            is_done_ = true;
+            ready_ = ready;
+            ec_ = ec;
+            signal_.cancel();
+        }
+    };
+    auto state = std::make_shared<WaitState>(io_context_);
+    auto watch = [this, &state](int bit, Socket::wait_type type) {
+        socket_.async_wait(type, asio::bind_executor(strand_, [state, bit](const asio::error_code& ec) { state->complete(ec ? 0 : bit, ec); }));
+    };
+    if (status & MYSQL_WAIT_READ) watch(MYSQL_WAIT_READ, Socket::wait_read);
+    if (status & MYSQL_WAIT_WRITE) watch(MYSQL_WAIT_WRITE, Socket::wait_write);
+    if (status & MYSQL_WAIT_EXCEPT) watch(MYSQL_WAIT_EXCEPT, Socket::wait_error);
+    if (status & MYSQL_WAIT_TIMEOUT) {
+        state->timer_.expires_after(std::chrono::milliseconds(mysql_get_timeout_value_ms(mysql_ptr_.get())));
+        state->timer_.async_wait(asio::bind_executor(strand_, [state](const asio::error_code& ec) {
+            if (!ec) state->complete(MYSQL_WAIT_TIMEOUT, ec);
+        }));
+    }
+    asio::error_code ignored;
+    co_await state->signal_.async_wait(asio::redirect_error(asio::use_awaitable, ignored));
+    // the waits that lost the race complete later with operation_aborted and are ignored
+    socket_.cancel(ignored);
+    state->timer_.cancel();
+    if (state->ec_) {
+        throw asio::system_error(state->ec_);
+    }
+    co_return state->ready_;
+}
 inline asio::awaitable<bool> MysqlConnection::async_connect() {
     int wait_status = 0;
     MYSQL* ret;
     conn_status_ = ConnectStatus::Connecting;
     wait_status = mysql_real_connect_start(&ret, mysql_ptr_.get(), conn_info_.host.c_str(), conn_info_.user.c_str(), conn_info_.password.c_str(),
-                                           conn_info_.database.c_str(), atol(conn_info_.port.c_str()), nullptr, 0);
+                                           conn_info_.database.c_str(), atol(conn_info_.port.c_str()), nullptr, client_flag_);
     auto fd = mysql_get_socket(mysql_ptr_.get());
     if (fd < 0) {
-        exit(1);
+        fail_connect(mysql_error(mysql_ptr_.get()));
+        co_return false;
+    }
+    // asio gets its own descriptor of the socket, so that closing the socket_ and mysql_close never close the same fd twice
+    auto socket_fd = ::dup(fd);
+    if (socket_fd < 0) {
+        fail_connect(strerror(errno));
+        co_return false;
     }
-    socket_.assign(asio::ip::tcp::v4(), fd);
+    socket_.assign(asio::ip::tcp::v4(), socket_fd);
+    if (connect_timeout_.count() > 0) {
+        // cancelling the socket wait ends the loops below with operation_aborted
+        timeout_timer_.expires_after(connect_timeout_);
+        timeout_timer_.async_wait(asio::bind_executor(strand_, [weak_this = weak_from_this()](const asio::error_code& ec) {
+            auto this_ptr = weak_this.lock();
+            if (ec || !this_ptr) return;
+            asio::error_code ignored;
+            this_ptr->socket_.cancel(ignored);
+        }));
+    }
+    // a timed out wait throws, see handle_connect
     while (wait_status) {
-        co_await socket_.async_wait(asio::ip::tcp::socket::wait_read, asio::use_awaitable);
-        wait_status = mysql_real_connect_cont(&ret, mysql_ptr_.get(), MYSQL_WAIT_READ);
+        wait_status = mysql_real_connect_cont(&ret, mysql_ptr_.get(), co_await async_wait_status(wait_status));
     }
-    auto errorNo = mysql_errno(mysql_ptr_.get());
-    if (!ret && errno) {
-        handle_error();
+    if (!ret) {
+        fail_connect(mysql_error(mysql_ptr_.get()));
         co_return false;
     }
     if (!conn_info_.character_set.empty()) {
         int err = 0;
         wait_status = mysql_set_character_set_start(&err, mysql_ptr_.get(), conn_info_.character_set.c_str());
         while (wait_status) {
-            co_await socket_.async_wait(asio::ip::tcp::socket::wait_read, asio::use_awaitable);
-            wait_status = mysql_set_character_set_cont(&err, mysql_ptr_.get(), MYSQL_WAIT_READ);
+            wait_status = mysql_set_character_set_cont(&err, mysql_ptr_.get(), co_await async_wait_status(wait_status));
         }
         if (err) {
-            handle_error();
+            fail_connect(mysql_error(mysql_ptr_.get()));
             co_return false;
         }
     }
+    timeout_timer_.cancel();
     conn_status_ = ConnectStatus::Ok;
+    last_active_ = std::chrono::steady_clock::now();
     if (connected_callback_) {
         connected_callback_(shared_from_this());
     }
     co_return true;
 }
+inline asio::awaitable<bool> MysqlConnection::async_ping() {
+    int err = 0;
+    if (connect_timeout_.count() > 0) {
+        timeout_timer_.expires_after(connect_timeout_);
+        timeout_timer_.async_wait(asio::bind_executor(strand_, [weak_this = weak_from_this()](const asio::error_code& ec) {
+            auto this_ptr = weak_this.lock();
+            if (ec || !this_ptr) return;
+            asio::error_code ignored;
+            this_ptr->socket_.cancel(ignored);
+        }));
+    }
+    int wait_status = mysql_ping_start(&err, mysql_ptr_.get());
+    while (wait_status) {
+        wait_status = mysql_ping_cont(&err, mysql_ptr_.get(), co_await async_wait_status(wait_status));
+    }
+    timeout_timer_.cancel();
+    if (err) co_return false;
+    last_active_ = std::chrono::steady_clock::now();
+    co_return true;
+}
+inline void MysqlConnection::begin_execution() {
+    is_aborted_ = false;
+    auto execution_id = execution_id_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (canceller_) {
+        canceller_->attach(shared_from_this(), execution_id);
+    }
+}
+inline void MysqlConnection::arm_query_timer() {
+    auto deadline = deadline_;
+    // a stream may legitimately wait for its consumer, only an explicit deadline bounds it
+    if (query_timeout_.count() > 0 && !batch_callback_) {
+        deadline = std::min(deadline, std::chrono::steady_clock::now() + query_timeout_);
+    }
+    if (deadline == Deadline::max()) return;
+    timeout_timer_.expires_at(deadline);
+    timeout_timer_.async_wait(asio::bind_executor(strand_, [weak_this = weak_from_this(), execution_id = execution_id_.load(std::memory_order_relaxed)](const asio::error_code& ec) {
+        auto this_ptr = weak_this.lock();
+        if (ec || !this_ptr) return;
+        this_ptr->abort_execution(execution_id, ErrorCode::Timeout, "query timed out");
+    }));
+}
+inline void MysqlConnection::abort_execution(std::uint64_t execution_id, ErrorCode code, const char* message) {
+    if (!is_working_ || is_aborted_ || execution_id != execution_id_.load(std::memory_order_relaxed)) return;
+    is_aborted_ = true;
+    // release the callers now, whatever the server still sends is read and dropped
+    auto ec_ptr = std::make_exception_ptr(MysqlException(code, message));
+    std::vector<ExceptPtrCallback> ec_callbacks;
+    if (pipeline_.empty()) {
+        ec_callbacks.push_back(std::move(ec_callback_));
+    } else {
+        for (auto i = pipeline_index_; i < pipeline_.size(); ++i) {
+            ec_callbacks.push_back(std::move(pipeline_[i]->exception_callback_));
+            pipeline_[i]->result_callback_ = nullptr;
+            pipeline_[i]->exception_callback_ = nullptr;
+        }
+    }
+    ec_callback_ = nullptr;
+    result_callback_ = nullptr;
+    batch_callback_ = nullptr;
+    count_failed(ec_callbacks.size());
+    for (auto& ec_callback : ec_callbacks) {
+        if (ec_callback) {
+            ec_callback(ec_ptr);
+        }
+    }
+    if (exec_status_ == ExecStatus::FetchRow) {
+        // a stream may be parked waiting for its consumer
+        resume_stream(false);
+    }
+    kill_query();
+}
+inline void MysqlConnection::kill_query() {
+    if (killer_) return;
+    auto thread_id = mysql_thread_id(mysql_ptr_.get());
+    killer_ = std::make_shared<MysqlConnection>(io_context_, conn_info_);
+    killer_->set_timeouts(connect_timeout_, query_timeout_);
+    auto release = [weak_this = weak_from_this()]() {
+        auto this_ptr = weak_this.lock();
+        if (!this_ptr) return;
+        asio::post(this_ptr->strand_, [this_ptr]() { this_ptr->killer_.reset(); });
+    };
+    killer_->set_connected_callback([thread_id, release](const MysqlConnectionPtr& killer) {
+        killer->set_complete_callback([release]() { release(); });
+        killer->execute_sql("KILL QUERY " + std::to_string(thread_id), nullptr, nullptr);
+    });
+    killer_->set_closed_callback([release](const MysqlConnectionPtr&) { release(); });
+    killer_->handle_connect();
+}
 inline void MysqlConnection::handle_error() {
+    handle_error(mysql_errno(mysql_ptr_.get()), mysql_error(mysql_ptr_.get()));
+}
+inline void MysqlConnection::handle_error(unsigned int errorNo, const char* message) {
     exec_status_ = ExecStatus::None;
-    auto errorNo = mysql_errno(mysql_ptr_.get());
     if (is_working_) {
-        auto ec_ptr = std::make_exception_ptr(std::exception(std::runtime_error(mysql_error(mysql_ptr_.get()))));
-        if (ec_callback_) {
-            ec_callback_(ec_ptr);
+        auto error = MysqlException::from_errno(errorNo, message);
+        auto ec_ptr = std::make_exception_ptr(error);
+        // server side errors only fail the statement, the connection can still be used
+        bool is_broken = error.code() == ErrorCode::Connection;
+        // an aborted execution was already counted when its callers were failed, e.g. the later ER_QUERY_INTERRUPTED
+        if (pipeline_.empty()) {
+            if (!is_aborted_) count_failed();
+            if (ec_callback_) {
+                ec_callback_(ec_ptr);
+            }
+        } else {
+            auto failed_index = pipeline_index_;
+            if (!is_aborted_) count_failed(is_broken ? pipeline_.size() - failed_index : 1);
+            if (pipeline_[failed_index]->exception_callback_) {
+                pipeline_[failed_index]->exception_callback_(ec_ptr);
+            }
+            if (failed_index + 1 == pipeline_.size()) {
+                is_pipeline_tail_done_ = true;
+            }
+            if (is_broken) {
+                for (auto i = failed_index + 1; i < pipeline_.size(); ++i) {
+                    if (pipeline_[i]->exception_callback_) {
+                        pipeline_[i]->exception_callback_(ec_ptr);
+                    }
+                }
+            } else if (!is_aborted_ && failed_index + 1 < pipeline_.size()) {
+                // statements after the failed one were never executed, send them again
+                pipeline_index_ = failed_index + 1;
+                build_pipeline_sql();
+                start_execute();
+                return;
+            }
+        }
+        if (is_broken) {
+            end_execution();
+            ec_callback_ = nullptr;
+            result_callback_ = nullptr;
+            pipeline_.clear();
+            params_.clear();
+            is_prepared_ = false;
+            batch_callback_ = nullptr;
+            is_working_ = false;
+            handle_close();
+        } else {
+            handle_complete();
         }
-        ec_callback_ = nullptr;
-        result_callback_ = nullptr;
-        is_working_ = false;
-        handle_close();
     }
 }
 }  // namespace db
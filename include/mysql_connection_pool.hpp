@@ -1,233 +1,1464 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <asio.hpp>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstring>
 #include <deque>
 #include <iostream>
-#include <list>
 #include <memory>
 #include <mutex>
-#include <shared_mutex>
+#include <random>
 #include <string>
 #include <string_view>
 #include <thread>
-#include <unordered_set>
+#include <unordered_map>
+#include <vector>
 
+#include "io_context_pool.hpp"
+#include "lockfree_queue.hpp"
 #include "mysql_connection.hpp"
+#include "mysql_metrics.hpp"
+#include "mysql_point_batcher.hpp"
+#include "mysql_result_cache.hpp"
 #include "mysql_transaction.hpp"
 namespace db {
 constexpr int max_sql_buffer = 200000;
+constexpr int max_trans_buffer = 4096;
+/**
+ * @brief 积压队列已满时如何处理新的命令
+ */
+enum class AdmissionPolicy { Reject,  //立即以 ErrorCode::Overloaded 调用错误回调
+                             Block };  //阻塞调用线程直到队列有空位; 在io线程上调用时退化为Reject, 避免死锁
+/**
+ * @brief 连接池自动伸缩的配置
+ * 不开启时按需逐个创建连接(每条排队的命令一个, 直到max_size), 连接空闲且超过min_size时立即关闭
+ * 开启后每个周期根据排队等待的p95, 使用中的连接数以及建立连接的耗时决定连接数:
+ * 等待超过目标时按步长扩容; 需求呈上升趋势时提前建立连接(预热); 使用率持续低于阈值一段时间后才逐步关闭空闲连接
+ */
+struct AutoscaleOptions {
+    bool enabled = false;
+    // 评估周期
+    std::chrono::milliseconds interval{50};
+    // 排队等待的p95超过这个值时扩容, 低于它的一半才可能缩容
+    std::chrono::microseconds target_queue_wait{2000};
+    // 每个周期最多新建的连接数
+    std::size_t max_grow_step = 4;
+    // 使用中的连接占比持续低于这个值时缩容
+    double shrink_utilization = 0.5;
+    // 低使用率持续这么久才关闭一批空闲连接
+    std::chrono::milliseconds idle_before_shrink{30000};
+    // 每次缩容关闭的连接数
+    std::size_t shrink_step = 1;
+    // 按需求趋势预测建立连接所需时间之后的需求, 乘以这个系数作为预热的目标, 0为不预热
+    double prewarm_headroom = 1.2;
+};
+/**
+ * @brief run_transaction 的重试策略
+ * 事务因死锁(ER_LOCK_DEADLOCK)或锁等待超时(ER_LOCK_WAIT_TIMEOUT)回滚时, 随机等待一段时间后在新的事务中重新执行事务体
+ */
+struct TransactionRetryPolicy {
+    // 最多重试次数, 0为不重试
+    std::size_t max_retries = 3;
+    // 第n次重试前的等待时间在 [0, min(backoff_max, backoff_min * 2^n)] 中随机选取, 避免冲突的事务再次同时执行
+    std::chrono::milliseconds backoff_min{5};
+    std::chrono::milliseconds backoff_max{200};
+    // 锁等待超时是否也重试
+    bool retry_lock_wait_timeout = true;
+};
+struct PoolOptions {
+    // >1 时开启流水线: 连接空闲时从积压队列一次取出最多这么多条语句, 合并成一个multi statement发送
+    std::size_t pipeline_depth = 1;
+    // 开启后所有连接都允许multi statement, 事务的BEGIN推迟到与第一条语句一起发送, execute_and_commit 的语句与COMMIT一起发送
+    // 注意multi statement会让拼接进sql的恶意输入可以执行多条语句, 只在参数都经过转义或预处理时开启
+    bool merge_transaction_statements = false;
+    // 每个连接缓存的预处理语句数量
+    std::size_t stmt_cache_size = 64;
+    // 结果格子的存放顺序, 需要按列扫描大结果时选 Columnar
+    ResultLayout result_layout = ResultLayout::RowMajor;
+    // 积压队列满时的处理方式
+    AdmissionPolicy admission_policy = AdmissionPolicy::Reject;
+    // 积压队列的容量, 平均分给各个分片
+    std::size_t max_backlog = max_sql_buffer;
+    // >0 时排队超过这么久仍未拿到连接的命令以 ErrorCode::DeadlineExceeded 失败, 不再执行
+    std::chrono::milliseconds queue_timeout{0};
+    // >0 时建立连接超过这么久视为失败
+    std::chrono::milliseconds connect_timeout{0};
+    // >0 时语句执行超过这么久以 ErrorCode::Timeout 失败, 并KILL QUERY
+    std::chrono::milliseconds query_timeout{0};
+    // >0 时开启点查合并: 这段时间内同一模板的 lookup 合并成一条 where key in (...) 查询, 见 PointQueryBatcher
+    std::chrono::microseconds coalesce_window{0};
+    // 一次合并的最多键数, 达到后立即发送
+    std::size_t coalesce_max_keys = 256;
+    // >0 时开启结果缓存(query_cached), 所有分片合计的内存上限
+    std::size_t result_cache_bytes = 0;
+    // 结果缓存的分片数
+    std::size_t result_cache_shards = 16;
+    // 自动伸缩
+    AutoscaleOptions autoscale;
+    // >0 时定期ping空闲超过这么久的连接, 失败的连接被关闭并替换
+    std::chrono::milliseconds keepalive_interval{30000};
+    // 连接断开后连接数低于min_size时重新建立, 连续失败时等待时间从min开始加倍, 最多到max
+    std::chrono::milliseconds reconnect_backoff_min{100};
+    std::chrono::milliseconds reconnect_backoff_max{10000};
+    // >0 时只读语句(select/show/desc/explain)因连接断开失败时, 换一个连接重试的次数
+    // 重试需要另外保存一份sql与参数, 默认关闭; 加锁读, select ... into 以及调用锁与序列函数的语句不会重试
+    std::size_t read_retries = 0;
+};
 class MysqlConnectionPool;
 using MysqlPoolPtr = std::shared_ptr<MysqlConnectionPool>;
 class MysqlConnectionPool : public std::enable_shared_from_this<MysqlConnectionPool> {
-    asio::io_context& io_context_;
+   public:
+    /**
+     * @brief 连接池就绪的回调, 成功时参数为空
+     */
+    using ReadyCallback = std::function<void(std::exception_ptr)>;
+    /**
+     * @brief 获取事务的回调, 排队已满时参数为空
+     */
+    using TransactionPtrCallback = std::function<void(const MysqlTransactionPtr&)>;
+    /**
+     * @brief run_transaction 的事务体, 重试时会再次调用
+     */
+    using TransactionBody = std::function<void(const MysqlTransactionPtr&)>;
+
+   private:
+    using TransCallbackPtr = std::unique_ptr<TransactionPtrCallback>;
+
+    enum class SlotState : std::uint8_t { Free = 0,
+                                          Busy,    //连接被某个任务占用, 不在空闲栈中
+                                          Idle };  //连接在空闲栈中
+    struct ConnectionSlot {
+        MysqlConnectionPtr conn_;
+        std::atomic<SlotState> state_{SlotState::Free};
+        bool retired_ = false;  //因超过min_size_被关闭, 已经提前从conn_count_中减去
+    };
+    /**
+     * @brief 每个io线程一个分片
+     * 提交方把命令压入分片的MPSC队列, 空闲连接所在的槽位放在分片的无锁栈上, 任何线程都可以直接取走;
+     * 槽位的分配回收以及connections_只在分片所在的io线程上修改
+     * 分片的队列只由自己的连接读取, 所以命令只放入有连接的分片, 连接都关闭后积压的命令转给其它分片, 见 hand_over
+     */
+    struct Shard {
+        asio::io_context& io_context_;
+        MpscRing<SqlCmdPtr> sql_cmds_;
+        MpscRing<TransCallbackPtr> trans_callbacks_;
+        std::unique_ptr<ConnectionSlot[]> slots_;
+        IndexStack ready_slots_;
+        std::vector<std::uint32_t> free_slots_;
+        std::unordered_map<MysqlConnectionPtr, std::uint32_t> connections_;
+        std::deque<SqlCmdPtr> deferred_cmds_;  //组装流水线时取出但不能加入的命令, 优先于sql_cmds_执行
+        std::atomic<bool> drain_scheduled_{false};
+        std::atomic<std::size_t> conn_num_{0};  //分片上已创建以及正在创建的连接数
+        std::atomic<bool> is_orphaned_{false};  //没有连接, 且有积压没能转走, 见 hand_over
+
+        Shard(asio::io_context& io, std::size_t cmd_capacity, std::size_t slot_capacity)
+            : io_context_(io),
+              sql_cmds_(cmd_capacity),
+              trans_callbacks_(max_trans_buffer),
+              slots_(std::make_unique<ConnectionSlot[]>(slot_capacity)),
+              ready_slots_(slot_capacity) {
+            free_slots_.reserve(slot_capacity);
+            for (auto i = slot_capacity; i > 0; --i) {
+                free_slots_.push_back(static_cast<std::uint32_t>(i - 1));
+            }
+        }
+    };
+    struct ReadyConnection {
+        Shard* shard_ = nullptr;
+        std::uint32_t index_ = 0;
+        MysqlConnectionPtr conn_;
+    };
+
+    IOContextPool& io_context_pool_;  //每个新连接轮询绑定到其中一个io线程
     std::size_t min_size_;
     std::size_t max_size_;
     ConnectionInfo conn_info_;
+    PoolOptions options_;
 
-    mutable std::mutex conn_mutex_;
-    std::unordered_set<MysqlConnectionPtr> connections_;
-    std::unordered_set<MysqlConnectionPtr> ready_connections_;
-    std::unordered_set<MysqlConnectionPtr> busy_connections_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<std::size_t> conn_count_{0};  //已创建以及正在创建的连接数
+    std::atomic<std::size_t> next_shard_{0};
+    std::atomic<std::size_t> backlog_{0};            //所有分片积压队列中的命令数
+    std::atomic<std::size_t> blocked_producers_{0};  // AdmissionPolicy::Block 时等待空位的线程数
+    PointQueryBatcherPtr point_batcher_;              // coalesce_window 为0时为空
+    ResultCachePtr result_cache_;                     // result_cache_bytes 为0时为空
+    std::atomic<std::size_t> idle_count_{0};          //空闲栈中的连接数
+    PoolMetricsPtr metrics_{std::make_shared<PoolMetrics>()};
 
-    std::deque<std::shared_ptr<SqlCmd>> sqlCmd_buffer_;
-    using TransactionPtrCallback = std::function<void(const MysqlTransactionPtr&)>;
-    std::list<std::shared_ptr<TransactionPtrCallback>> trans_callbacks_;
-    bool is_busy_ = false;
-    std::thread::id thread_id_;
+    // init 建立的初始连接的进度, 由ready_mutex_保护
+    std::mutex ready_mutex_;
+    std::size_t warmup_pending_ = 0;  //还没有结果的初始连接数
+    std::size_t warmup_connected_ = 0;
+    std::string warmup_error_;  //最近一次初始连接失败的原因
+    bool is_ready_done_ = false;
+    std::exception_ptr ready_error_;
+    std::vector<ReadyCallback> ready_callbacks_;
+    std::unique_ptr<asio::steady_timer> ready_timer_;
+
+    // 自动伸缩的统计, 只在 options_.autoscale.enabled 时记录
+    std::array<std::atomic<std::uint32_t>, 32> wait_histogram_{};  //排队等待, 第i格为[2^i, 2^(i+1))微秒, 第0格包括0
+    std::atomic<std::int64_t> connect_latency_us_{0};              //建立连接耗时的EWMA
+    std::unique_ptr<asio::steady_timer> autoscale_timer_;
+    // 以下只在autoscale_timer_的线程上访问
+    double demand_level_ = 0;  //需求(使用中的连接+积压的命令)的平滑值
+    double demand_trend_ = 0;  //每个周期需求的变化量
+    std::chrono::steady_clock::time_point low_since_;  //使用率开始低于阈值的时间, 为空表示当前不低
+
+    // 断线重连
+    std::atomic<std::int64_t> reconnect_backoff_ms_{0};   //下一次重连前的等待, 连接建立成功后清零
+    std::atomic<std::int64_t> reconnect_not_before_{0};   //steady_clock的计数, 在此之前不按需创建连接
+    std::atomic<bool> is_closing_{false};                 //close_all之后不再重连
+    std::unique_ptr<asio::steady_timer> keepalive_timer_;
+
+    /**
+     * @brief 可重试的只读语句, 重试时使用这里保存的sql与参数
+     */
+    struct ReadRetry {
+        SqlText sql_;
+        std::unique_ptr<StmtParams> params_;
+        ResultPtrCallback result_callback_;
+        ExceptPtrCallback except_callback_;
+        Deadline deadline_;
+        std::shared_ptr<QueryCanceller> canceller_;
+    };
+    /**
+     * @brief run_transaction 的状态, 在各次重试之间共享
+     */
+    struct TransactionRun {
+        TransactionBody body_;
+        ExceptPtrCallback done_;
+        TransactionRetryPolicy policy_;
+        std::size_t retries_ = 0;
+        std::exception_ptr error_;  //本次执行中第一条失败语句的错误
+    };
 
    public:
-    MysqlConnectionPool(asio::io_context& io, std::size_t min_size, std::size_t max_size, const ConnectionInfo& conn_info)
-        : io_context_(io), min_size_(min_size), max_size_(max_size), conn_info_(conn_info) {}
-    void init() {
+    MysqlConnectionPool(IOContextPool& io_pool, std::size_t min_size, std::size_t max_size, const ConnectionInfo& conn_info,
+                        const PoolOptions& options = PoolOptions())
+        : io_context_pool_(io_pool), min_size_(min_size), max_size_(max_size), conn_info_(conn_info), options_(options) {
+        auto shard_num = io_context_pool_.size();
+        for (std::size_t i = 0; i < shard_num; ++i) {
+            shards_.emplace_back(std::make_unique<Shard>(io_context_pool_.get_io_context(i), options_.max_backlog / shard_num + 1, max_size_));
+        }
+    }
+    /**
+     * @brief 在各个io线程上并行建立min_size个连接, 不阻塞
+     *
+     * @param ready_callback 全部建立后以空参数回调; 超时, 或初始连接都已结束但不足min_size时以 MysqlException 回调
+     * @param timeout 0为不限
+     */
+    void init(ReadyCallback&& ready_callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        if (ready_callback) on_ready(std::move(ready_callback));
+        if (options_.coalesce_window.count() > 0) {
+            point_batcher_ = std::make_shared<PointQueryBatcher>(
+                [weak_this = weak_from_this()](SqlText&& sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+                    auto this_ptr = weak_this.lock();
+                    if (!this_ptr) {
+                        ecb(std::make_exception_ptr(MysqlException(ErrorCode::Cancelled, "connection pool has been released")));
+                        return;
+                    }
+                    this_ptr->execute_sql(std::move(sql), std::move(rcb), std::move(ecb));
+                },
+                io_context_pool_.get_io_context(), options_.coalesce_window, options_.coalesce_max_keys);
+        }
+        if (options_.result_cache_bytes > 0) {
+            result_cache_ = std::make_shared<ResultCache>(
+                [weak_this = weak_from_this()](SqlText&& sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+                    auto this_ptr = weak_this.lock();
+                    if (!this_ptr) {
+                        ecb(std::make_exception_ptr(MysqlException(ErrorCode::Cancelled, "connection pool has been released")));
+                        return;
+                    }
+                    this_ptr->execute_sql(std::move(sql), std::move(rcb), std::move(ecb));
+                },
+                options_.result_cache_bytes, options_.result_cache_shards);
+        }
+        if (options_.autoscale.enabled) {
+            autoscale_timer_ = std::make_unique<asio::steady_timer>(shards_.front()->io_context_);
+            schedule_autoscale();
+        }
+        if (options_.keepalive_interval.count() > 0) {
+            keepalive_timer_ = std::make_unique<asio::steady_timer>(shards_.front()->io_context_);
+            schedule_keepalive();
+        }
+        {
+            std::lock_guard<std::mutex> lock(ready_mutex_);
+            warmup_pending_ = min_size_;
+        }
+        if (min_size_ == 0) {
+            complete_ready(nullptr);
+        } else if (timeout.count() > 0) {
+            ready_timer_ = std::make_unique<asio::steady_timer>(shards_.front()->io_context_, timeout);
+            ready_timer_->async_wait([weak_this = weak_from_this()](const asio::error_code& ec) {
+                auto this_ptr = weak_this.lock();
+                if (ec || !this_ptr) return;
+                std::string message;
+                {
+                    std::lock_guard<std::mutex> lock(this_ptr->ready_mutex_);
+                    message = "connection pool warm-up timed out: " + std::to_string(this_ptr->warmup_connected_) + " of " +
+                              std::to_string(this_ptr->min_size_) + " connections established";
+                    if (!this_ptr->warmup_error_.empty()) message += ", last error: " + this_ptr->warmup_error_;
+                }
+                this_ptr->complete_ready(std::make_exception_ptr(MysqlException(ErrorCode::Timeout, message)));
+            });
+        }
+        // every shard connects on its own io thread, so the handshakes run in parallel
         for (size_t i = 0; i < min_size_; ++i) {
-            connections_.insert(create_connection());
+            conn_count_.fetch_add(1, std::memory_order_relaxed);
+            post_create_connection(*shards_[i % shards_.size()], true);
+        }
+    }
+    /**
+     * @brief 连接池就绪(或确定无法就绪)时回调, 已经有结果时立即回调
+     *
+     * @param callback
+     */
+    void on_ready(ReadyCallback&& callback) {
+        std::unique_lock<std::mutex> lock(ready_mutex_);
+        if (!is_ready_done_) {
+            ready_callbacks_.push_back(std::move(callback));
+            return;
         }
+        auto error = ready_error_;
+        lock.unlock();
+        callback(error);
     }
     void close_all() {
-        for (auto& conn : connections_) {
-            conn->handle_close();
+        is_closing_.store(true, std::memory_order_relaxed);
+        for (auto& shard : shards_) {
+            asio::post(shard->io_context_, [weak_this = weak_from_this(), shard = shard.get()]() {
+                auto this_ptr = weak_this.lock();
+                if (!this_ptr) return;
+                std::vector<MysqlConnectionPtr> conns;
+                conns.reserve(shard->connections_.size());
+                for (auto& item : shard->connections_) {
+                    conns.push_back(item.first);
+                }
+                for (auto& conn : conns) {
+                    conn->handle_close();
+                }
+            });
+        }
+    }
+    /**
+     * @brief 执行sql, 没有空闲连接时进入积压队列, 队列满时按 PoolOptions::admission_policy 处理
+     *
+     * @param sql
+     * @param result_callback
+     * @param except_callback 收到的异常为 MysqlException
+     * @param deadline 截止时间, 排队与执行都计算在内; 排队时还受 PoolOptions::queue_timeout 限制
+     * @param canceller 用于取消命令, 可以为空
+     */
+    void execute_sql(
+        SqlText sql,
+        ResultPtrCallback&& result_callback = nullptr,
+        ExceptPtrCallback&& except_callback = nullptr,
+        Deadline deadline = Deadline::max(),
+        std::shared_ptr<QueryCanceller> canceller = nullptr) {
+        if (options_.read_retries > 0 && is_idempotent_read(sql)) {
+            submit_read(std::make_shared<ReadRetry>(ReadRetry{std::move(sql), nullptr, std::move(result_callback), std::move(except_callback), deadline, std::move(canceller)}),
+                        options_.read_retries);
+            return;
         }
-        connections_.clear();
-        busy_connections_.clear();
-        ready_connections_.clear();
+        submit_sql(std::move(sql), std::move(result_callback), std::move(except_callback), deadline, std::move(canceller));
     }
+    /**
+     * @brief 以预处理语句执行, 参数按值保存, 结果为二进制协议的行
+     *
+     * @param sql 以?作为参数占位符
+     * @param params 可用 make_params 构造
+     * @param result_callback
+     * @param except_callback
+     * @param deadline 截止时间, 排队与执行都计算在内
+     * @param canceller 用于取消命令, 可以为空
+     */
     void execute_sql(
-        const char* sql,
+        SqlText sql,
+        StmtParams&& params,
         ResultPtrCallback&& result_callback = nullptr,
+        ExceptPtrCallback&& except_callback = nullptr,
+        Deadline deadline = Deadline::max(),
+        std::shared_ptr<QueryCanceller> canceller = nullptr) {
+        if (options_.read_retries > 0 && is_idempotent_read(sql)) {
+            submit_read(std::make_shared<ReadRetry>(ReadRetry{std::move(sql), std::make_unique<StmtParams>(std::move(params)), std::move(result_callback),
+                                                              std::move(except_callback), deadline, std::move(canceller)}),
+                        options_.read_retries);
+            return;
+        }
+        submit_sql(std::move(sql), std::move(params), std::move(result_callback), std::move(except_callback), deadline, std::move(canceller));
+    }
+    /**
+     * @brief 经结果缓存查询, 见 ResultCache::query; 未开启 PoolOptions::result_cache_bytes 时直接执行
+     *
+     * @param sql
+     * @param ttl 结果在缓存中的有效时长
+     * @param tables 结果依赖的表
+     * @param result_callback 命中时与其它调用方共享同一个结果
+     * @param except_callback
+     */
+    void query_cached(
+        SqlText sql,
+        std::chrono::milliseconds ttl,
+        const CacheTags& tables,
+        ResultPtrCallback&& result_callback,
         ExceptPtrCallback&& except_callback = nullptr) {
-        MysqlConnectionPtr conn = nullptr;
-        {
-            std::lock_guard<std::mutex> locker(conn_mutex_);
-            if (ready_connections_.empty()) {
-                if (sqlCmd_buffer_.size() > max_sql_buffer) {
-                    is_busy_ = true;
-                } else {
-                    auto cmd_ptr =
-                        std::make_shared<SqlCmd>(std::string_view(sql), std::move(result_callback), std::move(except_callback));
-                    sqlCmd_buffer_.push_back((cmd_ptr));
-                    if (connections_.size() < max_size_) {
-                        connections_.insert(create_connection());
-                    }
-                }
-            } else {
-                auto iter = ready_connections_.begin();
-                busy_connections_.insert(*iter);
-                conn = *iter;
-                ready_connections_.erase(iter);
+        if (result_cache_) {
+            result_cache_->query(std::move(sql), ttl, tables, std::move(result_callback), std::move(except_callback));
+            return;
+        }
+        execute_sql(std::move(sql), std::move(result_callback), std::move(except_callback));
+    }
+    /**
+     * @brief 执行修改tables的语句, 完成(无论成功与否)后使依赖这些表的缓存结果失效
+     *
+     * @param sql
+     * @param tables
+     * @param result_callback
+     * @param except_callback
+     */
+    void execute_tagged(
+        SqlText sql,
+        const CacheTags& tables,
+        ResultPtrCallback&& result_callback = nullptr,
+        ExceptPtrCallback&& except_callback = nullptr) {
+        if (!result_cache_ || tables.empty()) {
+            execute_sql(std::move(sql), std::move(result_callback), std::move(except_callback));
+            return;
+        }
+        auto tags = std::make_shared<CacheTags>(tables);
+        execute_sql(
+            std::move(sql),
+            [cache = result_cache_, tags, result_callback = std::move(result_callback)](const MysqlResultPtr& result) {
+                cache->invalidate(*tags);
+                if (result_callback) result_callback(result);
+            },
+            [cache = result_cache_, tags, except_callback = std::move(except_callback)](std::exception_ptr except) {
+                cache->invalidate(*tags);
+                if (except_callback) except_callback(except);
+            });
+    }
+    /**
+     * @brief 使依赖tables的缓存结果失效, 用于在连接池之外修改了数据的情况
+     *
+     * @param tables
+     */
+    void invalidate_cache(const CacheTags& tables) {
+        if (result_cache_) result_cache_->invalidate(tables);
+    }
+    const ResultCachePtr& result_cache() const noexcept { return result_cache_; }
+    /**
+     * @brief 已创建以及正在创建的连接数
+     */
+    std::size_t connection_count() const noexcept { return conn_count_.load(std::memory_order_relaxed); }
+    std::size_t idle_count() const noexcept { return idle_count_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 延迟分布, 计数以及连接数的快照, 可用 to_prometheus 输出; 定义 DB_DISABLE_METRICS 时只有连接数
+     */
+    MetricsSnapshot metrics() const {
+        MetricsSnapshot snapshot;
+        snapshot.queue_wait = metrics_->queue_wait_.snapshot();
+        snapshot.connect_time = metrics_->connect_time_.snapshot();
+        snapshot.round_trip = metrics_->round_trip_.snapshot();
+        snapshot.decode_time = metrics_->decode_time_.snapshot();
+        snapshot.queued = metrics_->queued_.value();
+        snapshot.executed = metrics_->executed_.value();
+        snapshot.failed = metrics_->failed_.value();
+        snapshot.dropped = metrics_->dropped_.value();
+        snapshot.reconnects = metrics_->reconnects_.value();
+        snapshot.transaction_retries = metrics_->transaction_retries_.value();
+        snapshot.transaction_exhausted = metrics_->transaction_exhausted_.value();
+        snapshot.total_connections = conn_count_.load(std::memory_order_relaxed);
+        snapshot.ready_connections = std::min(idle_count_.load(std::memory_order_relaxed), snapshot.total_connections);
+        snapshot.busy_connections = snapshot.total_connections - snapshot.ready_connections;
+        snapshot.backlog = backlog_.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+    /**
+     * @brief 提前建立连接直到至少有connections个, 用于已知的流量高峰之前, 不超过max_size
+     *
+     * @param connections
+     */
+    void prewarm(std::size_t connections) {
+        auto count = conn_count_.load(std::memory_order_relaxed);
+        if (connections > count) grow(connections - count);
+    }
+    /**
+     * @brief 按整数键的点查, 开启 PoolOptions::coalesce_window 时与同模板的其它点查合并发送, 否则单独执行
+     * 两种方式都以文本协议执行, 开启合并不改变结果的格式
+     *
+     * @param sql 以 "<键列> = ?" 结尾的模板, 合并时键列需要出现在select的列中
+     * @param key
+     * @param result_callback 只包含键等于key的行
+     * @param except_callback 模板不合法时收到 std::invalid_argument
+     */
+    void lookup(
+        std::string_view sql,
+        long long key,
+        ResultPtrCallback&& result_callback,
+        ExceptPtrCallback&& except_callback = nullptr) {
+        if (point_batcher_) {
+            point_batcher_->lookup(sql, key, std::move(result_callback), std::move(except_callback));
+            return;
+        }
+        SqlText text;
+        try {
+            text = PointQueryBatcher::bind_key(sql, key);
+        } catch (const std::invalid_argument&) {
+            if (except_callback) except_callback(std::current_exception());
+            return;
+        }
+        execute_sql(std::move(text), std::move(result_callback), std::move(except_callback));
+    }
+    /**
+     * @brief 流式查询, 见 MysqlConnection::execute_stream
+     *
+     * @param sql
+     * @param batch_rows 每批的行数
+     * @param batch_callback
+     * @param except_callback
+     */
+    void query_stream(
+        SqlText sql,
+        std::size_t batch_rows,
+        RowBatchCallback&& batch_callback,
+        ExceptPtrCallback&& except_callback = nullptr) {
+        auto ready = pop_ready_connection();
+        if (ready.conn_) {
+            ready.conn_->execute_stream(std::move(sql), batch_rows, std::move(batch_callback), std::move(except_callback));
+            return;
+        }
+        auto cmd_ptr = std::make_unique<SqlCmd>(std::move(sql), nullptr, std::move(except_callback));
+        cmd_ptr->batch_callback_ = std::move(batch_callback);
+        cmd_ptr->batch_rows_ = batch_rows;
+        enqueue(std::move(cmd_ptr));
+    }
+    /**
+     * @brief LOAD DATA LOCAL INFILE, 文件内容来自data, 见 MysqlConnection::execute_load_data
+     *
+     * @param sql
+     * @param data
+     * @param result_callback
+     * @param except_callback
+     */
+    void execute_load_data(
+        SqlText sql,
+        std::string&& data,
+        ResultPtrCallback&& result_callback = nullptr,
+        ExceptPtrCallback&& except_callback = nullptr) {
+        auto ready = pop_ready_connection();
+        if (ready.conn_) {
+            ready.conn_->execute_load_data(std::move(sql), std::move(data), std::move(result_callback), std::move(except_callback));
+            return;
+        }
+        auto cmd_ptr = std::make_unique<SqlCmd>(std::move(sql), std::move(result_callback), std::move(except_callback));
+        cmd_ptr->infile_data_ = std::make_unique<std::string>(std::move(data));
+        enqueue(std::move(cmd_ptr));
+    }
+    /**
+     * @brief 当前线程是否是连接池的io线程, 这些线程上不能阻塞等待连接池
+     */
+    bool is_io_thread() const {
+        for (auto& shard : shards_) {
+            if (shard->io_context_.get_executor().running_in_this_thread()) return true;
+        }
+        return false;
+    }
+    /**
+     * @brief 获取事务, 不阻塞; 没有空闲连接时排队, 在事务所在连接的strand上回调, 排队已满时以空指针回调
+     *
+     * @param callback
+     */
+    void new_transaction_async(TransactionPtrCallback&& callback) {
+        auto ready = pop_ready_connection();
+        if (ready.conn_) {
+            begin_trans(*ready.shard_, ready.index_, ready.conn_, std::move(callback));
+            return;
+        }
+        auto callback_ptr = std::make_unique<TransactionPtrCallback>(std::move(callback));
+        auto shard_ptr = try_push(callback_ptr);
+        if (!shard_ptr) {
+            (*callback_ptr)(nullptr);
+            return;
+        }
+        schedule_drain(*shard_ptr);
+    }
+    /**
+     * @brief 执行事务, 因死锁或锁等待超时回滚时按policy在新的事务中重新执行body
+     * body在事务所在连接的strand上调用, 每次重试都重新调用, 不能依赖上一次执行留下的状态; 事务的最后一个引用释放时提交
+     * 重试次数记入 metrics 的 transaction_retries
+     *
+     * @param body
+     * @param done 提交成功时参数为空, 否则为导致回滚的错误
+     * @param policy
+     */
+    void run_transaction(TransactionBody&& body, ExceptPtrCallback&& done, const TransactionRetryPolicy& policy = TransactionRetryPolicy()) {
+        start_transaction_run(std::make_shared<TransactionRun>(TransactionRun{std::move(body), std::move(done), policy}));
+    }
+    /**
+     * @brief 积压队列中的命令数
+     *
+     * @return std::size_t
+     */
+    std::size_t backlog() const noexcept { return backlog_.load(std::memory_order_relaxed); }
+
+   private:
+    void submit_sql(SqlText&& sql, ResultPtrCallback&& result_callback, ExceptPtrCallback&& except_callback, Deadline deadline,
+                    std::shared_ptr<QueryCanceller> canceller) {
+        auto ready = pop_ready_connection();
+        if (ready.conn_) {
+            ready.conn_->set_execution_control(deadline, std::move(canceller));
+            ready.conn_->execute_sql(std::move(sql), std::move(result_callback), std::move(except_callback));
+            return;
+        }
+        auto cmd_ptr = std::make_unique<SqlCmd>(std::move(sql), std::move(result_callback), std::move(except_callback));
+        cmd_ptr->deadline_ = deadline;
+        cmd_ptr->canceller_ = std::move(canceller);
+        enqueue(std::move(cmd_ptr));
+    }
+    void submit_sql(SqlText&& sql, StmtParams&& params, ResultPtrCallback&& result_callback, ExceptPtrCallback&& except_callback, Deadline deadline,
+                    std::shared_ptr<QueryCanceller> canceller) {
+        auto ready = pop_ready_connection();
+        if (ready.conn_) {
+            ready.conn_->set_execution_control(deadline, std::move(canceller));
+            ready.conn_->execute_prepared(std::move(sql), std::move(params), std::move(result_callback), std::move(except_callback));
+            return;
+        }
+        auto cmd_ptr = std::make_unique<SqlCmd>(std::move(sql), std::move(result_callback), std::move(except_callback));
+        cmd_ptr->params_ = std::make_unique<StmtParams>(std::move(params));
+        cmd_ptr->deadline_ = deadline;
+        cmd_ptr->canceller_ = std::move(canceller);
+        enqueue(std::move(cmd_ptr));
+    }
+    /**
+     * @brief 只读且单条的语句才能在连接断开后安全地重新执行
+     * 加锁读(for update/share), select ... into, 用户变量赋值以及有副作用的函数(get_lock, nextval等)除外
+     */
+    static bool is_idempotent_read(std::string_view sql) {
+        if (sql.find(';') != std::string_view::npos || sql.find(":=") != std::string_view::npos) return false;
+        auto pos = sql.find_first_not_of(" \t\r\n(");
+        if (pos == std::string_view::npos) return false;
+        auto rest = sql.substr(pos);
+        bool is_read = false;
+        for (const char* keyword : {"select", "show", "desc", "explain"}) {
+            auto length = strlen(keyword);
+            if (rest.size() > length && strncasecmp(rest.data(), keyword, length) == 0) {
+                is_read = true;
+                break;
             }
         }
-        if (is_busy_) {
+        if (!is_read) return false;
+        for (const char* word : {"update", "share", "into", "get_lock", "release_lock", "release_all_locks", "nextval", "setval", "lastval"}) {
+            if (contains_word(rest, word)) return false;
+        }
+        return true;
+    }
+    /**
+     * @brief text中是否有不区分大小写的完整单词word
+     */
+    static bool contains_word(std::string_view text, std::string_view word) {
+        auto is_ident = [](char c) { return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$'; };
+        for (std::size_t i = 0; i + word.size() <= text.size(); ++i) {
+            if (strncasecmp(text.data() + i, word.data(), word.size()) != 0) continue;
+            if (i > 0 && is_ident(text[i - 1])) continue;
+            if (i + word.size() < text.size() && is_ident(text[i + word.size()])) continue;
+            return true;
+        }
+        return false;
+    }
+    static bool is_connection_lost(std::exception_ptr except) {
+        try {
+            std::rethrow_exception(except);
+        } catch (const MysqlException& e) {
+            return e.code() == ErrorCode::Connection;
+        } catch (...) {
+            return false;
         }
-        if (conn) {
-            execute_sql(conn, sql, std::move(result_callback), std::move(except_callback));
+    }
+    void submit_read(const std::shared_ptr<ReadRetry>& read, std::size_t retries) {
+        ResultPtrCallback result_callback = [read](const MysqlResultPtr& result) {
+            if (read->result_callback_) read->result_callback_(result);
+        };
+        ExceptPtrCallback except_callback = [weak_this = weak_from_this(), read, retries](std::exception_ptr except) {
+            auto this_ptr = weak_this.lock();
+            if (this_ptr && retries > 0 && is_connection_lost(except) && std::chrono::steady_clock::now() < read->deadline_ &&
+                !(read->canceller_ && read->canceller_->is_cancelled())) {
+                // the broken connection is replaced by the pool, the statement goes to another one
+                this_ptr->submit_read(read, retries - 1);
+                return;
+            }
+            if (read->except_callback_) read->except_callback_(except);
+        };
+        if (read->params_) {
+            submit_sql(SqlText(read->sql_), StmtParams(*read->params_), std::move(result_callback), std::move(except_callback), read->deadline_, read->canceller_);
         } else {
+            submit_sql(SqlText(read->sql_), std::move(result_callback), std::move(except_callback), read->deadline_, read->canceller_);
         }
     }
-    void new_transaction_async(TransactionPtrCallback&& callback) {
-        MysqlConnectionPtr conn_ptr = nullptr;
-        {
-            std::lock_guard<std::mutex> locker(conn_mutex_);
-            if (!ready_connections_.empty()) {
-                auto iter = ready_connections_.begin();
-                busy_connections_.insert(*iter);
-                conn_ptr = *iter;
-                ready_connections_.erase(iter);
-            } else {
-                auto callback_ptr = std::make_shared<TransactionPtrCallback>(callback);
-                trans_callbacks_.push_back(callback_ptr);
+    void execute_cmd(const MysqlConnectionPtr& conn, SqlCmdPtr&& cmd) {
+        conn->set_execution_control(cmd->deadline_, std::move(cmd->canceller_));
+        if (cmd->params_) {
+            conn->execute_prepared(std::move(cmd->sql_), std::move(*cmd->params_), std::move(cmd->result_callback_), std::move(cmd->exception_callback_));
+        } else if (cmd->infile_data_) {
+            conn->execute_load_data(std::move(cmd->sql_), std::move(*cmd->infile_data_), std::move(cmd->result_callback_), std::move(cmd->exception_callback_));
+        } else if (cmd->batch_callback_) {
+            conn->execute_stream(std::move(cmd->sql_), cmd->batch_rows_, std::move(cmd->batch_callback_), std::move(cmd->exception_callback_));
+        } else {
+            conn->execute_sql(std::move(cmd->sql_), std::move(cmd->result_callback_), std::move(cmd->exception_callback_));
+        }
+    }
+    void enqueue(SqlCmdPtr&& cmd_ptr) {
+        if (metrics_enabled || options_.autoscale.enabled) {
+            cmd_ptr->enqueued_at_ = std::chrono::steady_clock::now();
+        }
+        cmd_ptr->expire_at_ = cmd_ptr->deadline_;
+        if (options_.queue_timeout.count() > 0) {
+            cmd_ptr->expire_at_ = std::min(cmd_ptr->expire_at_, std::chrono::steady_clock::now() + options_.queue_timeout);
+        }
+        auto shard_ptr = try_push(cmd_ptr);
+        if (!shard_ptr && options_.admission_policy == AdmissionPolicy::Block && !is_io_thread()) {
+            blocked_producers_.fetch_add(1);
+            for (;;) {
+                auto observed = backlog_.load();
+                if ((shard_ptr = try_push(cmd_ptr))) break;
+                // woken by pop_cmd once a command leaves the backlog
+                backlog_.wait(observed);
+            }
+            blocked_producers_.fetch_sub(1);
+        }
+        if (!shard_ptr) {
+            metrics_->dropped_.add();
+            fail_cmd(cmd_ptr, ErrorCode::Overloaded, "too many queued sql commands");
+            return;
+        }
+        metrics_->queued_.add();
+        auto& shard = *shard_ptr;
+        // with autoscale the pool is grown by the periodic evaluation instead of once per queued command
+        auto limit = options_.autoscale.enabled ? std::max<std::size_t>(min_size_, 1) : max_size_;
+        // while the server is unreachable only the backoff reconnect creates connections
+        if (std::chrono::steady_clock::now().time_since_epoch().count() < reconnect_not_before_.load(std::memory_order_relaxed)) {
+            limit = 0;
+        }
+        std::size_t count = conn_count_.load(std::memory_order_relaxed);
+        while (count < limit && !conn_count_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
+        }
+        if (count < limit) {
+            post_create_connection(shard);
+        }
+        schedule_drain(shard);
+    }
+    Shard& next_shard() { return *shards_[next_shard_.fetch_add(1, std::memory_order_relaxed) % shards_.size()]; }
+    /**
+     * @brief 从轮询的起点依次尝试各个分片, 先尝试有连接(包括正在建立)的分片
+     *
+     * @param push 放入分片, 已满时返回false
+     * @param is_any_shard 有连接的分片都已满时是否放入没有连接的分片, 由 enqueue 为其建立连接或由 hand_over 转走
+     * @return Shard* 放入的分片, 全部失败时为空
+     */
+    template <typename Push>
+    Shard* push_to_shard(Push&& push, bool is_any_shard) {
+        auto start = next_shard_.fetch_add(1, std::memory_order_relaxed);
+        for (int pass = 0; pass < (is_any_shard ? 2 : 1); ++pass) {
+            for (std::size_t i = 0; i < shards_.size(); ++i) {
+                auto& shard = *shards_[(start + i) % shards_.size()];
+                bool has_connection = shard.conn_num_.load(std::memory_order_acquire) > 0;
+                if (has_connection != (pass == 0)) continue;
+                if (push(shard)) return &shard;
             }
         }
-        if (conn_ptr) {
-            begin_trans(conn_ptr, std::move(callback));
+        return nullptr;
+    }
+    /**
+     * @brief 放入一个分片的积压队列, 失败时命令不会被移走
+     *
+     * @param cmd_ptr
+     * @param is_any_shard 见 push_to_shard
+     * @return Shard* 放入的分片, 全部已满时为空
+     */
+    Shard* try_push(SqlCmdPtr& cmd_ptr, bool is_any_shard = true) {
+        return push_to_shard(
+            [this, &cmd_ptr](Shard& shard) {
+                backlog_.fetch_add(1);
+                if (shard.sql_cmds_.try_push(std::move(cmd_ptr))) return true;
+                backlog_.fetch_sub(1);
+                return false;
+            },
+            is_any_shard);
+    }
+    Shard* try_push(TransCallbackPtr& callback_ptr, bool is_any_shard = true) {
+        return push_to_shard([&callback_ptr](Shard& shard) { return shard.trans_callbacks_.try_push(std::move(callback_ptr)); }, is_any_shard);
+    }
+    bool pop_cmd(Shard& shard, SqlCmdPtr& cmd_ptr);
+    static void fail_cmd(SqlCmdPtr& cmd_ptr, ErrorCode code, const char* message) {
+        if (cmd_ptr->exception_callback_) {
+            cmd_ptr->exception_callback_(std::make_exception_ptr(MysqlException(code, message)));
         }
     }
 
-   private:
-    void execute_sql(const MysqlConnectionPtr& conn, std::string_view sql, ResultPtrCallback&& result_callback, ExceptPtrCallback&& except_callback) {
-        conn->execute_sql(std::move(sql), std::move(result_callback), std::move(except_callback));
-    };
-    MysqlConnectionPtr create_connection();
+    ReadyConnection pop_ready_connection();
+    void schedule_drain(Shard& shard);
+    void drain(Shard& shard);
+    void hand_over(Shard& shard);
+    void adopt_orphans();
+
+    void post_create_connection(Shard& shard, bool is_warmup = false);
+    void create_connection(Shard& shard, bool is_warmup);
+    void warmup_finished(bool is_connected, const std::string& error);
+    void complete_ready(std::exception_ptr error);
+    void release_connection(Shard& shard, const MysqlConnectionPtr& conn);
+    std::function<void()> make_complete_callback(Shard& shard, std::uint32_t index, const MysqlConnectionPtr& conn);
 
-    void handle_new_task(const MysqlConnectionPtr& conn);
+    void handle_new_task(Shard& shard, std::uint32_t index, const MysqlConnectionPtr& conn);
 
-    void begin_trans(const MysqlConnectionPtr& conn, TransactionPtrCallback&& callback);
+    void record_wait(std::chrono::steady_clock::duration wait);
+    std::int64_t wait_percentile(double percentile);
+    void schedule_autoscale();
+    void autoscale();
+    void grow(std::size_t connections);
+    void retire_idle(Shard& shard);
+
+    void schedule_reconnect(Shard& shard, std::size_t target);
+    void schedule_keepalive();
+    void keepalive(Shard& shard);
+
+    void begin_trans(Shard& shard, std::uint32_t index, const MysqlConnectionPtr& conn, TransactionPtrCallback&& callback);
+    void start_transaction_run(const std::shared_ptr<TransactionRun>& run);
+    void retry_transaction_run(const std::shared_ptr<TransactionRun>& run);
+    static bool is_retryable(const std::exception_ptr& error, const TransactionRetryPolicy& policy) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const MysqlException& e) {
+            return e.is_deadlock() || (policy.retry_lock_wait_timeout && e.is_lock_wait_timeout());
+        } catch (...) {
+            return false;
+        }
+    }
 };
-inline MysqlConnectionPtr MysqlConnectionPool::create_connection() {
-    auto conn_ptr = std::make_shared<MysqlConnection>(io_context_, conn_info_);
+inline MysqlConnectionPool::ReadyConnection MysqlConnectionPool::pop_ready_connection() {
+    auto start = next_shard_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        auto& shard = *shards_[(start + i) % shards_.size()];
+        std::uint32_t index;
+        while (shard.ready_slots_.pop(index)) {
+            auto& slot = shard.slots_[index];
+            auto conn = slot.conn_;
+            slot.state_.store(SlotState::Busy, std::memory_order_release);
+            idle_count_.fetch_sub(1, std::memory_order_relaxed);
+            if (conn->status() == ConnectStatus::Ok) {
+                metrics_->queue_wait_.record_us(0);
+                if (options_.autoscale.enabled) record_wait({});
+                return {&shard, index, std::move(conn)};
+            }
+            // connection is closed while idle, give the slot back on its own thread
+            asio::post(shard.io_context_, [weak_this = weak_from_this(), shard = &shard, conn]() {
+                auto this_ptr = weak_this.lock();
+                if (!this_ptr) return;
+                this_ptr->release_connection(*shard, conn);
+            });
+        }
+    }
+    return {};
+}
+inline void MysqlConnectionPool::schedule_drain(Shard& shard) {
+    if (shard.drain_scheduled_.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+    asio::post(shard.io_context_, [weak_this = weak_from_this(), shard = &shard]() {
+        auto this_ptr = weak_this.lock();
+        if (!this_ptr) return;
+        this_ptr->drain(*shard);
+    });
+}
+inline void MysqlConnectionPool::drain(Shard& shard) {
+    shard.drain_scheduled_.exchange(false, std::memory_order_acq_rel);
+    if (shard.conn_num_.load(std::memory_order_acquire) == 0) {
+        hand_over(shard);
+        return;
+    }
+    while (!shard.deferred_cmds_.empty() || !shard.sql_cmds_.empty() || !shard.trans_callbacks_.empty()) {
+        std::uint32_t index;
+        if (!shard.ready_slots_.pop(index)) {
+            // the queued commands are picked up when a connection of this shard completes
+            return;
+        }
+        auto& slot = shard.slots_[index];
+        auto conn = slot.conn_;
+        slot.state_.store(SlotState::Busy, std::memory_order_release);
+        idle_count_.fetch_sub(1, std::memory_order_relaxed);
+        if (conn->status() != ConnectStatus::Ok) {
+            release_connection(shard, conn);
+            continue;
+        }
+        handle_new_task(shard, index, conn);
+    }
+}
+/**
+ * @brief 分片上已经没有连接, 把积压的命令与事务转给有连接的分片, 在分片所在的io线程上调用
+ * 其它分片都已满时留在原处, 等其它连接空闲时由 adopt_orphans 再次触发; 整个连接池都没有连接时在本分片上按退避重新建立
+ */
+inline void MysqlConnectionPool::hand_over(Shard& shard) {
+    bool is_stuck = false;
+    while (!shard.deferred_cmds_.empty()) {
+        auto target = try_push(shard.deferred_cmds_.front(), false);
+        if (!target) {
+            is_stuck = true;
+            break;
+        }
+        shard.deferred_cmds_.pop_front();
+        schedule_drain(*target);
+    }
+    SqlCmdPtr cmd_ptr;
+    while (!is_stuck && shard.sql_cmds_.try_pop(cmd_ptr)) {
+        backlog_.fetch_sub(1);
+        if (auto target = try_push(cmd_ptr, false)) {
+            schedule_drain(*target);
+            continue;
+        }
+        // popped commands that can not move on wait in front of the queue
+        shard.deferred_cmds_.push_back(std::move(cmd_ptr));
+        if (blocked_producers_.load() > 0) {
+            backlog_.notify_all();
+        }
+        is_stuck = true;
+    }
+    TransCallbackPtr trans_callback;
+    while (!is_stuck && shard.trans_callbacks_.try_pop(trans_callback)) {
+        if (auto target = try_push(trans_callback, false)) {
+            schedule_drain(*target);
+            continue;
+        }
+        if (!shard.trans_callbacks_.try_push(std::move(trans_callback))) {
+            (*trans_callback)(nullptr);
+        }
+        is_stuck = true;
+    }
+    shard.is_orphaned_.store(is_stuck, std::memory_order_release);
+    if (is_stuck) {
+        schedule_reconnect(shard, std::max<std::size_t>(min_size_, 1));
+    }
+}
+/**
+ * @brief 让没有连接但仍有积压的分片把积压转走, 在连接空闲时调用
+ * 覆盖命令放入分片与分片最后一个连接关闭之间的竞争
+ */
+inline void MysqlConnectionPool::adopt_orphans() {
+    if (shards_.size() < 2) return;
+    for (auto& shard : shards_) {
+        if (shard->conn_num_.load(std::memory_order_acquire) == 0 &&
+            (shard->is_orphaned_.load(std::memory_order_acquire) || !shard->sql_cmds_.empty() || !shard->trans_callbacks_.empty())) {
+            schedule_drain(*shard);
+        }
+    }
+}
+inline void MysqlConnectionPool::post_create_connection(Shard& shard, bool is_warmup) {
+    shard.conn_num_.fetch_add(1, std::memory_order_release);
+    asio::post(shard.io_context_, [weak_this = weak_from_this(), shard = &shard, is_warmup]() {
+        auto this_ptr = weak_this.lock();
+        if (!this_ptr) return;
+        this_ptr->create_connection(*shard, is_warmup);
+    });
+}
+inline void MysqlConnectionPool::create_connection(Shard& shard, bool is_warmup) {
+    if (shard.free_slots_.empty()) {
+        conn_count_.fetch_sub(1, std::memory_order_relaxed);
+        shard.conn_num_.fetch_sub(1, std::memory_order_release);
+        if (is_warmup) warmup_finished(false, "no free connection slot");
+        return;
+    }
+    auto index = shard.free_slots_.back();
+    shard.free_slots_.pop_back();
+    auto conn_ptr = std::make_shared<MysqlConnection>(shard.io_context_, conn_info_);
+    if (options_.pipeline_depth > 1 || options_.merge_transaction_statements) {
+        conn_ptr->enable_multi_statements();
+    }
+    conn_ptr->set_stmt_cache_size(options_.stmt_cache_size);
+    conn_ptr->set_result_layout(options_.result_layout);
+    conn_ptr->set_timeouts(options_.connect_timeout, options_.query_timeout);
+    conn_ptr->set_metrics(metrics_);
+    auto& slot = shard.slots_[index];
+    slot.conn_ = conn_ptr;
+    slot.retired_ = false;
+    slot.state_.store(SlotState::Busy, std::memory_order_relaxed);
+    shard.connections_.emplace(conn_ptr, index);
+
     std::weak_ptr<MysqlConnectionPool> weakPtr = shared_from_this();
-    conn_ptr->set_closed_callback([weakPtr](const MysqlConnectionPtr& close_ptr) {
+    conn_ptr->set_closed_callback([weakPtr, shard = &shard, is_warmup](const MysqlConnectionPtr& close_ptr) {
         auto this_ptr = weakPtr.lock();
         if (this_ptr == nullptr)
             return;
-        {
-            std::lock_guard<std::mutex> locker(this_ptr->conn_mutex_);
-            this_ptr->ready_connections_.erase(close_ptr);
-            this_ptr->busy_connections_.erase(close_ptr);
-            this_ptr->connections_.erase(close_ptr);
+        if (is_warmup && !close_ptr->connect_error().empty()) {
+            this_ptr->warmup_finished(false, close_ptr->connect_error());
         }
+        asio::dispatch(shard->io_context_, [weakPtr, shard, close_ptr]() {
+            auto this_ptr = weakPtr.lock();
+            if (this_ptr == nullptr)
+                return;
+            this_ptr->release_connection(*shard, close_ptr);
+        });
     });
-    conn_ptr->set_connected_callback([weakPtr](const MysqlConnectionPtr& create_ptr) {
+    conn_ptr->set_connected_callback([weakPtr, shard = &shard, index, is_warmup, start = std::chrono::steady_clock::now()](const MysqlConnectionPtr& create_ptr) {
         auto this_ptr = weakPtr.lock();
         if (this_ptr == nullptr)
             return;
-        {
-            std::lock_guard<std::mutex> locker(this_ptr->conn_mutex_);
-            this_ptr->busy_connections_.insert(create_ptr);
+        if (is_warmup) this_ptr->warmup_finished(true, {});
+        this_ptr->reconnect_backoff_ms_.store(0, std::memory_order_relaxed);
+        this_ptr->reconnect_not_before_.store(0, std::memory_order_relaxed);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        this_ptr->metrics_->connect_time_.record(elapsed);
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        auto ewma = this_ptr->connect_latency_us_.load(std::memory_order_relaxed);
+        this_ptr->connect_latency_us_.store(ewma == 0 ? latency : (ewma * 7 + latency) / 8, std::memory_order_relaxed);
+        this_ptr->handle_new_task(*shard, index, create_ptr);
+    });
+    conn_ptr->set_complete_callback(make_complete_callback(shard, index, conn_ptr));
+    conn_ptr->handle_connect();
+}
+inline void MysqlConnectionPool::warmup_finished(bool is_connected, const std::string& error) {
+    std::exception_ptr result;
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        if (warmup_pending_ == 0) return;
+        --warmup_pending_;
+        if (is_connected) {
+            ++warmup_connected_;
+        } else {
+            warmup_error_ = error;
+        }
+        if (warmup_connected_ < min_size_ && warmup_pending_ > 0) return;
+        if (warmup_connected_ < min_size_) {
+            result = std::make_exception_ptr(MysqlException(ErrorCode::Connection, "only " + std::to_string(warmup_connected_) + " of " +
+                                                                                        std::to_string(min_size_) + " connections established: " + warmup_error_));
+        }
+    }
+    complete_ready(result);
+}
+inline void MysqlConnectionPool::complete_ready(std::exception_ptr error) {
+    std::vector<ReadyCallback> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        if (is_ready_done_) return;
+        is_ready_done_ = true;
+        ready_error_ = error;
+        callbacks.swap(ready_callbacks_);
+    }
+    if (ready_timer_) {
+        asio::post(shards_.front()->io_context_, [weak_this = weak_from_this()]() {
+            if (auto this_ptr = weak_this.lock()) this_ptr->ready_timer_->cancel();
+        });
+    }
+    for (auto& callback : callbacks) {
+        callback(error);
+    }
+}
+inline void MysqlConnectionPool::release_connection(Shard& shard, const MysqlConnectionPtr& conn) {
+    auto iter = shard.connections_.find(conn);
+    if (iter == shard.connections_.end()) {
+        return;
+    }
+    auto index = iter->second;
+    auto& slot = shard.slots_[index];
+    if (slot.state_.load(std::memory_order_acquire) == SlotState::Idle) {
+        // still in the ready stack, whoever pops it releases it
+        return;
+    }
+    bool is_lost = !slot.retired_;
+    if (is_lost) {
+        conn_count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    slot.conn_.reset();
+    slot.retired_ = false;
+    slot.state_.store(SlotState::Free, std::memory_order_relaxed);
+    shard.free_slots_.push_back(index);
+    shard.connections_.erase(iter);
+    if (is_lost) {
+        schedule_reconnect(shard, min_size_);
+    }
+    if (shard.conn_num_.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+        (!shard.deferred_cmds_.empty() || !shard.sql_cmds_.empty() || !shard.trans_callbacks_.empty())) {
+        schedule_drain(shard);
+    }
+}
+/**
+ * @brief 连接意外断开(或建立失败)后连接数低于target时, 等待退避时间后在同一分片上重新建立连接
+ * target通常为min_size, 见 hand_over
+ */
+inline void MysqlConnectionPool::schedule_reconnect(Shard& shard, std::size_t target) {
+    if (is_closing_.load(std::memory_order_relaxed)) return;
+    std::size_t count = conn_count_.load(std::memory_order_relaxed);
+    while (count < target && !conn_count_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
+    }
+    if (count >= target) return;
+    shard.conn_num_.fetch_add(1, std::memory_order_release);
+    // the first replacement is immediate, consecutive failures double the wait
+    auto delay = std::chrono::milliseconds(reconnect_backoff_ms_.load(std::memory_order_relaxed));
+    auto next = std::clamp(delay * 2, options_.reconnect_backoff_min, std::max(options_.reconnect_backoff_min, options_.reconnect_backoff_max));
+    reconnect_backoff_ms_.store(next.count(), std::memory_order_relaxed);
+    if (delay.count() > 0) {
+        auto not_before = std::chrono::steady_clock::now() + delay;
+        reconnect_not_before_.store(not_before.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    auto timer = std::make_shared<asio::steady_timer>(shard.io_context_, delay);
+    timer->async_wait([weak_this = weak_from_this(), shard = &shard, timer](const asio::error_code& ec) {
+        auto this_ptr = weak_this.lock();
+        if (!this_ptr) return;
+        if (ec || this_ptr->is_closing_.load(std::memory_order_relaxed)) {
+            this_ptr->conn_count_.fetch_sub(1, std::memory_order_relaxed);
+            shard->conn_num_.fetch_sub(1, std::memory_order_release);
+            return;
         }
-        this_ptr->handle_new_task(create_ptr);
+        this_ptr->metrics_->reconnects_.add();
+        this_ptr->create_connection(*shard, false);
     });
-
-    std::weak_ptr<MysqlConnection> weakConn = conn_ptr;
-    conn_ptr->set_complete_callback([weakPtr, weakConn]() {
+}
+inline void MysqlConnectionPool::schedule_keepalive() {
+    keepalive_timer_->expires_after(options_.keepalive_interval);
+    keepalive_timer_->async_wait([weak_this = weak_from_this()](const asio::error_code& ec) {
+        auto this_ptr = weak_this.lock();
+        if (ec || !this_ptr) return;
+        for (auto& shard : this_ptr->shards_) {
+            asio::post(shard->io_context_, [weak_this, shard = shard.get()]() {
+                auto this_ptr = weak_this.lock();
+                if (!this_ptr) return;
+                this_ptr->keepalive(*shard);
+            });
+        }
+        this_ptr->schedule_keepalive();
+    });
+}
+/**
+ * @brief ping分片上空闲超过keepalive_interval的连接, 在分片所在的io线程上调用
+ * 被检查的连接暂时移出空闲栈; 检查失败的连接被关闭, 由 schedule_reconnect 补充
+ */
+inline void MysqlConnectionPool::keepalive(Shard& shard) {
+    std::vector<std::uint32_t> indexes;
+    std::uint32_t index;
+    while (shard.ready_slots_.pop(index)) {
+        shard.slots_[index].state_.store(SlotState::Busy, std::memory_order_release);
+        idle_count_.fetch_sub(1, std::memory_order_relaxed);
+        indexes.push_back(index);
+    }
+    for (auto index : indexes) {
+        auto conn = shard.slots_[index].conn_;
+        if (conn->status() != ConnectStatus::Ok) {
+            release_connection(shard, conn);
+            continue;
+        }
+        if (conn->idle_for() < options_.keepalive_interval) {
+            handle_new_task(shard, index, conn);
+            continue;
+        }
+        conn->handle_ping([weak_this = weak_from_this(), shard = &shard, index, conn](bool is_alive) {
+            auto this_ptr = weak_this.lock();
+            if (!this_ptr) return;
+            if (!is_alive) {
+                conn->handle_close();
+                return;
+            }
+            this_ptr->handle_new_task(*shard, index, conn);
+        });
+    }
+}
+inline std::function<void()> MysqlConnectionPool::make_complete_callback(Shard& shard, std::uint32_t index, const MysqlConnectionPtr& conn) {
+    std::weak_ptr<MysqlConnectionPool> weakPtr = shared_from_this();
+    std::weak_ptr<MysqlConnection> weakConn = conn;
+    return [weakPtr, weakConn, shard = &shard, index]() {
         auto this_ptr = weakPtr.lock();
         if (this_ptr == nullptr)
             return;
         auto conn_ptr = weakConn.lock();
         if (conn_ptr == nullptr)
             return;
-        this_ptr->handle_new_task(conn_ptr);
-    });
-    conn_ptr->handle_connect();
-    return conn_ptr;
+        this_ptr->handle_new_task(*shard, index, conn_ptr);
+    };
 }
-inline void MysqlConnectionPool::handle_new_task(const MysqlConnectionPtr& conn) {
-    std::shared_ptr<SqlCmd> sql_cmd = nullptr;
-    TransactionPtrCallback trans_callback = nullptr;
-    bool is_extra = 0;
-    {
-        std::lock_guard<std::mutex> locker(conn_mutex_);
-        if (!sqlCmd_buffer_.empty()) {
-            sql_cmd = sqlCmd_buffer_.front();
-            sqlCmd_buffer_.pop_front();
-        } else if (!trans_callbacks_.empty()) {
-            trans_callback = std::move(*(trans_callbacks_.front()));
-            trans_callbacks_.pop_front();
-        } else {
-            if (connections_.size() > min_size_) {
-                is_extra = true;
-            } else {
-                ready_connections_.insert(conn);
-                busy_connections_.erase(conn);
-            }
+inline bool MysqlConnectionPool::pop_cmd(Shard& shard, SqlCmdPtr& cmd_ptr) {
+    while (shard.sql_cmds_.try_pop(cmd_ptr)) {
+        backlog_.fetch_sub(1);
+        if (blocked_producers_.load() > 0) {
+            backlog_.notify_all();
+        }
+        if (cmd_ptr->canceller_ && cmd_ptr->canceller_->is_cancelled()) {
+            // the caller has already been completed with ErrorCode::Cancelled
+            metrics_->dropped_.add();
+            cmd_ptr.reset();
+            continue;
+        }
+        if (cmd_ptr->expire_at_ != Deadline::max() && cmd_ptr->is_expired(std::chrono::steady_clock::now())) {
+            // shed instead of running a command whose caller has given up
+            metrics_->dropped_.add();
+            fail_cmd(cmd_ptr, ErrorCode::DeadlineExceeded, "sql command expired in queue");
+            cmd_ptr.reset();
+            continue;
         }
+        if (metrics_enabled || options_.autoscale.enabled) {
+            auto wait = std::chrono::steady_clock::now() - cmd_ptr->enqueued_at_;
+            metrics_->queue_wait_.record(wait);
+            if (options_.autoscale.enabled) record_wait(wait);
+        }
+        return true;
+    }
+    return false;
+}
+inline void MysqlConnectionPool::handle_new_task(Shard& shard, std::uint32_t index, const MysqlConnectionPtr& conn) {
+    SqlCmdPtr sql_cmd;
+    if (!shard.deferred_cmds_.empty()) {
+        sql_cmd = std::move(shard.deferred_cmds_.front());
+        shard.deferred_cmds_.pop_front();
+    } else {
+        pop_cmd(shard, sql_cmd);
     }
     if (sql_cmd) {
-        execute_sql(conn, std::move(sql_cmd->sql_), std::move(sql_cmd->result_callback_), std::move(sql_cmd->exception_callback_));
+        if (options_.pipeline_depth > 1 && sql_cmd->is_pipelinable()) {
+            std::vector<SqlCmdPtr> pipeline;
+            pipeline.reserve(options_.pipeline_depth);
+            pipeline.push_back(std::move(sql_cmd));
+            while (pipeline.size() < options_.pipeline_depth && pipeline.back()->is_pipelinable() &&
+                   pop_cmd(shard, sql_cmd)) {
+                if (!sql_cmd->is_batchable()) {
+                    // prepared statements, streams and LOAD DATA can not be packed into a multi statement,
+                    // commands with a deadline or a canceller need their own timer
+                    shard.deferred_cmds_.push_back(std::move(sql_cmd));
+                    schedule_drain(shard);
+                    break;
+                }
+                pipeline.push_back(std::move(sql_cmd));
+            }
+            if (pipeline.size() > 1) {
+                conn->execute_pipeline(std::move(pipeline));
+                return;
+            }
+            sql_cmd = std::move(pipeline.front());
+        }
+        execute_cmd(conn, std::move(sql_cmd));
+        return;
     }
-    if (trans_callback) {
-        begin_trans(conn, std::move(trans_callback));
-    } else {
-        if (is_extra) {
+    TransCallbackPtr trans_callback;
+    if (shard.trans_callbacks_.try_pop(trans_callback)) {
+        begin_trans(shard, index, conn, std::move(*trans_callback));
+        return;
+    }
+    if (!options_.autoscale.enabled) {
+        std::size_t count = conn_count_.load(std::memory_order_relaxed);
+        while (count > min_size_ && !conn_count_.compare_exchange_weak(count, count - 1, std::memory_order_relaxed)) {
+        }
+        if (count > min_size_) {
+            shard.slots_[index].retired_ = true;
             conn->handle_close();
+            return;
+        }
+    }
+    shard.slots_[index].state_.store(SlotState::Idle, std::memory_order_relaxed);
+    idle_count_.fetch_add(1, std::memory_order_relaxed);
+    shard.ready_slots_.push(index);
+    adopt_orphans();
+}
+inline void MysqlConnectionPool::record_wait(std::chrono::steady_clock::duration wait) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+    std::size_t bucket = 0;
+    while (us > 1 && bucket + 1 < wait_histogram_.size()) {
+        us >>= 1;
+        ++bucket;
+    }
+    wait_histogram_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+/**
+ * @brief 上个周期以来排队等待的百分位数(取所在格的上界), 并清空统计
+ */
+inline std::int64_t MysqlConnectionPool::wait_percentile(double percentile) {
+    std::array<std::uint32_t, 32> counts;
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        counts[i] = wait_histogram_[i].exchange(0, std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) return 0;
+    auto rank = static_cast<std::uint64_t>(std::ceil(percentile * total));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) return std::int64_t(2) << i;
+    }
+    return std::int64_t(2) << (counts.size() - 1);
+}
+inline void MysqlConnectionPool::schedule_autoscale() {
+    autoscale_timer_->expires_after(options_.autoscale.interval);
+    autoscale_timer_->async_wait([weak_this = weak_from_this()](const asio::error_code& ec) {
+        auto this_ptr = weak_this.lock();
+        if (ec || !this_ptr) return;
+        this_ptr->autoscale();
+        this_ptr->schedule_autoscale();
+    });
+}
+inline void MysqlConnectionPool::autoscale() {
+    const auto& opt = options_.autoscale;
+    auto now = std::chrono::steady_clock::now();
+    auto p95 = wait_percentile(0.95);
+    auto count = conn_count_.load(std::memory_order_relaxed);
+    auto idle = std::min(idle_count_.load(std::memory_order_relaxed), count);
+    auto backlog = backlog_.load(std::memory_order_relaxed);
+    auto in_use = count - idle;
+
+    // Holt's linear smoothing of the demand, used to see a ramp coming
+    double demand = static_cast<double>(in_use + backlog);
+    double last_level = demand_level_;
+    demand_level_ = 0.5 * demand + 0.5 * (demand_level_ + demand_trend_);
+    demand_trend_ = 0.3 * (demand_level_ - last_level) + 0.7 * demand_trend_;
+    // look ahead by the time a new connection needs to become usable
+    double horizon = std::max(1.0, static_cast<double>(connect_latency_us_.load(std::memory_order_relaxed)) /
+                                       std::chrono::duration_cast<std::chrono::microseconds>(opt.interval).count());
+    double predicted = demand_level_ + std::max(0.0, demand_trend_) * horizon;
+
+    std::size_t desired = std::max(count, min_size_);
+    if (p95 > opt.target_queue_wait.count() || backlog > 0) {
+        desired = std::max(desired, count + std::max<std::size_t>(1, std::min(backlog, opt.max_grow_step)));
+    }
+    if (opt.prewarm_headroom > 0) {
+        desired = std::max(desired, static_cast<std::size_t>(std::ceil(predicted * opt.prewarm_headroom)));
+    }
+    desired = std::min({desired, count + std::max<std::size_t>(opt.max_grow_step, min_size_ > count ? min_size_ - count : 0), max_size_});
+    if (desired > count) {
+        low_since_ = {};
+        grow(desired - count);
+        return;
+    }
+
+    // hysteresis: shrinking needs low utilization, a short queue and a flat forecast for a whole idle period
+    bool is_low = count > min_size_ && idle > 0 && in_use < opt.shrink_utilization * count && p95 * 2 <= opt.target_queue_wait.count() &&
+                  predicted * std::max(opt.prewarm_headroom, 1.0) < count;
+    if (!is_low) {
+        low_since_ = {};
+        return;
+    }
+    if (low_since_ == std::chrono::steady_clock::time_point{}) {
+        low_since_ = now;
+        return;
+    }
+    if (now - low_since_ < opt.idle_before_shrink) return;
+    low_since_ = now;
+    auto retire = std::min({opt.shrink_step, count - min_size_, idle});
+    for (std::size_t i = 0; i < retire; ++i) {
+        auto& shard = next_shard();
+        asio::post(shard.io_context_, [weak_this = weak_from_this(), shard = &shard]() {
+            auto this_ptr = weak_this.lock();
+            if (!this_ptr) return;
+            this_ptr->retire_idle(*shard);
+        });
+    }
+}
+inline void MysqlConnectionPool::grow(std::size_t connections) {
+    for (std::size_t i = 0; i < connections; ++i) {
+        std::size_t count = conn_count_.load(std::memory_order_relaxed);
+        while (count < max_size_ && !conn_count_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
         }
+        if (count >= max_size_) return;
+        post_create_connection(next_shard());
     }
 }
-inline void MysqlConnectionPool::begin_trans(const MysqlConnectionPtr& conn, TransactionPtrCallback&& callback) {
+/**
+ * @brief 关闭分片上的一个空闲连接, 在分片所在的io线程上调用
+ */
+inline void MysqlConnectionPool::retire_idle(Shard& shard) {
+    std::uint32_t index;
+    if (!shard.ready_slots_.pop(index)) return;
+    auto& slot = shard.slots_[index];
+    auto conn = slot.conn_;
+    slot.state_.store(SlotState::Busy, std::memory_order_release);
+    idle_count_.fetch_sub(1, std::memory_order_relaxed);
+    std::size_t count = conn_count_.load(std::memory_order_relaxed);
+    while (count > min_size_ && !conn_count_.compare_exchange_weak(count, count - 1, std::memory_order_relaxed)) {
+    }
+    if (count <= min_size_ || conn->status() != ConnectStatus::Ok) {
+        // went under min_size_ meanwhile, or broken: let the normal path handle it
+        if (count > min_size_) conn_count_.fetch_add(1, std::memory_order_relaxed);
+        if (conn->status() != ConnectStatus::Ok) {
+            release_connection(shard, conn);
+        } else {
+            handle_new_task(shard, index, conn);
+        }
+        return;
+    }
+    slot.retired_ = true;
+    conn->handle_close();
+}
+inline void MysqlConnectionPool::begin_trans(Shard& shard, std::uint32_t index, const MysqlConnectionPtr& conn, TransactionPtrCallback&& callback) {
     std::weak_ptr<MysqlConnectionPool> weakThis = shared_from_this();
     auto trans = std::make_shared<MysqlTransaction>(conn,
                                                      std::function<void(bool)>(),
-                                                     [weakThis, conn]() {
+                                                     [weakThis, conn, shard = &shard, index]() {
                                                          auto thisPtr = weakThis.lock();
                                                          if (!thisPtr)
                                                              return;
                                                          if (conn->status() == ConnectStatus::Bad) {
                                                              return;
                                                          }
-                                                         {
-                                                             std::lock_guard<std::mutex> guard(thisPtr->conn_mutex_);
-                                                             if (thisPtr->connections_.find(conn) ==
-                                                                 thisPtr->connections_.end()) {
-                                                                 // connection is broken and removed
-                                                                 //  assert(thisPtr->busyConnections_.find(conn) ==
-                                                                 //             thisPtr->busyConnections_.end() &&
-                                                                 //         thisPtr->readyConnections_.find(conn) ==
-                                                                 //             thisPtr->readyConnections_.end());
-
-                                                                 return;
-                                                             }
-                                                         }
-                                                         asio::post(conn->io_context(), [weakThis, conn]() {
+                                                         asio::post(conn->strand(), [weakThis, conn, shard, index]() {
                                                              auto thisPtr = weakThis.lock();
                                                              if (!thisPtr)
                                                                  return;
-                                                             std::weak_ptr<MysqlConnection> weakConn(conn);
-                                                             conn->set_complete_callback([weakThis, weakConn]() {
-                                                                 auto thisPtr = weakThis.lock();
-                                                                 if (!thisPtr)
-                                                                     return;
-                                                                 auto connPtr = weakConn.lock();
-                                                                 if (!connPtr)
-                                                                     return;
-                                                                 thisPtr->handle_new_task(connPtr);
-                                                             });
-                                                             thisPtr->handle_new_task(conn);
+                                                             if (shard->connections_.find(conn) == shard->connections_.end()) {
+                                                                 // connection is broken and removed
+                                                                 return;
+                                                             }
+                                                             conn->set_complete_callback(thisPtr->make_complete_callback(*shard, index, conn));
+                                                             thisPtr->handle_new_task(*shard, index, conn);
                                                          });
-                                                     });
+                                                     },
+                                                     options_.merge_transaction_statements);
     trans->do_begin();
-    asio::post(conn->io_context(),
+    asio::post(conn->strand(),
                [callback = std::move(callback), trans]() { callback(trans); });
 }
+inline void MysqlConnectionPool::start_transaction_run(const std::shared_ptr<TransactionRun>& run) {
+    run->error_ = nullptr;
+    new_transaction_async([weak_this = weak_from_this(), run](const MysqlTransactionPtr& trans) {
+        if (!trans) {
+            run->done_(std::make_exception_ptr(MysqlException(ErrorCode::Overloaded, "too many queued transactions")));
+            return;
+        }
+        trans->set_failure_callback([run](const std::exception_ptr& error) {
+            if (!run->error_) run->error_ = error;
+        });
+        trans->set_commit_callback([weak_this, run](bool is_committed) {
+            if (is_committed) {
+                run->done_(nullptr);
+                return;
+            }
+            auto error = run->error_ ? run->error_ : std::make_exception_ptr(MysqlException(ErrorCode::Cancelled, "transaction has been rolled back"));
+            auto this_ptr = weak_this.lock();
+            if (!this_ptr || !run->error_ || !is_retryable(run->error_, run->policy_)) {
+                run->done_(error);
+                return;
+            }
+            if (run->retries_ >= run->policy_.max_retries) {
+                this_ptr->metrics_->transaction_exhausted_.add();
+                run->done_(error);
+                return;
+            }
+            this_ptr->metrics_->transaction_retries_.add();
+            this_ptr->retry_transaction_run(run);
+        });
+        run->body_(trans);
+    });
+}
+inline void MysqlConnectionPool::retry_transaction_run(const std::shared_ptr<TransactionRun>& run) {
+    auto& policy = run->policy_;
+    auto ceiling = std::min<std::int64_t>(policy.backoff_max.count(), policy.backoff_min.count() << std::min<std::size_t>(run->retries_, 20));
+    ++run->retries_;
+    thread_local std::minstd_rand engine(std::random_device{}());
+    std::chrono::milliseconds delay(std::uniform_int_distribution<std::int64_t>(0, std::max<std::int64_t>(ceiling, 0))(engine));
+    auto timer = std::make_shared<asio::steady_timer>(next_shard().io_context_, delay);
+    timer->async_wait([weak_this = weak_from_this(), run, timer](const asio::error_code& ec) {
+        auto this_ptr = weak_this.lock();
+        if (ec || !this_ptr) {
+            run->done_(run->error_);
+            return;
+        }
+        this_ptr->start_transaction_run(run);
+    });
+}
 }  // namespace db
 
-// namespace test
\ No newline at end of file
+// namespace test
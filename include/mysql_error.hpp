@@ -0,0 +1,74 @@
+#pragma once
+
+#include <mariadb/errmsg.h>
+#include <mariadb/mysqld_error.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace db {
+/**
+ * @brief 错误回调中异常的分类
+ */
+enum class ErrorCode {
+    Server = 1,        //服务端返回的错误, 连接仍然可用
+    Connection,        //客户端库的错误(CR_*), 连接已经不可用
+    Overloaded,        //积压队列已满, 命令没有被接受
+    DeadlineExceeded,  //命令在队列中等待超过了截止时间, 没有被执行
+    Timeout,           //命令执行超时, 语句已被KILL QUERY
+    Cancelled,         //调用方取消了命令
+};
+inline const char* to_string(ErrorCode code) noexcept {
+    switch (code) {
+        case ErrorCode::Server:
+            return "server";
+        case ErrorCode::Connection:
+            return "connection";
+        case ErrorCode::Overloaded:
+            return "overloaded";
+        case ErrorCode::DeadlineExceeded:
+            return "deadline exceeded";
+        case ErrorCode::Timeout:
+            return "timeout";
+        case ErrorCode::Cancelled:
+            return "cancelled";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief 错误回调收到的异常类型, 继承自std::runtime_error, 原有按runtime_error捕获的代码不受影响
+ */
+class MysqlException : public std::runtime_error {
+   private:
+    ErrorCode code_;
+    unsigned int mysql_errno_;
+
+   public:
+    MysqlException(ErrorCode code, const std::string& message, unsigned int mysql_errno = 0)
+        : std::runtime_error(message), code_(code), mysql_errno_(mysql_errno) {}
+
+    /**
+     * @brief 由mysql_errno得到异常, CR_*范围内的错误视为连接不可用
+     *
+     * @param mysql_errno
+     * @param message
+     * @return MysqlException
+     */
+    static MysqlException from_errno(unsigned int mysql_errno, const char* message) {
+        bool is_broken = mysql_errno >= CR_MIN_ERROR && mysql_errno <= CR_MAX_ERROR;
+        return MysqlException(is_broken ? ErrorCode::Connection : ErrorCode::Server, message ? message : "", mysql_errno);
+    }
+
+    ErrorCode code() const noexcept { return code_; }
+    unsigned int mysql_errno() const noexcept { return mysql_errno_; }
+    /**
+     * @brief 死锁, 服务端已经回滚了整个事务
+     */
+    bool is_deadlock() const noexcept { return mysql_errno_ == ER_LOCK_DEADLOCK; }
+    /**
+     * @brief 锁等待超时, 默认只回滚了这条语句
+     */
+    bool is_lock_wait_timeout() const noexcept { return mysql_errno_ == ER_LOCK_WAIT_TIMEOUT; }
+};
+}  // namespace db
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace db {
+/**
+ * 编译时定义 DB_DISABLE_METRICS 可以去掉所有统计: 记录函数变为空操作, 也不再读取时钟
+ */
+#ifdef DB_DISABLE_METRICS
+constexpr bool metrics_enabled = false;
+#else
+constexpr bool metrics_enabled = true;
+#endif
+
+/**
+ * @brief 某一时刻的延迟分布, 单位为微秒
+ */
+struct HistogramSnapshot {
+    std::vector<std::uint64_t> counts;  //第i格的样本数, 上界见 LatencyHistogram::upper_bound
+    std::uint64_t count = 0;
+    std::uint64_t sum_us = 0;
+    std::uint64_t max_us = 0;
+
+    /**
+     * @brief 百分位数, 取所在格的上界, 误差不超过1/8
+     *
+     * @param percentile 0~1
+     * @return std::uint64_t
+     */
+    std::uint64_t percentile(double percentile) const;
+    /**
+     * @brief 不超过le微秒的样本数
+     */
+    std::uint64_t count_below(std::uint64_t le_us) const;
+    double mean_us() const noexcept { return count ? static_cast<double>(sum_us) / count : 0; }
+};
+
+/**
+ * @brief 无锁的对数-线性延迟直方图(HDR风格)
+ * 每个2的幂区间再线性分成8格, 相对误差不超过12.5%; 范围为0到2^40微秒, 更大的值记入最后一格
+ * 记录只是几次relaxed原子加, 可以在任意线程上并发调用
+ */
+class LatencyHistogram {
+   public:
+    static constexpr std::size_t sub_bucket_bits = 3;
+    static constexpr std::size_t sub_buckets = std::size_t(1) << sub_bucket_bits;
+    static constexpr std::size_t max_bits = 40;
+    static constexpr std::size_t bucket_count = (max_bits - sub_bucket_bits + 1) * sub_buckets;
+    static constexpr std::uint64_t max_value = (std::uint64_t(1) << max_bits) - 1;
+
+    static constexpr std::size_t index(std::uint64_t us) noexcept {
+        if (us > max_value) us = max_value;
+        if (us < 2 * sub_buckets) return static_cast<std::size_t>(us);
+        auto shift = static_cast<std::size_t>(std::bit_width(us)) - sub_bucket_bits - 1;
+        return (shift + 1) * sub_buckets + static_cast<std::size_t>(us >> shift) - sub_buckets;
+    }
+    /**
+     * @brief 第i格包含的最大值
+     */
+    static constexpr std::uint64_t upper_bound(std::size_t i) noexcept {
+        if (i < 2 * sub_buckets) return i;
+        auto shift = i / sub_buckets - 1;
+        auto sub_index = i % sub_buckets + sub_buckets;
+        return ((std::uint64_t(sub_index) + 1) << shift) - 1;
+    }
+
+    void record(std::chrono::steady_clock::duration elapsed) noexcept {
+        if constexpr (metrics_enabled) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            record_us(us < 0 ? 0 : static_cast<std::uint64_t>(us));
+        }
+    }
+    void record_us(std::uint64_t us) noexcept {
+        if constexpr (metrics_enabled) {
+            counts_[index(us)].fetch_add(1, std::memory_order_relaxed);
+            sum_us_.fetch_add(us, std::memory_order_relaxed);
+            auto max = max_us_.load(std::memory_order_relaxed);
+            while (us > max && !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+            }
+        }
+    }
+    /**
+     * @brief 各格分别读取, 与并发的记录之间不是一个原子快照
+     */
+    HistogramSnapshot snapshot() const {
+        HistogramSnapshot result;
+        result.counts.resize(bucket_count);
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            result.counts[i] = counts_[i].load(std::memory_order_relaxed);
+            // summed from the buckets so that the cumulative counts never exceed the total
+            result.count += result.counts[i];
+        }
+        result.sum_us = sum_us_.load(std::memory_order_relaxed);
+        result.max_us = max_us_.load(std::memory_order_relaxed);
+        return result;
+    }
+
+   private:
+    std::array<std::atomic<std::uint64_t>, bucket_count> counts_{};
+    std::atomic<std::uint64_t> sum_us_{0};
+    std::atomic<std::uint64_t> max_us_{0};
+};
+
+inline std::uint64_t HistogramSnapshot::percentile(double percentile) const {
+    auto total = count;
+    if (total == 0) return 0;
+    auto rank = static_cast<std::uint64_t>(percentile * total);
+    if (rank == 0) rank = 1;
+    if (rank > total) rank = total;
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) return std::min(LatencyHistogram::upper_bound(i), max_us);
+    }
+    return max_us;
+}
+inline std::uint64_t HistogramSnapshot::count_below(std::uint64_t le_us) const {
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size() && LatencyHistogram::upper_bound(i) <= le_us; ++i) {
+        seen += counts[i];
+    }
+    return seen;
+}
+
+/**
+ * @brief 只增不减的计数
+ */
+class MetricCounter {
+   public:
+    void add(std::uint64_t n = 1) noexcept {
+        if constexpr (metrics_enabled) value_.fetch_add(n, std::memory_order_relaxed);
+    }
+    std::uint64_t value() const noexcept { return value_.load(std::memory_order_relaxed); }
+
+   private:
+    std::atomic<std::uint64_t> value_{0};
+};
+
+/**
+ * @brief 一个连接池的统计, 由连接池与其中的连接共享
+ */
+struct PoolMetrics {
+    LatencyHistogram queue_wait_;    //命令从提交到拿到连接, 直接拿到空闲连接的记为0
+    LatencyHistogram connect_time_;  //建立连接(含握手)的耗时
+    LatencyHistogram round_trip_;    //发送语句到读完结果的耗时
+    LatencyHistogram decode_time_;   //把结果转换成MysqlResult的耗时
+    MetricCounter queued_;           //进入积压队列的命令数
+    MetricCounter executed_;         //成功返回的结果数, 一条语句返回多个结果集时计多次
+    MetricCounter failed_;           //执行失败(包括超时与取消)的语句数
+    MetricCounter dropped_;          //没有执行就被丢弃的命令数: 队列已满, 排队超时或取消
+    MetricCounter reconnects_;       //连接断开后重新建立连接的次数
+    MetricCounter transaction_retries_;    //run_transaction 因死锁或锁等待超时重新执行事务的次数
+    MetricCounter transaction_exhausted_;  //重试次数用完仍然失败的事务数
+};
+using PoolMetricsPtr = std::shared_ptr<PoolMetrics>;
+
+/**
+ * @brief 连接池统计的快照, 通过 MysqlConnectionPool::metrics 获取
+ */
+struct MetricsSnapshot {
+    HistogramSnapshot queue_wait;
+    HistogramSnapshot connect_time;
+    HistogramSnapshot round_trip;
+    HistogramSnapshot decode_time;
+    std::uint64_t queued = 0;
+    std::uint64_t executed = 0;
+    std::uint64_t failed = 0;
+    std::uint64_t dropped = 0;
+    std::uint64_t reconnects = 0;
+    std::uint64_t transaction_retries = 0;
+    std::uint64_t transaction_exhausted = 0;
+    std::size_t ready_connections = 0;  //空闲的连接
+    std::size_t busy_connections = 0;   //使用中以及正在建立的连接
+    std::size_t total_connections = 0;
+    std::size_t backlog = 0;
+};
+
+namespace detail {
+inline void append_labels(std::string& out, std::string_view labels, std::string_view extra = {}) {
+    if (labels.empty() && extra.empty()) return;
+    out += '{';
+    out.append(labels);
+    if (!labels.empty() && !extra.empty()) out += ',';
+    out.append(extra);
+    out += '}';
+}
+inline void append_histogram(std::string& out, std::string_view prefix, std::string_view name, std::string_view help, std::string_view labels,
+                             const HistogramSnapshot& histogram) {
+    std::string full_name(prefix);
+    full_name.append("_").append(name).append("_seconds");
+    out.append("# HELP ").append(full_name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(full_name).append(" histogram\n");
+    // powers of two from 16us to about 67s keep the exposition short
+    for (std::size_t bits = 4; bits <= 26; ++bits) {
+        auto le_us = std::uint64_t(1) << bits;
+        out.append(full_name).append("_bucket");
+        append_labels(out, labels, "le=\"" + std::to_string(le_us / 1e6) + "\"");
+        out.append(" ").append(std::to_string(histogram.count_below(le_us))).append("\n");
+    }
+    out.append(full_name).append("_bucket");
+    append_labels(out, labels, "le=\"+Inf\"");
+    out.append(" ").append(std::to_string(histogram.count)).append("\n");
+    out.append(full_name).append("_sum");
+    append_labels(out, labels);
+    out.append(" ").append(std::to_string(histogram.sum_us / 1e6)).append("\n");
+    out.append(full_name).append("_count");
+    append_labels(out, labels);
+    out.append(" ").append(std::to_string(histogram.count)).append("\n");
+}
+inline void append_scalar(std::string& out, std::string_view prefix, std::string_view name, std::string_view type, std::string_view help,
+                          std::string_view labels, std::uint64_t value) {
+    std::string full_name(prefix);
+    full_name.append("_").append(name);
+    out.append("# HELP ").append(full_name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(full_name).append(" ").append(type).append("\n");
+    out.append(full_name);
+    append_labels(out, labels);
+    out.append(" ").append(std::to_string(value)).append("\n");
+}
+}  // namespace detail
+
+/**
+ * @brief 按Prometheus文本格式输出, 延迟换算为秒
+ *
+ * @param snapshot
+ * @param prefix 指标名的前缀
+ * @param labels 附加在每个指标上的标签, 例如 pool="primary", 可以为空
+ * @return std::string
+ */
+inline std::string to_prometheus(const MetricsSnapshot& snapshot, std::string_view prefix = "mysql_pool", std::string_view labels = {}) {
+    std::string out;
+    out.reserve(8192);
+    detail::append_histogram(out, prefix, "queue_wait", "Time from submitting a command to getting a connection.", labels, snapshot.queue_wait);
+    detail::append_histogram(out, prefix, "connect", "Time to establish a connection.", labels, snapshot.connect_time);
+    detail::append_histogram(out, prefix, "round_trip", "Time from sending a statement to reading its whole result.", labels, snapshot.round_trip);
+    detail::append_histogram(out, prefix, "decode", "Time to build a result object.", labels, snapshot.decode_time);
+    detail::append_scalar(out, prefix, "queued_total", "counter", "Commands put into the backlog.", labels, snapshot.queued);
+    detail::append_scalar(out, prefix, "executed_total", "counter", "Results returned successfully.", labels, snapshot.executed);
+    detail::append_scalar(out, prefix, "failed_total", "counter", "Statements failed, timed out or cancelled.", labels, snapshot.failed);
+    detail::append_scalar(out, prefix, "dropped_total", "counter", "Commands dropped before execution.", labels, snapshot.dropped);
+    detail::append_scalar(out, prefix, "reconnects_total", "counter", "Connections re-established after a disconnect.", labels, snapshot.reconnects);
+    detail::append_scalar(out, prefix, "transaction_retries_total", "counter", "Transactions replayed after a deadlock or lock wait timeout.", labels,
+                          snapshot.transaction_retries);
+    detail::append_scalar(out, prefix, "transaction_retries_exhausted_total", "counter", "Transactions that still failed after the last retry.", labels,
+                          snapshot.transaction_exhausted);
+    detail::append_scalar(out, prefix, "ready_connections", "gauge", "Idle connections.", labels, snapshot.ready_connections);
+    detail::append_scalar(out, prefix, "busy_connections", "gauge", "Connections in use or being established.", labels, snapshot.busy_connections);
+    detail::append_scalar(out, prefix, "connections", "gauge", "All connections.", labels, snapshot.total_connections);
+    detail::append_scalar(out, prefix, "backlog", "gauge", "Commands waiting in the backlog.", labels, snapshot.backlog);
+    return out;
+}
+}  // namespace db
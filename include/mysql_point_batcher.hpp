@@ -0,0 +1,207 @@
+#pragma once
+
+#include <asio.hpp>
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "mysql_connection.hpp"
+#include "mysql_result.hpp"
+#include "sql_text.hpp"
+namespace db {
+/**
+ * @brief 点查合并
+ * 短时间窗口内同一模板(例如 select id, name from user where id = ?)的多次查询合并成一条 where id in (...) 查询,
+ * 结果按键拆开后分别回调各个调用方
+ * 要求: 模板以 "<键列> = ?" 结尾, 键为整数, 且键列出现在select的列中; 同一个键的多个调用方得到相同的行
+ * 结果总是文本协议的行, 与单独执行(bind_key)时相同
+ */
+class PointQueryBatcher : public std::enable_shared_from_this<PointQueryBatcher> {
+   public:
+    using Executor = std::function<void(SqlText&& sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb)>;
+
+   private:
+    struct Waiter {
+        long long key_;
+        ResultPtrCallback result_callback_;
+        ExceptPtrCallback except_callback_;
+    };
+    struct Batch {
+        std::string sql_;         //模板原文
+        std::string_view prefix_;  //模板中 "= ?" 之前的部分, 以键列结尾
+        std::string key_column_;  //结果中键列的名字
+        std::vector<Waiter> waiters_;
+    };
+    using BatchPtr = std::shared_ptr<Batch>;
+
+    Executor executor_;
+    asio::io_context& io_context_;
+    std::chrono::microseconds window_;
+    std::size_t max_keys_;
+
+    std::mutex mutex_;
+    // keyed by the hash of the template; on a collision the second template is executed alone
+    std::unordered_map<std::size_t, BatchPtr> pending_;
+
+   public:
+    PointQueryBatcher(Executor&& executor, asio::io_context& io_context, std::chrono::microseconds window, std::size_t max_keys)
+        : executor_(std::move(executor)), io_context_(io_context), window_(window), max_keys_(max_keys == 0 ? 1 : max_keys) {}
+
+    /**
+     * @brief 加入一次点查, 在窗口结束或键数达到上限时与同模板的其它点查一起发送
+     *
+     * @param sql 以 "<键列> = ?" 结尾的模板
+     * @param key
+     * @param result_callback 只包含键等于key的行
+     * @param except_callback 模板不合法时收到 std::invalid_argument
+     */
+    void lookup(std::string_view sql, long long key, ResultPtrCallback&& result_callback, ExceptPtrCallback&& except_callback) {
+        BatchPtr full;
+        try {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto hash = std::hash<std::string_view>()(sql);
+            auto iter = pending_.find(hash);
+            if (iter != pending_.end() && iter->second->sql_ != sql) {
+                // hash collision, not worth a second map
+                full = make_batch(sql);
+                full->waiters_.push_back({key, std::move(result_callback), std::move(except_callback)});
+            } else {
+                if (iter == pending_.end()) {
+                    iter = pending_.emplace(hash, make_batch(sql)).first;
+                    arm_timer(iter->second);
+                }
+                auto& batch = iter->second;
+                batch->waiters_.push_back({key, std::move(result_callback), std::move(except_callback)});
+                if (batch->waiters_.size() >= max_keys_) {
+                    full = std::move(batch);
+                    pending_.erase(iter);
+                }
+            }
+        } catch (const std::invalid_argument&) {
+            // make_batch throws before the callbacks are moved
+            if (except_callback) except_callback(std::current_exception());
+            return;
+        }
+        if (full) dispatch(full);
+    }
+    /**
+     * @brief 不合并时单独执行的sql: 模板中的?换成key, 以文本协议执行, 结果与合并发送时相同
+     *
+     * @param sql 以 "<键列> = ?" 结尾的模板, 不合法时抛出 std::invalid_argument
+     * @param key
+     * @return SqlText
+     */
+    static SqlText bind_key(std::string_view sql, long long key) {
+        SqlText text(key_prefix(sql));
+        text.append(" = ");
+        char buf[24];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), key);
+        text.append(std::string_view(buf, end - buf));
+        return text;
+    }
+
+   private:
+    /**
+     * @brief 模板中 "= ?" 之前的部分, 以键列结尾
+     */
+    static std::string_view key_prefix(std::string_view text) {
+        auto end = text.find_last_not_of(" \t\r\n;");
+        if (end == std::string_view::npos || text[end] != '?' || end == 0) {
+            throw std::invalid_argument("point query must end with \"<column> = ?\"");
+        }
+        auto eq = text.find_last_not_of(" \t\r\n", end - 1);
+        if (eq == std::string_view::npos || text[eq] != '=') {
+            throw std::invalid_argument("point query must end with \"<column> = ?\"");
+        }
+        auto prefix = text.substr(0, eq);
+        auto column_end = prefix.find_last_not_of(" \t\r\n");
+        return prefix.substr(0, column_end == std::string_view::npos ? 0 : column_end + 1);
+    }
+    static BatchPtr make_batch(std::string_view sql) {
+        auto batch = std::make_shared<Batch>();
+        batch->sql_.assign(sql);
+        batch->prefix_ = key_prefix(batch->sql_);
+        // the key column is the last identifier before '=', without table qualifier and backquotes
+        auto column = batch->prefix_;
+        auto column_begin = column.find_last_of(" \t\r\n.(");
+        column = column.substr(column_begin == std::string_view::npos ? 0 : column_begin + 1);
+        for (auto c : column) {
+            if (c != '`') batch->key_column_ += c;
+        }
+        if (batch->key_column_.empty()) {
+            throw std::invalid_argument("point query must end with \"<column> = ?\"");
+        }
+        return batch;
+    }
+    void arm_timer(const BatchPtr& batch) {
+        auto timer = std::make_shared<asio::steady_timer>(io_context_, window_);
+        timer->async_wait([weak_this = weak_from_this(), weak_batch = std::weak_ptr<Batch>(batch), timer](const asio::error_code& ec) {
+            auto this_ptr = weak_this.lock();
+            auto batch = weak_batch.lock();
+            if (ec || !this_ptr || !batch) return;
+            {
+                std::lock_guard<std::mutex> lock(this_ptr->mutex_);
+                auto iter = this_ptr->pending_.find(std::hash<std::string_view>()(batch->sql_));
+                // already sent because it reached max_keys
+                if (iter == this_ptr->pending_.end() || iter->second != batch) return;
+                this_ptr->pending_.erase(iter);
+            }
+            this_ptr->dispatch(batch);
+        });
+    }
+    void dispatch(const BatchPtr& batch) {
+        SqlText sql(batch->prefix_);
+        sql.append(" IN (");
+        for (std::size_t i = 0; i < batch->waiters_.size(); ++i) {
+            if (i) sql.push_back(',');
+            char buf[24];
+            auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), batch->waiters_[i].key_);
+            sql.append(std::string_view(buf, end - buf));
+        }
+        sql.push_back(')');
+        executor_(
+            std::move(sql),
+            [batch](const MysqlResultPtr& result) { demultiplex(*batch, result); },
+            [batch](std::exception_ptr except) {
+                for (auto& waiter : batch->waiters_) {
+                    if (waiter.except_callback_) waiter.except_callback_(except);
+                }
+            });
+    }
+    static void demultiplex(Batch& batch, const MysqlResultPtr& result) {
+        if (batch.waiters_.size() == 1) {
+            if (batch.waiters_[0].result_callback_) batch.waiters_[0].result_callback_(result);
+            return;
+        }
+        auto column = result->columnNumber(batch.key_column_);
+        if (column >= result->columns()) {
+            auto except = std::make_exception_ptr(std::runtime_error("key column " + batch.key_column_ + " is not selected by the point query"));
+            for (auto& waiter : batch.waiters_) {
+                if (waiter.except_callback_) waiter.except_callback_(except);
+            }
+            return;
+        }
+        std::unordered_map<long long, std::vector<MysqlResult::SizeType>> rows;
+        rows.reserve(batch.waiters_.size());
+        for (MysqlResult::SizeType row = 0; row < result->size(); ++row) {
+            if (!result->isNull(row, column)) {
+                rows[result->get<long long>(row, column)].push_back(row);
+            }
+        }
+        static const std::vector<MysqlResult::SizeType> no_rows;
+        for (auto& waiter : batch.waiters_) {
+            if (!waiter.result_callback_) continue;
+            auto iter = rows.find(waiter.key_);
+            waiter.result_callback_(std::make_shared<MysqlResult>(*result, iter == rows.end() ? no_rows : iter->second));
+        }
+    }
+};
+using PointQueryBatcherPtr = std::shared_ptr<PointQueryBatcher>;
+}  // namespace db
@@ -8,46 +8,441 @@
 #include <string.h>
 
 #include <algorithm>
-#include <map>
+#include <charconv>
+#include <unordered_map>
 #include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 namespace db {
 enum class SqlStatus {
     Ok,
     End
 };
+/**
+ * @brief 二进制协议下格子的存放方式, 由字段类型决定
+ */
+enum class BinaryCell { Text,
+                        Integer,  // 8字节 long long / unsigned long long
+                        Double };  // 8字节 double
+inline BinaryCell binary_cell_kind(enum_field_types type) noexcept {
+    switch (type) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_YEAR:
+            return BinaryCell::Integer;
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+            return BinaryCell::Double;
+        default:
+            return BinaryCell::Text;
+    }
+}
+namespace detail {
+template <typename T>
+struct is_optional : std::false_type {};
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+/**
+ * @brief 把一个非NULL的格子解码成T, 不分配内存(std::string除外)
+ * 文本格子用std::from_chars解析, 二进制数值格子直接memcpy
+ */
+template <typename T>
+T decode_cell(const char* value, unsigned long length, BinaryCell kind, bool is_unsigned) {
+    if constexpr (std::is_same_v<T, std::string_view>) {
+        if (kind != BinaryCell::Text) throw std::runtime_error("binary numeric cell can not be viewed as text");
+        return std::string_view(value, length);
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        if (kind == BinaryCell::Integer) return is_unsigned ? std::to_string(decode_cell<unsigned long long>(value, length, kind, true)) : std::to_string(decode_cell<long long>(value, length, kind, false));
+        if (kind == BinaryCell::Double) return std::to_string(decode_cell<double>(value, length, kind, false));
+        return std::string(value, length);
+    } else if constexpr (std::is_arithmetic_v<T>) {
+        if (kind == BinaryCell::Integer) {
+            long long number;
+            memcpy(&number, value, sizeof(number));
+            if (is_unsigned) return static_cast<T>(static_cast<unsigned long long>(number));
+            return static_cast<T>(number);
+        }
+        if (kind == BinaryCell::Double) {
+            double number;
+            memcpy(&number, value, sizeof(number));
+            return static_cast<T>(number);
+        }
+        using Parsed = std::conditional_t<std::is_same_v<T, bool>, int, T>;
+        Parsed number{};
+        auto [end, ec] = std::from_chars(value, value + length, number);
+        if (ec != std::errc() || end != value + length) {
+            throw std::runtime_error("can not convert cell \"" + std::string(value, length) + "\"");
+        }
+        return static_cast<T>(number);
+    } else {
+        static_assert(std::is_arithmetic_v<T>, "unsupported cell type");
+    }
+}
+}  // namespace detail
+/**
+ * @brief 拷贝出来的结果行, 所有格子的值都在data_中, 用于预处理语句与流式查询
+ * 二进制协议(预处理语句)时整数列为8字节的long long(无符号列为unsigned long long), 浮点列为8字节的double,
+ * 其余列以及文本协议的所有列为以'\0'结尾的文本
+ */
+struct RowBuffer {
+    std::string data_;
+    std::vector<const char*> cells_;  //按行存放 rows * columns, NULL 表示该格子为NULL
+    std::vector<unsigned long> lengths_;
+
+    /**
+     * @brief 追加一个格子
+     *
+     * @param value NULL 表示该格子为NULL
+     * @param length
+     * @param terminate 是否补一个'\0', 文本值需要
+     */
+    void append(const char* value, unsigned long length, bool terminate = true) {
+        if (!value) {
+            offsets_.push_back(std::string::npos);
+            lengths_.push_back(0);
+            return;
+        }
+        offsets_.push_back(data_.size());
+        data_.append(value, length);
+        if (terminate) {
+            data_.push_back('\0');
+        }
+        lengths_.push_back(length);
+    }
+    /**
+     * @brief 所有格子追加完毕后, 把偏移转换成指针; 之后不能再追加
+     */
+    void finish() {
+        cells_.clear();
+        cells_.reserve(offsets_.size());
+        for (auto offset : offsets_) {
+            cells_.push_back(offset == std::string::npos ? nullptr : data_.data() + offset);
+        }
+        offsets_.clear();
+    }
+
+   private:
+    std::vector<std::size_t> offsets_;  // data_ 追加时可能重新分配, 先记录偏移
+};
+/**
+ * @brief 字段信息的拷贝
+ * 流式查询的MYSQL_RES必须在连接执行下一条语句之前释放, 交给用户的各批结果不能引用它
+ */
+class FieldArray {
+   private:
+    std::vector<MYSQL_FIELD> fields_;
+    std::vector<std::unique_ptr<char[]>> strings_;
+
+    char* copy(const char* str) {
+        if (!str) return nullptr;
+        auto size = strlen(str) + 1;
+        strings_.emplace_back(std::make_unique<char[]>(size));
+        memcpy(strings_.back().get(), str, size);
+        return strings_.back().get();
+    }
+
+   public:
+    FieldArray(const MYSQL_FIELD* fields, unsigned int count) : fields_(fields, fields + count) {
+        for (auto& field : fields_) {
+            field.name = copy(field.name);
+            field.org_name = copy(field.org_name);
+            field.table = copy(field.table);
+            field.org_table = copy(field.org_table);
+            field.db = copy(field.db);
+            field.catalog = copy(field.catalog);
+            field.def = copy(field.def);
+            field.extension = nullptr;
+        }
+    }
+    FieldArray(const FieldArray&) = delete;
+    FieldArray& operator=(const FieldArray&) = delete;
+    const MYSQL_FIELD* data() const noexcept { return fields_.data(); }
+    unsigned int size() const noexcept { return static_cast<unsigned int>(fields_.size()); }
+};
+/**
+ * @brief 结果的字段名字表, 按不区分大小写的字典序排好, 查找为二分且不分配内存
+ * 同一形状(同一条sql)的结果共享同一个对象
+ */
+class ResultSchema {
+   public:
+    static constexpr unsigned long npos = static_cast<unsigned long>(-1);
+
+    ResultSchema(const MYSQL_FIELD* fields, unsigned int count) {
+        std::vector<std::pair<std::size_t, std::size_t>> ranges;
+        ranges.reserve(count);
+        for (unsigned int i = 0; i < count; ++i) {
+            auto length = fields[i].name ? strlen(fields[i].name) : 0;
+            ranges.emplace_back(names_.size(), length);
+            names_.append(fields[i].name ? fields[i].name : "", length);
+        }
+        columns_.reserve(count);
+        entries_.reserve(count);
+        for (unsigned int i = 0; i < count; ++i) {
+            columns_.push_back(std::string_view(names_).substr(ranges[i].first, ranges[i].second));
+            entries_.push_back({columns_.back(), i});
+        }
+        std::stable_sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) { return less(a.name_, b.name_); });
+    }
+    ResultSchema(const ResultSchema&) = delete;
+    ResultSchema& operator=(const ResultSchema&) = delete;
+
+    std::size_t size() const noexcept { return entries_.size(); }
+
+    /**
+     * @brief 不区分大小写地查找列, 重名时取最后一列
+     *
+     * @param name
+     * @return unsigned long 找不到时为npos
+     */
+    unsigned long find(std::string_view name) const noexcept {
+        auto iter = std::upper_bound(entries_.begin(), entries_.end(), name, [](std::string_view n, const Entry& e) { return less(n, e.name_); });
+        if (iter == entries_.begin()) return npos;
+        --iter;
+        if (less(iter->name_, name)) return npos;
+        return iter->column_;
+    }
+
+    /**
+     * @brief 字段名字是否与本对象一致, 用于确认缓存的对象仍然适用(例如表结构变化后的 select *)
+     *
+     * @param fields
+     * @param count
+     * @return bool
+     */
+    bool matches(const MYSQL_FIELD* fields, unsigned int count) const noexcept {
+        if (count != columns_.size()) return false;
+        for (unsigned int i = 0; i < count; ++i) {
+            // compared per column, ("ab", "c") must not match ("a", "bc")
+            if (columns_[i] != std::string_view(fields[i].name ? fields[i].name : "")) return false;
+        }
+        return true;
+    }
+
+   private:
+    struct Entry {
+        std::string_view name_;
+        unsigned long column_;
+    };
+    std::string names_;                    //按列的顺序拼接的原始名字
+    std::vector<std::string_view> columns_;  //每一列的名字, 按列的顺序, 指向names_
+    std::vector<Entry> entries_;
+
+    static bool less(std::string_view a, std::string_view b) noexcept {
+        auto size = std::min(a.size(), b.size());
+        for (std::size_t i = 0; i < size; ++i) {
+            auto ca = tolower(static_cast<unsigned char>(a[i]));
+            auto cb = tolower(static_cast<unsigned char>(b[i]));
+            if (ca != cb) return ca < cb;
+        }
+        return a.size() < b.size();
+    }
+};
+using ResultSchemaPtr = std::shared_ptr<const ResultSchema>;
+
+/**
+ * @brief 每个连接上按sql文本缓存的ResultSchema, 只在连接所在的strand上访问
+ */
+class SchemaCache {
+   private:
+    // keyed by the hash of the sql text; a collision is harmless because matches() checks the names
+    std::unordered_map<std::size_t, ResultSchemaPtr> schemas_;
+    std::size_t capacity_;
+
+   public:
+    explicit SchemaCache(std::size_t capacity = 256) : capacity_(capacity) {}
+
+    ResultSchemaPtr get(std::string_view sql, const MYSQL_FIELD* fields, unsigned int count) {
+        if (!fields || count == 0) return nullptr;
+        auto& schema = schemas_[std::hash<std::string_view>()(sql)];
+        if (schema && schema->matches(fields, count)) {
+            return schema;
+        }
+        if (!schema && schemas_.size() > capacity_) {
+            schemas_.clear();
+            return schemas_[std::hash<std::string_view>()(sql)] = std::make_shared<const ResultSchema>(fields, count);
+        }
+        schema = std::make_shared<const ResultSchema>(fields, count);
+        return schema;
+    }
+    void clear() { schemas_.clear(); }
+};
+/**
+ * @brief 结果格子的存放顺序
+ * RowMajor: 同一行的格子相邻, 适合逐行读取; Columnar: 同一列的格子相邻, 适合扫描单列
+ */
+enum class ResultLayout { RowMajor,
+                          Columnar };
+/**
+ * @brief 结果中的一列, 不拷贝数据, 在结果存活期间有效
+ */
+class ColumnView {
+   private:
+    const char* const* values_;
+    const unsigned long* lengths_;
+    std::size_t size_;
+    std::size_t stride_;
+
+   public:
+    ColumnView(const char* const* values, const unsigned long* lengths, std::size_t size, std::size_t stride)
+        : values_(values), lengths_(lengths), size_(size), stride_(stride) {}
+    std::size_t size() const noexcept { return size_; }
+    const char* value(std::size_t row) const {
+        assert(row < size_);
+        return values_[row * stride_];
+    }
+    unsigned long length(std::size_t row) const {
+        assert(row < size_);
+        return lengths_[row * stride_];
+    }
+    bool isNull(std::size_t row) const { return value(row) == NULL; }
+
+    /**
+     * @brief Columnar 布局下该列在内存中是连续的, 可以直接以span线性扫描
+     *
+     * @return bool
+     */
+    bool isContiguous() const noexcept { return stride_ == 1 || size_ <= 1; }
+    std::span<const char* const> values() const {
+        assert(isContiguous());
+        return {values_, size_};
+    }
+    std::span<const unsigned long> lengths() const {
+        assert(isContiguous());
+        return {lengths_, size_};
+    }
+};
 class MysqlResult {
    public:
     using RowSizeType = unsigned long;
     using FieldSizeType = unsigned long;
     using SizeType = std::size_t;
-    using FieldNames = std::map<std::string, RowSizeType>;
-    MysqlResult(const std::shared_ptr<MYSQL_RES>& r, SizeType affected_rows, unsigned long long insert_id) : result_ptr_(r),
-                                                                                                             rows_number_(r ? mysql_num_rows(r.get()) : 0),
-                                                                                                             field_array_(r ? mysql_fetch_fields(r.get()) : nullptr),
-                                                                                                             fields_number_(r ? mysql_num_fields(r.get()) : 0),
-                                                                                                             affected_rows_(affected_rows),
-                                                                                                             insert_id_(insert_id) {
-        if (fields_number_ > 0) {
-            fields_map_ptr_ = std::make_shared<FieldNames>();
-            for (unsigned long i = 0; i < fields_number_; ++i) {
-                std::string field_name = field_array_[i].name;
-                std::transform(field_name.begin(), field_name.end(), field_name.begin(), [](unsigned char c) { return tolower(c); });
-                (*fields_map_ptr_)[field_name] = i;
-            }
-        }
-        if (rows_number_ > 0) {
-            rows_ptr_ = std::make_shared<std::vector<std::pair<char**, std::vector<unsigned long>>>>();
+    /**
+     * @brief mysql_store_result 的结果, 格子直接指向MYSQL_RES中的缓冲区, 不拷贝数据
+     *
+     * @param r
+     * @param affected_rows
+     * @param insert_id
+     * @param layout 格子的存放顺序
+     * @param schema 同一条sql共享的字段名字表, 为空时由本结果自己构建
+     */
+    MysqlResult(const std::shared_ptr<MYSQL_RES>& r, SizeType affected_rows, unsigned long long insert_id, ResultLayout layout = ResultLayout::RowMajor,
+                ResultSchemaPtr schema = nullptr)
+        : result_ptr_(r),
+          schema_ptr_(std::move(schema)),
+          rows_number_(r ? mysql_num_rows(r.get()) : 0),
+          field_array_(r ? mysql_fetch_fields(r.get()) : nullptr),
+          fields_number_(r ? mysql_num_fields(r.get()) : 0),
+          layout_(layout),
+          is_binary_(false),
+          affected_rows_(affected_rows),
+          insert_id_(insert_id) {
+        init_fields();
+        if (rows_number_ > 0 && fields_number_ > 0) {
+            cells_.resize(rows_number_ * fields_number_);
+            lengths_.resize(rows_number_ * fields_number_);
             MYSQL_ROW row;
-            std::vector<unsigned long> vLens;
-            vLens.resize(fields_number_);
-            while ((row = mysql_fetch_row(r.get())) != NULL) {
+            SizeType row_index = 0;
+            while ((row = mysql_fetch_row(r.get())) != NULL && row_index < rows_number_) {
                 auto lengths = mysql_fetch_lengths(r.get());
-                memcpy(vLens.data(),
-                       lengths,
-                       sizeof(unsigned long) * fields_number_);
-                rows_ptr_->push_back(std::make_pair(row, vLens));
+                if (layout_ == ResultLayout::RowMajor) {
+                    auto offset = row_index * fields_number_;
+                    std::copy(row, row + fields_number_, cells_.begin() + offset);
+                    std::copy(lengths, lengths + fields_number_, lengths_.begin() + offset);
+                } else {
+                    for (RowSizeType column = 0; column < fields_number_; ++column) {
+                        cells_[column * rows_number_ + row_index] = row[column];
+                        lengths_[column * rows_number_ + row_index] = lengths[column];
+                    }
+                }
+                ++row_index;
+            }
+        }
+    }
+    /**
+     * @brief 预处理语句的结果
+     *
+     * @param meta mysql_stmt_result_metadata 返回的字段信息
+     * @param rows 其中的格子会被移入本结果, data_ 由本结果继续持有
+     * @param rows_number
+     * @param affected_rows
+     * @param insert_id
+     * @param layout 格子的存放顺序
+     * @param schema 同一条sql共享的字段名字表, 为空时由本结果自己构建
+     */
+    MysqlResult(const std::shared_ptr<MYSQL_RES>& meta, const std::shared_ptr<RowBuffer>& rows, SizeType rows_number, SizeType affected_rows, unsigned long long insert_id,
+                ResultLayout layout = ResultLayout::RowMajor, ResultSchemaPtr schema = nullptr)
+        : result_ptr_(meta),
+          row_buffer_ptr_(rows),
+          schema_ptr_(std::move(schema)),
+          rows_number_(rows ? rows_number : 0),
+          field_array_(meta ? mysql_fetch_fields(meta.get()) : nullptr),
+          fields_number_(meta ? mysql_num_fields(meta.get()) : 0),
+          layout_(layout),
+          is_binary_(true),
+          affected_rows_(affected_rows),
+          insert_id_(insert_id) {
+        init_fields();
+        take_rows(rows);
+    }
+    /**
+     * @brief 流式查询的一批结果, 字段信息与行数据都是拷贝, 不依赖连接上的MYSQL_RES
+     *
+     * @param fields
+     * @param rows
+     * @param rows_number
+     * @param layout 格子的存放顺序
+     * @param schema 同一次查询的各批共享的字段名字表, 为空时由本结果自己构建
+     */
+    MysqlResult(const std::shared_ptr<const FieldArray>& fields, const std::shared_ptr<RowBuffer>& rows, SizeType rows_number, ResultLayout layout = ResultLayout::RowMajor,
+                ResultSchemaPtr schema = nullptr)
+        : row_buffer_ptr_(rows),
+          field_array_ptr_(fields),
+          schema_ptr_(std::move(schema)),
+          rows_number_(rows ? rows_number : 0),
+          field_array_(fields ? fields->data() : nullptr),
+          fields_number_(fields ? fields->size() : 0),
+          layout_(layout),
+          is_binary_(false),
+          affected_rows_(0),
+          insert_id_(0) {
+        init_fields();
+        take_rows(rows);
+    }
+    /**
+     * @brief 另一个结果中的部分行, 格子仍指向原结果的数据, 本结果与原结果共同持有这些数据
+     * 用于把合并后的查询结果按调用方拆开
+     *
+     * @param parent
+     * @param rows 原结果中的行号
+     */
+    MysqlResult(const MysqlResult& parent, const std::vector<SizeType>& rows)
+        : result_ptr_(parent.result_ptr_),
+          row_buffer_ptr_(parent.row_buffer_ptr_),
+          field_array_ptr_(parent.field_array_ptr_),
+          schema_ptr_(parent.schema_ptr_),
+          rows_number_(rows.size()),
+          field_array_(parent.field_array_),
+          fields_number_(parent.fields_number_),
+          layout_(parent.layout_),
+          is_binary_(parent.is_binary_),
+          affected_rows_(rows.size()),
+          insert_id_(0) {
+        cells_.resize(rows_number_ * fields_number_);
+        lengths_.resize(rows_number_ * fields_number_);
+        for (SizeType row_index = 0; row_index < rows_number_; ++row_index) {
+            for (RowSizeType column = 0; column < fields_number_; ++column) {
+                cells_[index(row_index, column)] = parent.cells_[parent.index(rows[row_index], column)];
+                lengths_[index(row_index, column)] = parent.lengths_[parent.index(rows[row_index], column)];
             }
         }
     }
@@ -92,17 +487,18 @@ class MysqlResult {
      * @param colName
      * @return RowSizeType
      */
-    RowSizeType columnNumber(const char colName[]) const {
-        if (!fields_map_ptr_) return -1;
-        std::string col(colName);
-        std::transform(col.begin(), col.end(), col.begin(), [](unsigned char c) {
-            return tolower(c);
-        });
-        if (fields_map_ptr_->find(col) != fields_map_ptr_->end())
-            return (*fields_map_ptr_)[col];
-        return -1;
+    RowSizeType columnNumber(std::string_view colName) const noexcept {
+        if (!schema_ptr_) return -1;
+        return schema_ptr_->find(colName);
     }
 
+    /**
+     * @brief 字段名字表, 同一条sql的结果共享同一个对象
+     *
+     * @return const ResultSchemaPtr&
+     */
+    const ResultSchemaPtr& schema() const noexcept { return schema_ptr_; }
+
     /**
      * @brief 根据row和col得到格子的值
      *
@@ -116,7 +512,7 @@ class MysqlResult {
             return NULL;
         assert(row < rows_number_);
         assert(column < fields_number_);
-        return (*rows_ptr_)[row].first[column];
+        return cells_[index(row, column)];
     }
 
     /**
@@ -132,26 +528,129 @@ class MysqlResult {
             return 0;
         assert(row < rows_number_);
         assert(column < fields_number_);
-        return (*rows_ptr_)[row].second[column];
+        return lengths_[index(row, column)];
     }
 
     bool isNull(SizeType row, RowSizeType column) const { return getValue(row, column) == NULL; }
+
+    /**
+     * @brief 取格子的值并转换成T, 支持算术类型, std::string, std::string_view 以及 std::optional<T>
+     * 文本格子用std::from_chars解析, 二进制协议的数值格子直接拷贝; NULL得到T{}或std::nullopt
+     *
+     * @tparam T
+     * @param row
+     * @param column
+     * @return T
+     */
+    template <typename T>
+    T get(SizeType row, RowSizeType column) const {
+        auto value = getValue(row, column);
+        if constexpr (detail::is_optional<T>::value) {
+            if (!value) return std::nullopt;
+            return get<typename T::value_type>(row, column);
+        } else {
+            if (!value) return T{};
+            auto kind = is_binary_ ? binary_cell_kind(field_array_[column].type) : BinaryCell::Text;
+            return detail::decode_cell<T>(value, getLength(row, column), kind, isUnsigned(column));
+        }
+    }
+
+    /**
+     * @brief 第column列的所有格子, Columnar 布局下是连续内存
+     *
+     * @param column
+     * @return ColumnView
+     */
+    ColumnView column(RowSizeType column) const {
+        assert(column < fields_number_);
+        if (rows_number_ == 0) return ColumnView(nullptr, nullptr, 0, 1);
+        auto first = index(0, column);
+        return ColumnView(cells_.data() + first, lengths_.data() + first, rows_number_,
+                          layout_ == ResultLayout::RowMajor ? fields_number_ : 1);
+    }
+    ResultLayout layout() const noexcept { return layout_; }
+
+    /**
+     * @brief 是否为预处理语句的二进制协议结果, 此时整数与浮点列的getValue指向原生的8字节数值
+     *
+     * @return bool
+     */
+    bool isBinary() const noexcept { return is_binary_; }
+
+    /**
+     * @brief 第number列的字段类型
+     *
+     * @param number
+     * @return enum_field_types
+     */
+    enum_field_types columnType(RowSizeType number) const {
+        assert(number < fields_number_);
+        return field_array_[number].type;
+    }
+    bool isUnsigned(RowSizeType number) const {
+        assert(number < fields_number_);
+        return field_array_[number].flags & UNSIGNED_FLAG;
+    }
     unsigned long long insertId() const noexcept { return insert_id_; }
 
+    /**
+     * @brief 结果占用内存的估计值: 格子数据的长度加上格子指针与长度数组, 不含字段信息
+     *
+     * @return SizeType
+     */
+    SizeType memoryUsage() const noexcept {
+        SizeType bytes = sizeof(MysqlResult) + cells_.size() * (sizeof(const char*) + sizeof(unsigned long));
+        for (auto length : lengths_) bytes += length;
+        return bytes;
+    }
+
    private:
     const std::shared_ptr<MYSQL_RES> result_ptr_;  //保存mql_res
+    const std::shared_ptr<RowBuffer> row_buffer_ptr_;         //预处理语句或流式查询拷贝出来的结果行
+    const std::shared_ptr<const FieldArray> field_array_ptr_;  //流式查询拷贝出来的字段信息
 
-    std::shared_ptr<FieldNames> fields_map_ptr_;  //字段名字和对应的列数的映射
-    std::shared_ptr<std::vector<std::pair<char**, std::vector<unsigned long>>>> rows_ptr_;
+    ResultSchemaPtr schema_ptr_;  //字段名字和对应的列数的映射
     const SizeType rows_number_;
 
     const MYSQL_FIELD* field_array_;  //保存字段
     const FieldSizeType fields_number_;
 
+    const ResultLayout layout_;
+    const bool is_binary_;
+    std::vector<const char*> cells_;  //所有格子的指针, 指向MYSQL_RES或row_buffer_ptr_中的数据
+    std::vector<unsigned long> lengths_;
+
     const SizeType affected_rows_;
     const unsigned long long insert_id_;
 
    private:
+    SizeType index(SizeType row, RowSizeType column) const noexcept {
+        return layout_ == ResultLayout::RowMajor ? row * fields_number_ + column : column * rows_number_ + row;
+    }
+    void take_rows(const std::shared_ptr<RowBuffer>& rows) {
+        if (rows_number_ == 0 || fields_number_ == 0) return;
+        assert(rows->cells_.size() == rows_number_ * fields_number_);
+        if (layout_ == ResultLayout::RowMajor) {
+            cells_ = std::move(rows->cells_);
+            lengths_ = std::move(rows->lengths_);
+            return;
+        }
+        cells_.resize(rows->cells_.size());
+        lengths_.resize(rows->lengths_.size());
+        for (SizeType row_index = 0; row_index < rows_number_; ++row_index) {
+            for (RowSizeType column = 0; column < fields_number_; ++column) {
+                cells_[column * rows_number_ + row_index] = rows->cells_[row_index * fields_number_ + column];
+                lengths_[column * rows_number_ + row_index] = rows->lengths_[row_index * fields_number_ + column];
+            }
+        }
+        rows->cells_.clear();
+        rows->lengths_.clear();
+    }
+    void init_fields() {
+        if (!schema_ptr_ && fields_number_ > 0) {
+            schema_ptr_ = std::make_shared<const ResultSchema>(field_array_, fields_number_);
+        }
+    }
     // enum Field::DataTypes convertNativeType(enum_field_types mysqlType) const;
 };
 using MysqlResultPtr = std::shared_ptr<MysqlResult>;
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mysql_connection.hpp"
+#include "mysql_result.hpp"
+#include "sql_text.hpp"
+namespace db {
+/**
+ * @brief 查询结果依赖的表名, 用于按表失效缓存
+ */
+using CacheTags = std::vector<std::string>;
+
+/**
+ * @brief 按sql文本缓存查询结果
+ * 分片加锁, 每个分片按最近最少使用淘汰, 总内存不超过max_bytes; 命中时直接共享同一个MysqlResultPtr, 不拷贝行
+ * 同一条sql同时未命中时只执行一次, 其余调用方等待这次的结果(single-flight)
+ * 按表失效只是把表的版本号加一, 缓存项记录了查询开始时各表的版本号, 取用时发现版本变化即视为失效;
+ * 因此与写入并发的查询不会把旧结果留在缓存中
+ */
+class ResultCache : public std::enable_shared_from_this<ResultCache> {
+   public:
+    using Loader = std::function<void(SqlText&& sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb)>;
+
+   private:
+    using Clock = std::chrono::steady_clock;
+    using TagVersion = std::shared_ptr<std::atomic<std::uint64_t>>;
+    struct Waiter {
+        ResultPtrCallback result_callback_;
+        ExceptPtrCallback except_callback_;
+    };
+    struct Entry {
+        std::string sql_;
+        MysqlResultPtr result_;
+        Clock::time_point expire_at_;
+        std::vector<std::pair<TagVersion, std::uint64_t>> tags_;  //查询开始时各表的版本号
+        std::size_t bytes_ = 0;
+        bool is_loading_ = false;
+        bool is_dropped_ = false;  //加载期间被clear, 完成后不缓存
+        std::vector<Waiter> waiters_;
+        std::list<std::size_t>::iterator lru_;  //只有已完成的项在lru_中
+    };
+    // keyed by the hash of the sql text; a colliding sql bypasses the cache
+    struct Shard {
+        std::mutex mutex_;
+        std::unordered_map<std::size_t, Entry> entries_;
+        std::list<std::size_t> lru_;  //头部是最近使用的
+        std::size_t bytes_ = 0;
+    };
+
+    Loader loader_;
+    std::size_t shard_bytes_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::shared_mutex tags_mutex_;
+    std::unordered_map<std::string, TagVersion> tags_;
+
+    std::atomic<std::size_t> hits_{0};
+    std::atomic<std::size_t> misses_{0};
+
+   public:
+    /**
+     * @brief
+     *
+     * @param loader 未命中时执行查询的方式
+     * @param max_bytes 所有分片合计的内存上限, 单个结果超过一个分片的上限时不缓存
+     * @param shard_num
+     */
+    ResultCache(Loader&& loader, std::size_t max_bytes, std::size_t shard_num) : loader_(std::move(loader)) {
+        shard_num = shard_num == 0 ? 1 : shard_num;
+        shard_bytes_ = max_bytes / shard_num;
+        for (std::size_t i = 0; i < shard_num; ++i) {
+            shards_.emplace_back(std::make_unique<Shard>());
+        }
+    }
+
+    /**
+     * @brief 命中时立即回调, 否则执行查询并在成功后缓存ttl时长
+     *
+     * @param sql
+     * @param ttl
+     * @param tables 结果依赖的表, invalidate其中任一表都会使结果失效
+     * @param result_callback
+     * @param except_callback
+     */
+    void query(SqlText sql, std::chrono::milliseconds ttl, const CacheTags& tables, ResultPtrCallback&& result_callback, ExceptPtrCallback&& except_callback) {
+        auto hash = std::hash<std::string_view>()(sql);
+        auto& shard = *shards_[hash % shards_.size()];
+        std::unique_lock<std::mutex> lock(shard.mutex_);
+        auto iter = shard.entries_.find(hash);
+        if (iter != shard.entries_.end() && iter->second.sql_ != sql.view()) {
+            lock.unlock();
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            loader_(std::move(sql), std::move(result_callback), std::move(except_callback));
+            return;
+        }
+        if (iter != shard.entries_.end()) {
+            auto& entry = iter->second;
+            if (entry.is_loading_) {
+                entry.waiters_.push_back({std::move(result_callback), std::move(except_callback)});
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (is_valid(entry)) {
+                shard.lru_.splice(shard.lru_.begin(), shard.lru_, entry.lru_);
+                auto result = entry.result_;
+                lock.unlock();
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                if (result_callback) result_callback(result);
+                return;
+            }
+            remove(shard, iter);
+        }
+        auto& entry = shard.entries_[hash];
+        entry.sql_.assign(sql.view());
+        entry.is_loading_ = true;
+        entry.waiters_.push_back({std::move(result_callback), std::move(except_callback)});
+        entry.tags_.reserve(tables.size());
+        for (auto& table : tables) {
+            auto version = tag_version(table);
+            entry.tags_.emplace_back(version, version->load(std::memory_order_acquire));
+        }
+        lock.unlock();
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        loader_(
+            std::move(sql),
+            [weak_this = weak_from_this(), hash, ttl](const MysqlResultPtr& result) {
+                if (auto this_ptr = weak_this.lock()) this_ptr->complete(hash, ttl, result, nullptr);
+            },
+            [weak_this = weak_from_this(), hash, ttl](std::exception_ptr except) {
+                if (auto this_ptr = weak_this.lock()) this_ptr->complete(hash, ttl, nullptr, except);
+            });
+    }
+    /**
+     * @brief 使依赖table的所有结果失效, 包括正在执行中的查询
+     *
+     * @param table
+     */
+    void invalidate(std::string_view table) { tag_version(table)->fetch_add(1, std::memory_order_acq_rel); }
+    void invalidate(const CacheTags& tables) {
+        for (auto& table : tables) invalidate(table);
+    }
+    void clear() {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex_);
+            for (auto iter = shard->entries_.begin(); iter != shard->entries_.end();) {
+                if (iter->second.is_loading_) {
+                    iter->second.is_dropped_ = true;
+                    ++iter;
+                } else {
+                    iter = shard->entries_.erase(iter);
+                }
+            }
+            shard->lru_.clear();
+            shard->bytes_ = 0;
+        }
+    }
+    std::size_t hits() const noexcept { return hits_.load(std::memory_order_relaxed); }
+    std::size_t misses() const noexcept { return misses_.load(std::memory_order_relaxed); }
+
+   private:
+    TagVersion tag_version(std::string_view table) {
+        {
+            std::shared_lock<std::shared_mutex> lock(tags_mutex_);
+            auto iter = tags_.find(std::string(table));
+            if (iter != tags_.end()) return iter->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(tags_mutex_);
+        auto& version = tags_[std::string(table)];
+        if (!version) version = std::make_shared<std::atomic<std::uint64_t>>(0);
+        return version;
+    }
+    static bool tags_current(const Entry& entry) {
+        for (auto& [version, value] : entry.tags_) {
+            if (version->load(std::memory_order_acquire) != value) return false;
+        }
+        return true;
+    }
+    static bool is_valid(const Entry& entry) { return Clock::now() < entry.expire_at_ && tags_current(entry); }
+    void remove(Shard& shard, std::unordered_map<std::size_t, Entry>::iterator iter) {
+        if (!iter->second.is_loading_) {
+            shard.lru_.erase(iter->second.lru_);
+            shard.bytes_ -= iter->second.bytes_;
+        }
+        shard.entries_.erase(iter);
+    }
+    void complete(std::size_t hash, std::chrono::milliseconds ttl, const MysqlResultPtr& result, std::exception_ptr except) {
+        auto& shard = *shards_[hash % shards_.size()];
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            auto iter = shard.entries_.find(hash);
+            if (iter == shard.entries_.end() || !iter->second.is_loading_) return;
+            auto& entry = iter->second;
+            waiters = std::move(entry.waiters_);
+            auto bytes = result ? result->memoryUsage() + entry.sql_.size() : 0;
+            if (!result || ttl.count() <= 0 || bytes > shard_bytes_ || entry.is_dropped_ || !tags_current(entry)) {
+                shard.entries_.erase(iter);
+            } else {
+                entry.is_loading_ = false;
+                entry.result_ = result;
+                entry.expire_at_ = Clock::now() + ttl;
+                entry.bytes_ = bytes;
+                shard.bytes_ += bytes;
+                shard.lru_.push_front(hash);
+                entry.lru_ = shard.lru_.begin();
+                evict(shard);
+            }
+        }
+        for (auto& waiter : waiters) {
+            if (result) {
+                if (waiter.result_callback_) waiter.result_callback_(result);
+            } else if (waiter.except_callback_) {
+                waiter.except_callback_(except);
+            }
+        }
+    }
+    void evict(Shard& shard) {
+        while (shard.bytes_ > shard_bytes_ && !shard.lru_.empty()) {
+            remove(shard, shard.entries_.find(shard.lru_.back()));
+        }
+    }
+};
+using ResultCachePtr = std::shared_ptr<ResultCache>;
+}  // namespace db
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "mysql_result.hpp"
+namespace db {
+/**
+ * @brief 结构体成员与结果列名字的对应关系
+ */
+template <typename Struct, typename Member>
+struct ColumnBinding {
+    const char* name_;
+    Member Struct::*member_;
+};
+template <typename Struct, typename Member>
+constexpr ColumnBinding<Struct, Member> column(const char* name, Member Struct::*member) {
+    return {name, member};
+}
+
+/**
+ * @brief 由用户特化, 描述结果列如何映射到结构体, 例如:
+ *
+ * struct User { std::string user; std::string host; };
+ * template <> struct db::RowMapping<User> {
+ *     static constexpr auto columns = std::make_tuple(db::column("user", &User::user), db::column("host", &User::host));
+ * };
+ *
+ * 成员类型可以是 MysqlResult::get 支持的任意类型
+ */
+template <typename Struct>
+struct RowMapping;
+
+/**
+ * @brief 把一个结果的行映射成结构体, 列名字在构造时解析一次, 之后按下标取值
+ */
+template <typename Struct>
+class RowMapper {
+   private:
+    static constexpr auto& columns_ = RowMapping<Struct>::columns;
+    static constexpr std::size_t count_ = std::tuple_size_v<std::decay_t<decltype(RowMapping<Struct>::columns)>>;
+
+    const MysqlResult& result_;
+    std::array<MysqlResult::RowSizeType, count_> indexes_;
+
+   public:
+    explicit RowMapper(const MysqlResult& result) : result_(result) {
+        std::size_t i = 0;
+        std::apply([this, &i](const auto&... binding) { ((indexes_[i++] = resolve(binding.name_)), ...); }, columns_);
+    }
+
+    Struct operator()(MysqlResult::SizeType row) const {
+        Struct value{};
+        std::apply([this, row, &value](const auto&... binding) {
+            std::size_t i = 0;
+            ((assign(value.*(binding.member_), row, indexes_[i++])), ...);
+        },
+                   columns_);
+        return value;
+    }
+
+   private:
+    MysqlResult::RowSizeType resolve(const char* name) const {
+        auto index = result_.columnNumber(name);
+        if (index >= result_.columns()) {
+            throw std::runtime_error(std::string("no column named ") + name);
+        }
+        return index;
+    }
+    template <typename Member>
+    void assign(Member& member, MysqlResult::SizeType row, MysqlResult::RowSizeType column) const {
+        member = result_.get<Member>(row, column);
+    }
+};
+
+/**
+ * @brief 把整个结果映射成结构体数组
+ *
+ * @tparam Struct 需要特化 RowMapping<Struct>
+ * @param result
+ * @return std::vector<Struct>
+ */
+template <typename Struct>
+std::vector<Struct> map_rows(const MysqlResult& result) {
+    RowMapper<Struct> mapper(result);
+    std::vector<Struct> rows;
+    rows.reserve(result.size());
+    for (MysqlResult::SizeType row = 0; row < result.size(); ++row) {
+        rows.push_back(mapper(row));
+    }
+    return rows;
+}
+}  // namespace db
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <mariadb/mysql.h>
+
+#include <algorithm>
+#include <list>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mysql_result.hpp"
+namespace db {
+/**
+ * @brief 预处理语句的一个参数, 按值保存, 可以安全地跨线程排队
+ */
+struct StmtParam {
+    enum_field_types type_ = MYSQL_TYPE_NULL;
+    my_bool is_unsigned_ = 0;
+    my_bool is_null_ = 1;
+    union {
+        long long int_value_;
+        double double_value_;
+    };
+    std::string str_value_;
+    unsigned long length_ = 0;
+
+    StmtParam() : int_value_(0) {}
+    StmtParam(std::nullptr_t) : StmtParam() {}
+    template <typename T, std::enable_if_t<std::is_integral_v<T>, int> = 0>
+    StmtParam(T value) : type_(MYSQL_TYPE_LONGLONG), is_unsigned_(std::is_unsigned_v<T>), is_null_(0), int_value_(static_cast<long long>(value)) {}
+    template <typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+    StmtParam(T value) : type_(MYSQL_TYPE_DOUBLE), is_null_(0), double_value_(static_cast<double>(value)) {}
+    StmtParam(std::string_view value) : type_(MYSQL_TYPE_STRING), is_null_(0), int_value_(0), str_value_(value), length_(value.size()) {}
+    StmtParam(const std::string& value) : StmtParam(std::string_view(value)) {}
+    StmtParam(const char* value) : StmtParam(value ? StmtParam(std::string_view(value)) : StmtParam()) {}
+
+    /**
+     * @brief 填充MYSQL_BIND, 指向本对象内部的存储, 本对象在执行结束前不能移动
+     *
+     * @param bind
+     */
+    void bind(MYSQL_BIND& bind) {
+        bind.buffer_type = type_;
+        bind.is_null = &is_null_;
+        bind.is_unsigned = is_unsigned_;
+        switch (type_) {
+            case MYSQL_TYPE_LONGLONG:
+                bind.buffer = &int_value_;
+                break;
+            case MYSQL_TYPE_DOUBLE:
+                bind.buffer = &double_value_;
+                break;
+            case MYSQL_TYPE_STRING:
+                length_ = str_value_.size();
+                bind.buffer = str_value_.data();
+                bind.buffer_length = length_;
+                bind.length = &length_;
+                break;
+            default:
+                bind.buffer = nullptr;
+                break;
+        }
+    }
+};
+using StmtParams = std::vector<StmtParam>;
+
+template <typename... Args>
+StmtParams make_params(Args&&... args) {
+    StmtParams params;
+    params.reserve(sizeof...(Args));
+    (params.emplace_back(std::forward<Args>(args)), ...);
+    return params;
+}
+
+/**
+ * @brief 按字段类型为结果列选择绑定方式
+ * 整数列取8字节long long, 浮点列取8字节double, 其余列(decimal, 字符串, 时间等)取文本
+ *
+ * @param field
+ * @param bind
+ * @param buffer 绑定使用的缓冲区
+ * @return bool 是否以原生数值取回
+ */
+inline bool bind_result_column(const MYSQL_FIELD& field, MYSQL_BIND& bind, std::string& buffer) {
+    bool is_number = true;
+    switch (binary_cell_kind(field.type)) {
+        case BinaryCell::Integer:
+            bind.buffer_type = MYSQL_TYPE_LONGLONG;
+            bind.is_unsigned = (field.flags & UNSIGNED_FLAG) != 0;
+            buffer.resize(sizeof(long long));
+            break;
+        case BinaryCell::Double:
+            bind.buffer_type = MYSQL_TYPE_DOUBLE;
+            buffer.resize(sizeof(double));
+            break;
+        default:
+            // max_length is filled by mysql_stmt_store_result with STMT_ATTR_UPDATE_MAX_LENGTH
+            is_number = false;
+            bind.buffer_type = MYSQL_TYPE_STRING;
+            buffer.resize(std::max<unsigned long>(field.max_length, 80) + 1);
+            break;
+    }
+    bind.buffer = buffer.data();
+    bind.buffer_length = buffer.size();
+    return is_number;
+}
+
+/**
+ * @brief 每个连接上按sql文本缓存的MYSQL_STMT, 最近最少使用的先被淘汰
+ * 只在连接所在的strand上访问
+ */
+class StatementCache {
+   private:
+    using Entry = std::pair<std::string, MYSQL_STMT*>;
+    std::list<Entry> entries_;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    std::size_t capacity_;
+
+   public:
+    explicit StatementCache(std::size_t capacity = 64) : capacity_(capacity == 0 ? 1 : capacity) {}
+    StatementCache(const StatementCache&) = delete;
+    StatementCache& operator=(const StatementCache&) = delete;
+
+    void set_capacity(std::size_t capacity) { capacity_ = capacity == 0 ? 1 : capacity; }
+
+    MYSQL_STMT* find(std::string_view sql) {
+        auto iter = index_.find(sql);
+        if (iter == index_.end()) return nullptr;
+        entries_.splice(entries_.begin(), entries_, iter->second);
+        return iter->second->second;
+    }
+
+    /**
+     * @brief 放入缓存, 超出容量时返回被淘汰的语句, 由调用方负责关闭
+     *
+     * @param sql
+     * @param stmt
+     * @return MYSQL_STMT*
+     */
+    MYSQL_STMT* insert(std::string_view sql, MYSQL_STMT* stmt) {
+        entries_.emplace_front(std::string(sql), stmt);
+        index_[entries_.front().first] = entries_.begin();
+        if (entries_.size() <= capacity_) return nullptr;
+        auto& last = entries_.back();
+        auto evicted = last.second;
+        index_.erase(last.first);
+        entries_.pop_back();
+        return evicted;
+    }
+
+    /**
+     * @brief 从缓存中移除但不关闭, 用于语句执行出错后重新prepare
+     *
+     * @param sql
+     * @return MYSQL_STMT*
+     */
+    MYSQL_STMT* erase(std::string_view sql) {
+        auto iter = index_.find(sql);
+        if (iter == index_.end()) return nullptr;
+        auto list_iter = iter->second;
+        auto stmt = list_iter->second;
+        index_.erase(iter);
+        entries_.erase(list_iter);
+        return stmt;
+    }
+
+    /**
+     * @brief 取出全部语句并清空缓存, 由调用方负责关闭
+     * 连接析构时先 mysql_close 使这些语句失效, 之后的 mysql_stmt_close 只释放内存, 不会阻塞在socket上
+     *
+     * @return std::vector<MYSQL_STMT*>
+     */
+    std::vector<MYSQL_STMT*> release() {
+        std::vector<MYSQL_STMT*> stmts;
+        stmts.reserve(entries_.size());
+        for (auto& entry : entries_) {
+            stmts.push_back(entry.second);
+        }
+        index_.clear();
+        entries_.clear();
+        return stmts;
+    }
+};
+}  // namespace db
@@ -1,48 +1,242 @@
-#include <list>
+#pragma once
 
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mysql_awaitable.hpp"
+#include "mysql_bulk_writer.hpp"
 #include "mysql_connection.hpp"
+#include "ring_deque.hpp"
 namespace db {
 class MysqlTransaction;
 using MysqlTransactionPtr = std::shared_ptr<MysqlTransaction>;
 class MysqlTransaction : public std::enable_shared_from_this<MysqlTransaction> {
    private:
     MysqlConnectionPtr conn_ptr_;
-    asio::io_context& io_context_;
+    MysqlConnection::Strand& strand_;
     std::function<void(bool)> commit_callback_;
     std::function<void()> usedup_callback_;
+    ExceptPtrCallback failure_callback_;
 
+    enum class SavepointOp : std::uint8_t { None,
+                                            Set,
+                                            RollbackTo,
+                                            Release };
+    // held by value in the ring, a statement that fits in SqlText's inline buffer costs no allocation besides its callbacks
     struct SqlCmd {
-        std::string_view sql_;
+        SqlText sql_;
         ResultPtrCallback result_callback_;
         ExceptPtrCallback ec_callback_;
+        StmtParams params_;
+        std::string infile_data_;
+        bool has_params_ = false;
+        bool has_infile_ = false;
+        bool is_begin_cmd_ = false;
         bool is_rollback_cmd_ = false;
-        std::shared_ptr<MysqlTransaction> this_ptr_;
+        bool is_commit_cmd_ = false;
+        bool with_commit_ = false;  //与COMMIT合并发送, 见 execute_and_commit
+        SavepointOp savepoint_op_ = SavepointOp::None;
+        std::string savepoint_;
     };
-    using SqlCmdPtr = std::shared_ptr<SqlCmd>;
-    std::list<SqlCmdPtr> sqlCmdBuffer_;
+    RingDeque<SqlCmd> sqlCmdBuffer_;
+    SqlCmd current_;                   //连接上正在执行的命令
+    std::size_t result_index_ = 0;     //current_已经返回的结果数
+    std::size_t statement_index_ = 0;  //current_中语句本身的结果序号, 之前是合并发送的BEGIN
+    // keeps the transaction alive while a command is on the connection, the callbacks given to the connection only capture this
+    MysqlTransactionPtr self_;
 
     bool is_commited_rollback = false;
     bool is_working_ = false;
+    bool merge_statements_ = false;  //连接开启了multi statement, BEGIN/COMMIT可以与语句合并发送
+    bool is_begin_pending_ = false;  //BEGIN推迟到第一条语句时发送
+    bool is_end_queued_ = false;     //COMMIT或ROLLBACK已经排队, 见 execute_and_commit, rollback
+    std::vector<std::string> savepoints_;  //已设置的保存点, 按设置顺序
 
    public:
+    /**
+     * @brief 由连接池创建
+     *
+     * @param conn_ptr
+     * @param commit_callback
+     * @param usedup_callback 事务结束, 连接可以归还时调用
+     * @param merge_statements 连接开启了multi statement时为true, BEGIN与第一条语句, 最后一条语句与COMMIT各自合并成一次往返
+     */
     MysqlTransaction(const MysqlConnectionPtr& conn_ptr, std::function<void(bool)>&& commit_callback,
-                     std::function<void()>&& usedup_callback)
-        : conn_ptr_(conn_ptr), io_context_(conn_ptr_->io_context()), commit_callback_(commit_callback), usedup_callback_(usedup_callback) {
+                     std::function<void()>&& usedup_callback, bool merge_statements = false)
+        : conn_ptr_(conn_ptr), strand_(conn_ptr_->strand()), commit_callback_(commit_callback), usedup_callback_(usedup_callback), merge_statements_(merge_statements) {
     }
     ~MysqlTransaction();
+    /**
+     * @brief 提交或回滚后回调, 参数为是否提交成功; 每个事务只回调一次
+     */
     void set_commit_callback(const std::function<void(bool)>& commitCallback) { commit_callback_ = commitCallback; }
+    /**
+     * @brief 语句失败时, 先于该语句的错误回调调用, 用于 MysqlConnectionPool::run_transaction 判断是否重试
+     */
+    void set_failure_callback(ExceptPtrCallback&& callback) { failure_callback_ = std::move(callback); }
+    MysqlConnection::Strand& strand() { return strand_; }
     bool is_connection_available() { return conn_ptr_->status() == ConnectStatus::Ok; }
-    void execute_sql(std::string_view&& sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb);
+    void execute_sql(SqlText sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb);
+    /**
+     * @brief 在事务中以预处理语句执行
+     *
+     * @param sql 以?作为参数占位符
+     * @param params
+     * @param rcb
+     * @param ecb
+     */
+    void execute_sql(SqlText sql, StmtParams&& params, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb);
+    /**
+     * @brief 执行事务的最后一条语句并提交, 之后的语句都以错误回调
+     * 可以合并时 "sql;commit" 作为一个multi statement发送, 省去单独提交的一次往返; sql只能是返回一个结果的单条语句
+     * 语句失败时事务回滚, 提交回调收到false
+     *
+     * @param sql
+     * @param rcb
+     * @param ecb
+     */
+    void execute_and_commit(SqlText sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb);
+    /**
+     * @brief 设置保存点, 同名的旧保存点被替换
+     * 有保存点时语句失败只回滚这条语句: 排在它后面的语句以错误回调, 由调用方在错误回调中 rollback_to 或 rollback;
+     * 死锁时服务端已经回滚了整个事务, 以及排队了 execute_and_commit 时, 仍然回滚整个事务
+     *
+     * @param name
+     * @param rcb
+     * @param ecb
+     */
+    void savepoint(std::string_view name, ResultPtrCallback&& rcb = nullptr, ExceptPtrCallback&& ecb = nullptr) {
+        add_savepoint_cmd("SAVEPOINT ", name, SavepointOp::Set, std::move(rcb), std::move(ecb));
+    }
+    /**
+     * @brief 回滚到保存点, 保存点本身保留, 在它之后设置的保存点被删除
+     */
+    void rollback_to(std::string_view name, ResultPtrCallback&& rcb = nullptr, ExceptPtrCallback&& ecb = nullptr) {
+        add_savepoint_cmd("ROLLBACK TO SAVEPOINT ", name, SavepointOp::RollbackTo, std::move(rcb), std::move(ecb));
+    }
+    /**
+     * @brief 删除保存点以及在它之后设置的保存点, 不回滚数据
+     */
+    void release_savepoint(std::string_view name, ResultPtrCallback&& rcb = nullptr, ExceptPtrCallback&& ecb = nullptr) {
+        add_savepoint_cmd("RELEASE SAVEPOINT ", name, SavepointOp::Release, std::move(rcb), std::move(ecb));
+    }
+    /**
+     * @brief 在已排队的语句之后回滚整个事务, 之后的语句都以错误回调, 提交回调收到false
+     */
+    void rollback(ResultPtrCallback&& rcb = nullptr, ExceptPtrCallback&& ecb = nullptr) {
+        SqlCmd cmd{"rollback", std::move(rcb), std::move(ecb)};
+        cmd.is_rollback_cmd_ = true;
+        add_sql_cmd(std::move(cmd));
+    }
+    /**
+     * @brief 在事务中执行 LOAD DATA LOCAL INFILE, 文件内容来自data
+     *
+     * @param sql
+     * @param data
+     * @param rcb
+     * @param ecb
+     */
+    void execute_load_data(SqlText sql, std::string&& data, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+        SqlCmd cmd{std::move(sql), std::move(rcb), std::move(ecb)};
+        cmd.infile_data_ = std::move(data);
+        cmd.has_infile_ = true;
+        add_sql_cmd(std::move(cmd));
+    }
+    /**
+     * @brief 在事务中批量写入, 见 BulkWriter
+     * 写入器只持有事务的弱引用, 需要在释放事务之前flush, 事务已释放时的批次以错误回调
+     *
+     * @param table
+     * @param columns
+     * @param options
+     * @param batch_callback
+     * @return BulkWriterPtr
+     */
+    BulkWriterPtr new_bulk_writer(std::string_view table, const std::vector<std::string>& columns, const BulkOptions& options = {},
+                                  BulkBatchCallback&& batch_callback = nullptr) {
+        auto executor = [weak_this = weak_from_this()](SqlText&& sql, std::unique_ptr<std::string>&& data, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+            auto this_ptr = weak_this.lock();
+            if (!this_ptr) {
+                ecb(std::make_exception_ptr(std::runtime_error("transaction has been released")));
+                return;
+            }
+            SqlCmd cmd{std::move(sql), std::move(rcb), std::move(ecb)};
+            if (data) {
+                cmd.infile_data_ = std::move(*data);
+                cmd.has_infile_ = true;
+            }
+            this_ptr->add_sql_cmd(std::move(cmd));
+        };
+        return std::make_shared<BulkWriter>(std::move(executor), strand_.get_inner_executor().context(), table, columns, options, std::move(batch_callback));
+    }
+    /**
+     * @brief 在事务中异步执行, 完成令牌的用法同 MysqlClient::async_query
+     *
+     * @param sql
+     * @param token 完成签名为 void(std::exception_ptr, MysqlResultPtr)
+     */
+    template <typename CompletionToken>
+    auto async_execute_sql(std::string_view sql, CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, QuerySignature>(
+            [this_ptr = shared_from_this()](auto handler, SqlText sql) {
+                auto op = detail::make_query_operation(std::move(handler));
+                auto [result_callback, ec_callback] = op->make_callbacks(op);
+                this_ptr->add_sql_cmd(SqlCmd{std::move(sql), std::move(result_callback), std::move(ec_callback)});
+            },
+            token, SqlText(sql));
+    }
+    template <typename CompletionToken>
+    auto async_execute_sql(std::string_view sql, StmtParams&& params, CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, QuerySignature>(
+            [this_ptr = shared_from_this()](auto handler, SqlText sql, StmtParams params) {
+                auto op = detail::make_query_operation(std::move(handler));
+                auto [result_callback, ec_callback] = op->make_callbacks(op);
+                SqlCmd cmd{std::move(sql), std::move(result_callback), std::move(ec_callback), std::move(params)};
+                cmd.has_params_ = true;
+                this_ptr->add_sql_cmd(std::move(cmd));
+            },
+            token, SqlText(sql), std::move(params));
+    }
     void do_begin();
 
    private:
+    void add_sql_cmd(SqlCmd&& cmd);
+    void queue_cmd(SqlCmd&& cmd);
+    void add_savepoint_cmd(std::string_view statement, std::string_view name, SavepointOp op, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb);
+    void apply_savepoint_op();
+    void fail_queued(std::size_t count, const std::exception_ptr& ec_ptr);
+    void run_current();
+    void on_result(const MysqlResultPtr& result_ptr);
+    void on_error(const std::exception_ptr& ec_ptr);
     void execute_new_task();
     void roll_back();
+    void fail_buffered();
+    void finish_commit(bool is_committed) {
+        is_commited_rollback = true;
+        if (commit_callback_) {
+            auto callback = std::move(commit_callback_);
+            commit_callback_ = nullptr;
+            callback(is_committed);
+        }
+    }
+    static std::exception_ptr finished_error() {
+        return std::make_exception_ptr(MysqlException(ErrorCode::Cancelled, "transaction has been committed or rolled back"));
+    }
 };
-MysqlTransaction::~MysqlTransaction() {
+inline MysqlTransaction::~MysqlTransaction() {
     assert(sqlCmdBuffer_.empty());
-    if (!is_commited_rollback) {
-        asio::post(io_context_, [conn = conn_ptr_,
+    if (is_begin_pending_ && !is_commited_rollback) {
+        // nothing has been sent, there is nothing to commit
+        if (commit_callback_) {
+            commit_callback_(true);
+        }
+        if (usedup_callback_) {
+            usedup_callback_();
+        }
+    } else if (!is_commited_rollback) {
+        asio::post(strand_, [conn = conn_ptr_,
                                  ucb = std::move(usedup_callback_),
                                  commitCb = std::move(commit_callback_)]() {
             conn->set_complete_callback([ucb = std::move(ucb)]() {
@@ -58,11 +252,7 @@ MysqlTransaction::~MysqlTransaction() {
                 },
                 [commitCb](const std::exception_ptr& ePtr) {
                     if (commitCb) {
-                        try {
-                            std::rethrow_exception(ePtr);
-                        } catch (const std::exception& e) {
-                            commitCb(false);
-                        }
+                        commitCb(false);
                     }
                 });
         });
@@ -73,7 +263,7 @@ MysqlTransaction::~MysqlTransaction() {
     }
 }
 inline void MysqlTransaction::do_begin() {
-    asio::post(io_context_,
+    asio::post(strand_,
                [this_ptr = shared_from_this()]() {
                    std::weak_ptr<MysqlTransaction> weak_this(this_ptr);
                    this_ptr->conn_ptr_->set_complete_callback([weak_this]() {
@@ -82,87 +272,208 @@ inline void MysqlTransaction::do_begin() {
                            return;
                        this_ptr->execute_new_task();
                    });
-                   this_ptr->is_working_ = true;
-                   this_ptr->conn_ptr_->execute_sql(
-                       "begin", [](const MysqlResultPtr& ptr) {}, [this_ptr](const std::exception_ptr& e) { this_ptr->is_commited_rollback = true; });
+                   if (this_ptr->merge_statements_) {
+                       // sent together with the first statement, see run_current
+                       this_ptr->is_begin_pending_ = true;
+                       return;
+                   }
+                   this_ptr->current_.sql_ = "begin";
+                   this_ptr->current_.is_begin_cmd_ = true;
+                   this_ptr->run_current();
                });
 }
 inline void MysqlTransaction::roll_back() {
-    auto thisPtr = shared_from_this();
-
-    asio::post(io_context_, [thisPtr]() {
-        if (thisPtr->is_commited_rollback)
-            return;
-        if (thisPtr->is_working_) {
-            // push sql cmd to buffer;
-            auto cmdPtr = std::make_shared<SqlCmd>();
-            cmdPtr->sql_ = "rollback";
-            cmdPtr->result_callback_ = [thisPtr](const MysqlResultPtr&) {
-                thisPtr->is_commited_rollback = true;
-            };
-            cmdPtr->ec_callback_ = [thisPtr](const std::exception_ptr&) {
-                // clearupCb();
-                thisPtr->is_commited_rollback = true;
-            };
-            cmdPtr->is_rollback_cmd_ = true;
-            // Rollback cmd should be executed firstly, so we push it in front
-            // of the list
-            thisPtr->sqlCmdBuffer_.push_front(std::move(cmdPtr));
+    // called from a failed statement's callback on the strand, the rollback must be
+    // queued before the connection completes and picks the next statement
+    if (is_commited_rollback)
+        return;
+    SqlCmd cmd;
+    cmd.sql_ = "rollback";
+    cmd.is_rollback_cmd_ = true;
+    if (is_working_) {
+        // Rollback cmd should be executed firstly, so we push it in front
+        // of the queue
+        sqlCmdBuffer_.push_front(std::move(cmd));
+        return;
+    }
+    current_ = std::move(cmd);
+    run_current();
+}
+/**
+ * @brief 在连接上执行current_, 需要时把推迟的BEGIN和COMMIT拼进同一个multi statement
+ * 合并后按顺序返回 BEGIN, 语句, COMMIT 各自的结果, 只有语句的结果交给调用方
+ */
+inline void MysqlTransaction::run_current() {
+    is_working_ = true;
+    if (!self_) self_ = shared_from_this();
+    bool with_begin = is_begin_pending_;
+    is_begin_pending_ = false;
+    if (with_begin && (current_.has_params_ || current_.has_infile_)) {
+        // prepared statements and LOAD DATA can not share a packet, BEGIN goes first on its own
+        sqlCmdBuffer_.push_front(std::move(current_));
+        current_ = SqlCmd();
+        current_.sql_ = "begin";
+        current_.is_begin_cmd_ = true;
+        with_begin = false;
+    }
+    if (with_begin || current_.with_commit_) {
+        SqlText sql(with_begin ? "begin;" : "");
+        sql.append(current_.sql_);
+        if (current_.with_commit_) sql.append(";commit");
+        current_.sql_ = std::move(sql);
+    }
+    result_index_ = 0;
+    statement_index_ = with_begin ? 1 : 0;
+    // the callbacks only capture this, small enough for std::function to store without allocating
+    auto rcb = [this](const MysqlResultPtr& result_ptr) { on_result(result_ptr); };
+    auto ecb = [this](const std::exception_ptr& ec_ptr) { on_error(ec_ptr); };
+    if (current_.has_params_) {
+        conn_ptr_->execute_prepared(std::move(current_.sql_), std::move(current_.params_), rcb, ecb);
+    } else if (current_.has_infile_) {
+        conn_ptr_->execute_load_data(std::move(current_.sql_), std::move(current_.infile_data_), rcb, ecb);
+    } else {
+        conn_ptr_->execute_sql(std::move(current_.sql_), rcb, ecb);
+    }
+}
+inline void MysqlTransaction::on_result(const MysqlResultPtr& result_ptr) {
+    auto index = result_index_++;
+    if (index < statement_index_ || current_.is_begin_cmd_)
+        return;
+    if (index > statement_index_) {
+        if (current_.with_commit_) {
+            finish_commit(true);
             return;
         }
-        thisPtr->is_working_ = true;
-        thisPtr->conn_ptr_->execute_sql(
-            "rollback",
-            [thisPtr](const MysqlResultPtr&) {
-                thisPtr->is_commited_rollback = true;
-                // clearupCb();
-            },
-            [thisPtr](const std::exception_ptr&) {
-                thisPtr->is_commited_rollback = true;
-            });
-    });
+        // further result sets of the statement itself, e.g. from CALL
+    } else if (current_.is_rollback_cmd_) {
+        finish_commit(false);
+    } else if (current_.is_commit_cmd_) {
+        finish_commit(true);
+    } else if (current_.savepoint_op_ != SavepointOp::None) {
+        apply_savepoint_op();
+    }
+    if (current_.result_callback_) {
+        current_.result_callback_(result_ptr);
+    }
+}
+inline void MysqlTransaction::on_error(const std::exception_ptr& ec_ptr) {
+    if (failure_callback_) {
+        failure_callback_(ec_ptr);
+    }
+    bool is_broken = false;
+    bool is_deadlock = false;
+    try {
+        std::rethrow_exception(ec_ptr);
+    } catch (const MysqlException& e) {
+        is_broken = e.code() == ErrorCode::Connection;
+        is_deadlock = e.is_deadlock();
+    } catch (...) {
+    }
+    bool is_statement_failed = true;
+    std::size_t dependent_count = 0;
+    if (current_.with_commit_ && result_index_ > statement_index_) {
+        // the statement succeeded, COMMIT failed and the server rolled back
+        finish_commit(false);
+        is_statement_failed = false;
+    } else if (current_.is_begin_cmd_ || current_.is_rollback_cmd_ || current_.is_commit_cmd_) {
+        finish_commit(false);
+    } else if (!savepoints_.empty() && !is_deadlock && !is_broken && !is_end_queued_) {
+        // only this statement has been undone, the ones queued behind it were issued expecting it to succeed
+        dependent_count = sqlCmdBuffer_.size();
+    } else {
+        // a deadlock has already rolled back the whole transaction on the server, savepoints included
+        savepoints_.clear();
+        roll_back();
+        if (current_.with_commit_) finish_commit(false);
+    }
+    if (is_statement_failed && current_.ec_callback_) {
+        current_.ec_callback_(ec_ptr);
+    }
+    if (dependent_count) {
+        // commands added by the error callback, e.g. rollback_to, stay queued
+        fail_queued(dependent_count, std::make_exception_ptr(MysqlException(ErrorCode::Cancelled, "an earlier statement of the transaction failed")));
+    }
+    if (!is_broken)
+        return;
+    // the connection never completes, the server has rolled back and nothing else can run
+    is_working_ = false;
+    fail_buffered();
+    finish_commit(false);
+    current_ = SqlCmd();
+    asio::post(strand_, [self = std::move(self_)]() {});
+}
+inline void MysqlTransaction::fail_queued(std::size_t count, const std::exception_ptr& ec_ptr) {
+    SqlCmd cmd;
+    while (count-- && sqlCmdBuffer_.pop_front(cmd)) {
+        if (cmd.ec_callback_) {
+            cmd.ec_callback_(ec_ptr);
+        }
+    }
+}
+inline void MysqlTransaction::add_savepoint_cmd(std::string_view statement, std::string_view name, SavepointOp op, ResultPtrCallback&& rcb,
+                                                ExceptPtrCallback&& ecb) {
+    SqlCmd cmd{SqlText(statement), std::move(rcb), std::move(ecb)};
+    cmd.sql_.push_back('`');
+    for (auto c : name) {
+        // a backquote inside a quoted identifier is doubled
+        if (c == '`') cmd.sql_.push_back('`');
+        cmd.sql_.push_back(c);
+    }
+    cmd.sql_.push_back('`');
+    cmd.savepoint_op_ = op;
+    cmd.savepoint_.assign(name);
+    add_sql_cmd(std::move(cmd));
+}
+/**
+ * @brief 保存点语句成功后更新savepoints_, 与服务端的规则一致
+ */
+inline void MysqlTransaction::apply_savepoint_op() {
+    auto iter = std::find(savepoints_.begin(), savepoints_.end(), current_.savepoint_);
+    switch (current_.savepoint_op_) {
+        case SavepointOp::Set:
+            if (iter != savepoints_.end()) savepoints_.erase(iter);
+            savepoints_.push_back(std::move(current_.savepoint_));
+            break;
+        case SavepointOp::RollbackTo:
+            if (iter != savepoints_.end()) savepoints_.erase(iter + 1, savepoints_.end());
+            break;
+        case SavepointOp::Release:
+            savepoints_.erase(iter, savepoints_.end());
+            break;
+        case SavepointOp::None:
+            break;
+    }
+}
+inline void MysqlTransaction::fail_buffered() {
+    if (sqlCmdBuffer_.empty())
+        return;
+    auto ec_ptr = finished_error();
+    SqlCmd cmd;
+    while (sqlCmdBuffer_.pop_front(cmd)) {
+        if (cmd.is_commit_cmd_) {
+            finish_commit(false);
+        }
+        if (cmd.ec_callback_) {
+            cmd.ec_callback_(ec_ptr);
+        }
+    }
 }
 inline void MysqlTransaction::execute_new_task() {
     assert(is_working_);
+    // released on return, the transaction is destroyed here when the user no longer holds it
+    auto self = std::move(self_);
+    current_ = SqlCmd();
     if (!is_commited_rollback) {
-        auto this_ptr = shared_from_this();
-        if (!sqlCmdBuffer_.empty()) {
-            auto cmd = std::move(sqlCmdBuffer_.front());
-            sqlCmdBuffer_.pop_front();
-            conn_ptr_->execute_sql(
-                std::move(cmd->sql_),
-                [rcb = std::move(cmd->result_callback_), cmd, this_ptr](
-                    const MysqlResultPtr& result_ptr) {
-                    if (cmd->is_rollback_cmd_) {
-                        this_ptr->is_commited_rollback = true;
-                    }
-                    if (rcb) {
-                        rcb(result_ptr);
-                    }
-                },
-                [cmd, this_ptr](const std::exception_ptr& ec_ptr) {
-                    if (!cmd->is_rollback_cmd_) {
-                        this_ptr->roll_back();
-                    } else {
-                        this_ptr->is_commited_rollback = true;
-                    }
-                    if (cmd->ec_callback_) {
-                        cmd->ec_callback_(ec_ptr);
-                    }
-                });
+        if (sqlCmdBuffer_.pop_front(current_)) {
+            self_ = std::move(self);
+            run_current();
         } else {
             is_working_ = false;
         }
     } else {
         is_working_ = false;
         if (!sqlCmdBuffer_.empty()) {
-            auto ec_ptr = std::make_exception_ptr(std::exception(std::runtime_error("transaction been rollback")));
-            for (auto& cmd : sqlCmdBuffer_) {
-                if (cmd->ec_callback_) {
-                    cmd->ec_callback_(ec_ptr);
-                }
-            }
-            sqlCmdBuffer_.clear();
+            fail_buffered();
         } else {
             if (usedup_callback_) {
                 usedup_callback_();
@@ -171,34 +482,55 @@ inline void MysqlTransaction::execute_new_task() {
         }
     }
 }
-inline void MysqlTransaction::execute_sql(std::string_view&& sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
-    auto thisPtr = shared_from_this();
-    if (!is_commited_rollback) {
-        auto thisPtr = shared_from_this();
-        if (!is_working_) {
-            is_working_ = true;
-            conn_ptr_->execute_sql(std::move(sql),
-                                   std::move(rcb),
-                                   [ecb,
-                                    thisPtr](const std::exception_ptr& ePtr) {
-                                       thisPtr->roll_back();
-                                       if (ecb)
-                                           ecb(ePtr);
-                                   });
-        } else {
-            // push sql cmd to buffer;
-            auto cmdPtr = std::make_shared<SqlCmd>();
-            cmdPtr->sql_ = std::move(sql);
-            cmdPtr->result_callback_ = std::move(rcb);
-            cmdPtr->ec_callback_ = std::move(ecb);
-            cmdPtr->this_ptr_ = thisPtr;
-            thisPtr->sqlCmdBuffer_.push_back(std::move(cmdPtr));
-        }
-    } else {
-        // The transaction has been rolled back;
-        auto ec_ptr = std::make_exception_ptr(std::exception(std::runtime_error("transaction been rollback")));
-        ecb(ec_ptr);
+inline void MysqlTransaction::execute_sql(SqlText sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+    add_sql_cmd(SqlCmd{std::move(sql), std::move(rcb), std::move(ecb)});
+}
+inline void MysqlTransaction::execute_sql(SqlText sql, StmtParams&& params, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+    SqlCmd cmd{std::move(sql), std::move(rcb), std::move(ecb), std::move(params)};
+    cmd.has_params_ = true;
+    add_sql_cmd(std::move(cmd));
+}
+inline void MysqlTransaction::execute_and_commit(SqlText sql, ResultPtrCallback&& rcb, ExceptPtrCallback&& ecb) {
+    SqlCmd cmd{std::move(sql), std::move(rcb), std::move(ecb)};
+    if (merge_statements_) {
+        cmd.with_commit_ = true;
+        add_sql_cmd(std::move(cmd));
+        return;
+    }
+    SqlCmd commit_cmd;
+    commit_cmd.sql_ = "commit";
+    commit_cmd.is_commit_cmd_ = true;
+    // both in one handler, the statement must already see is_end_queued_ when it fails
+    asio::dispatch(strand_, [this_ptr = shared_from_this(), cmd = std::move(cmd), commit_cmd = std::move(commit_cmd)]() mutable {
+        this_ptr->is_end_queued_ = true;
+        this_ptr->queue_cmd(std::move(cmd));
+        this_ptr->queue_cmd(std::move(commit_cmd));
+    });
+}
+/**
+ * @brief 可以在任意线程调用, 命令转到连接的strand上排队, 事务的状态只在strand上修改
+ */
+inline void MysqlTransaction::add_sql_cmd(SqlCmd&& cmd) {
+    asio::dispatch(strand_, [this_ptr = shared_from_this(), cmd = std::move(cmd)]() mutable {
+        this_ptr->queue_cmd(std::move(cmd));
+    });
+}
+inline void MysqlTransaction::queue_cmd(SqlCmd&& cmd) {
+    if (cmd.is_rollback_cmd_ || cmd.with_commit_) {
+        is_end_queued_ = true;
+    }
+    if (is_commited_rollback) {
+        // The transaction has been committed or rolled back;
+        if (cmd.is_commit_cmd_) finish_commit(false);
+        if (cmd.ec_callback_) cmd.ec_callback_(finished_error());
+        return;
+    }
+    if (is_working_) {
+        sqlCmdBuffer_.push_back(std::move(cmd));
+        return;
     }
+    current_ = std::move(cmd);
+    run_current();
 }
 
-}  // namespace db
\ No newline at end of file
+}  // namespace db
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace db {
+/**
+ * @brief 单线程的环形双端队列, 容量为2的幂, 满时加倍
+ * 元素按值存放在槽位中, 出队后槽位留给后续元素复用, 稳定后入队出队都不再申请内存
+ * 第一次入队时才分配存储
+ *
+ * @tparam T 可默认构造, 可移动
+ */
+template <typename T>
+class RingDeque {
+   private:
+    std::unique_ptr<T[]> slots_;
+    std::size_t mask_ = 0;
+    std::size_t head_ = 0;
+    std::size_t size_ = 0;
+
+   public:
+    static constexpr std::size_t initial_capacity = 8;
+
+    RingDeque() = default;
+    RingDeque(const RingDeque&) = delete;
+    RingDeque& operator=(const RingDeque&) = delete;
+
+    bool empty() const noexcept { return size_ == 0; }
+    std::size_t size() const noexcept { return size_; }
+    std::size_t capacity() const noexcept { return slots_ ? mask_ + 1 : 0; }
+
+    void push_back(T&& value) {
+        reserve(size_ + 1);
+        slots_[(head_ + size_) & mask_] = std::move(value);
+        ++size_;
+    }
+    void push_front(T&& value) {
+        reserve(size_ + 1);
+        head_ = (head_ - 1) & mask_;
+        slots_[head_] = std::move(value);
+        ++size_;
+    }
+    T& front() noexcept { return slots_[head_]; }
+    /**
+     * @brief 移出队头, 队列为空时返回false
+     * 槽位重置为T(), 使其中的回调等资源立即释放
+     *
+     * @param value
+     * @return bool
+     */
+    bool pop_front(T& value) {
+        if (size_ == 0) return false;
+        value = std::move(slots_[head_]);
+        slots_[head_] = T();
+        head_ = (head_ + 1) & mask_;
+        --size_;
+        return true;
+    }
+    /**
+     * @brief 清空元素, 保留存储
+     */
+    void clear() {
+        T value;
+        while (pop_front(value)) {
+        }
+    }
+    void reserve(std::size_t size) {
+        if (size <= capacity()) return;
+        auto capacity = slots_ ? (mask_ + 1) * 2 : initial_capacity;
+        while (capacity < size) {
+            capacity <<= 1;
+        }
+        auto slots = std::make_unique<T[]>(capacity);
+        for (std::size_t i = 0; i < size_; ++i) {
+            slots[i] = std::move(slots_[(head_ + i) & mask_]);
+        }
+        slots_ = std::move(slots);
+        mask_ = capacity - 1;
+        head_ = 0;
+    }
+};
+}  // namespace db
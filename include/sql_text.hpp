@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace db {
+/**
+ * @brief 持有sql文本的小缓冲区字符串
+ * 不超过inline_capacity的sql直接存放在对象内部, 排队的命令与命令对象一起分配, 不再单独申请堆内存;
+ * 更长的sql才使用堆; 移动时长sql只转移指针
+ * 末尾总是保留一个'\0'
+ */
+class SqlText {
+   public:
+    static constexpr std::size_t inline_capacity = 256;
+
+    SqlText() noexcept { inline_[0] = '\0'; }
+    SqlText(std::string_view text) : SqlText() { assign(text); }
+    SqlText(const std::string& text) : SqlText(std::string_view(text)) {}
+    SqlText(const char* text) : SqlText(text ? std::string_view(text) : std::string_view()) {}
+    SqlText(const SqlText& other) : SqlText(other.view()) {}
+    SqlText(SqlText&& other) noexcept : SqlText() { take(std::move(other)); }
+    SqlText& operator=(const SqlText& other) {
+        if (this != &other) assign(other.view());
+        return *this;
+    }
+    SqlText& operator=(SqlText&& other) noexcept {
+        if (this != &other) {
+            heap_.reset();
+            take(std::move(other));
+        }
+        return *this;
+    }
+
+    const char* data() const noexcept { return heap_ ? heap_.get() : inline_; }
+    const char* c_str() const noexcept { return data(); }
+    std::size_t size() const noexcept { return size_; }
+    std::size_t length() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    std::string_view view() const noexcept { return {data(), size_}; }
+    operator std::string_view() const noexcept { return view(); }
+    bool is_inline() const noexcept { return !heap_; }
+
+    void clear() noexcept {
+        size_ = 0;
+        buffer()[0] = '\0';
+    }
+    void assign(std::string_view text) {
+        size_ = 0;
+        append(text);
+    }
+    void append(std::string_view text) {
+        reserve(size_ + text.size());
+        memcpy(buffer() + size_, text.data(), text.size());
+        size_ += text.size();
+        buffer()[size_] = '\0';
+    }
+    void push_back(char c) { append(std::string_view(&c, 1)); }
+    void reserve(std::size_t size) {
+        if (size < capacity_) return;
+        auto capacity = std::max(size + 1, capacity_ * 2);
+        auto heap = std::make_unique<char[]>(capacity);
+        memcpy(heap.get(), data(), size_ + 1);
+        heap_ = std::move(heap);
+        capacity_ = capacity;
+    }
+
+    // string_view interface used to classify statements
+    std::size_t find(char c, std::size_t pos = 0) const noexcept { return view().find(c, pos); }
+    std::size_t find_first_not_of(std::string_view chars, std::size_t pos = 0) const noexcept { return view().find_first_not_of(chars, pos); }
+
+   private:
+    std::unique_ptr<char[]> heap_;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = inline_capacity;  //包括结尾的'\0'
+    char inline_[inline_capacity];
+
+    char* buffer() noexcept { return heap_ ? heap_.get() : inline_; }
+    void take(SqlText&& other) noexcept {
+        size_ = other.size_;
+        if (other.heap_) {
+            heap_ = std::move(other.heap_);
+            capacity_ = other.capacity_;
+        } else {
+            capacity_ = inline_capacity;
+            memcpy(inline_, other.inline_, size_ + 1);
+        }
+        other.size_ = 0;
+        other.capacity_ = inline_capacity;
+        other.inline_[0] = '\0';
+    }
+};
+}  // namespace db
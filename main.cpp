@@ -1,7 +1,49 @@
+#include <cstring>
+
+#include "example/bench.hpp"
 #include "example/test.hpp"
 using namespace std;
 
 int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench::dispatch_contention();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "alloc") == 0) {
+        bench::transaction_queue_allocations();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "large_insert") == 0) {
+        test::large_insert_test();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bulk") == 0) {
+        test::bulk_insert_test();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "cluster") == 0) {
+        test::cluster_test();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "reconnect") == 0) {
+        test::reconnect_test();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "metrics") == 0) {
+        test::metrics_test();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "transaction") == 0) {
+        test::transaction_test();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "retry") == 0) {
+        test::retry_test();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "mock") == 0) {
+        return test::mock_test() == 0 ? 0 : 1;
+    }
     test::mysql_test();
     return 0;
 }
\ No newline at end of file